@@ -29,22 +29,10 @@
 #include <SDL_net.h>
 #include <iostream>
 #include <math.h>
+#include "NetworkConnection.h"
 
-enum message_type {
-  message_type_ping = 60000,
-  message_type_connect,
-  message_type_requestHost,
-  message_type_startHost,
-  message_type_checkHost,
-  message_type_foundHost,
-  message_type_noHost,
-  message_type_holePunched,
-  message_type_quit,
-  message_type_systemState,
-  message_type_newGame,
-
-  message_type_check = 65535
-};
+// Offset of the word in a traced data packet's trace block that the server writes the time it held the packet into
+#define NET_TRACE_SERVER_WORD (NET_DATA_HEADER + NET_TRACE_SIZE - 4)
 
 enum client_status {
   client_status_inGame,
@@ -173,6 +161,7 @@ int main(int argc, char **argv)
     if (SDLNet_UDP_Recv(sd, packet))
     {
       // Packet received
+      Uint64 receivedAt = SDL_GetPerformanceCounter();
       char buf[4];
       memcpy(buf, packet->data, 4);
 
@@ -334,11 +323,26 @@ int main(int argc, char **argv)
               printf("sending re-confirmation to client\n\n");
             }
           }
-          else if (packID < 10000 || packID == message_type_check)
+          else if ((packID & NET_PACKET_DATA) || packID == message_type_check
+            || (packID == message_type_ping && packet->len >= 8))
           {
-            // Relay packets to partner
+            // Relay packets to partner, including replies to check packets used to measure round trip times
             if (cl->partner != NULL)
             {
+              // Tell traced packets how long they were held here, at least 1us to show they were relayed
+              if ((packID & NET_PACKET_DATA) && (packID & NET_FLAG_TRACED)
+                && packet->len >= NET_TRACE_SERVER_WORD + 4)
+              {
+                Uint64 held = (SDL_GetPerformanceCounter() - receivedAt) * 1000000 / SDL_GetPerformanceFrequency();
+                if (held < 1)
+                  held = 1;
+                if (held > NET_TRACE_SERVER_MASK)
+                  held = NET_TRACE_SERVER_MASK;
+
+                Uint32 word = SDLNet_Read32(&packet->data[NET_TRACE_SERVER_WORD]);
+                SDLNet_Write32((word & ~NET_TRACE_SERVER_MASK) | (Uint32)held, &packet->data[NET_TRACE_SERVER_WORD]);
+              }
+
               cl->partner->sendPacket(packet);
               printf("\nRelaying packet\n\n");
             }
@@ -0,0 +1,285 @@
+/*
+  NetBitStream: Bit-packed reading and writing of messages sent with NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NetBitStream.h"
+
+// Mask of the lowest n bits, n from 0 to 32
+static Uint32 bitMask(int bits)
+{
+  return bits >= 32 ? 0xFFFFFFFF : (1u << bits) - 1;
+}
+
+BitWriter::BitWriter(NetworkConnection* net)
+{
+  this->net = net;
+  words = NULL;
+  maxWords = 0;
+  numWords = 0;
+  scratch = 0;
+  scratchBits = 0;
+  overflow = false;
+}
+
+BitWriter::BitWriter(Uint32* words, Uint32 maxWords)
+{
+  net = NULL;
+  this->words = words;
+  this->maxWords = maxWords;
+  numWords = 0;
+  scratch = 0;
+  scratchBits = 0;
+  overflow = false;
+}
+
+int BitWriter::putWord(Uint32 word)
+{
+  if (net)
+  {
+    if (!net->writeU32(word))
+    {
+      overflow = true;
+      return 0;
+    }
+  }
+  else
+  {
+    if (numWords >= maxWords)
+    {
+      overflow = true;
+      return 0;
+    }
+    words[numWords] = word;
+  }
+
+  numWords++;
+  return 1;
+}
+
+int BitWriter::writeBits(Uint32 value, int bits)
+{
+  if (bits <= 0 || bits > 32)
+    return 0;
+
+  // scratch never holds more than 31 bits between writes, so 63 at most here
+  scratch = (scratch << bits) | (value & bitMask(bits));
+  scratchBits += bits;
+
+  if (scratchBits >= 32)
+  {
+    scratchBits -= 32;
+    Uint32 word = (Uint32)(scratch >> scratchBits);
+    scratch &= bitMask(scratchBits);
+
+    return putWord(word);
+  }
+
+  return 1;
+}
+
+int BitWriter::writeBool(bool value)
+{
+  return writeBits(value ? 1 : 0, 1);
+}
+
+int BitWriter::writeFloat(float value)
+{
+  Uint32 bits;
+  memcpy(&bits, &value, 4);
+  return writeBits(bits, 32);
+}
+
+int BitWriter::writeQuantized(float value, float min, float max, int bits)
+{
+  if (bits <= 0 || bits > 32 || max <= min)
+    return 0;
+
+  double steps = (double)bitMask(bits);
+  double t = ((double)value - min) / ((double)max - min);
+
+  if (t < 0.0 || t != t)
+    t = 0.0;
+  else if (t > 1.0)
+    t = 1.0;
+
+  return writeBits((Uint32)(t * steps + 0.5), bits);
+}
+
+int BitWriter::writeVarUint(Uint32 value)
+{
+  while (value >= 0x80)
+  {
+    if (!writeBits((value & 0x7F) | 0x80, 8))
+      return 0;
+    value >>= 7;
+  }
+
+  return writeBits(value, 8);
+}
+
+int BitWriter::writeVarInt(Sint32 value)
+{
+  // Zigzag maps 0, -1, 1, -2... to 0, 1, 2, 3... so small negative values stay small
+  return writeVarUint(((Uint32)value << 1) ^ (Uint32)(value >> 31));
+}
+
+int BitWriter::flush()
+{
+  if (scratchBits == 0)
+    return 1;
+
+  Uint32 word = (Uint32)(scratch << (32 - scratchBits));
+  scratch = 0;
+  scratchBits = 0;
+
+  return putWord(word);
+}
+
+Uint32 BitWriter::wordsWritten()
+{
+  return numWords;
+}
+
+bool BitWriter::overflowed()
+{
+  return overflow;
+}
+
+
+BitReader::BitReader(NetworkConnection* net)
+{
+  this->net = net;
+  words = NULL;
+  numWords = 0;
+  readPos = 0;
+  scratch = 0;
+  scratchBits = 0;
+  underflow = false;
+}
+
+BitReader::BitReader(const Uint32* words, Uint32 numWords)
+{
+  net = NULL;
+  this->words = words;
+  this->numWords = numWords;
+  readPos = 0;
+  scratch = 0;
+  scratchBits = 0;
+  underflow = false;
+}
+
+Uint32 BitReader::getWord()
+{
+  if (net)
+  {
+    readPos++;
+    return net->readMessage();
+  }
+
+  if (readPos >= numWords)
+  {
+    underflow = true;
+    return 0;
+  }
+
+  return words[readPos++];
+}
+
+Uint32 BitReader::readBits(int bits)
+{
+  if (bits <= 0 || bits > 32)
+    return 0;
+
+  if (scratchBits < bits)
+  {
+    // scratch holds fewer than 32 bits here so there is room for another word
+    scratch = (scratch << 32) | getWord();
+    scratchBits += 32;
+
+    if (underflow)
+      return 0;
+  }
+
+  scratchBits -= bits;
+  Uint32 value = (Uint32)(scratch >> scratchBits) & bitMask(bits);
+  scratch &= bitMask(scratchBits);
+
+  return value;
+}
+
+bool BitReader::readBool()
+{
+  return readBits(1) != 0;
+}
+
+float BitReader::readFloat()
+{
+  Uint32 bits = readBits(32);
+  float value;
+  memcpy(&value, &bits, 4);
+  return value;
+}
+
+float BitReader::readQuantized(float min, float max, int bits)
+{
+  if (bits <= 0 || bits > 32 || max <= min)
+    return min;
+
+  double steps = (double)bitMask(bits);
+  return (float)(min + ((double)max - min) * (readBits(bits) / steps));
+}
+
+Uint32 BitReader::readVarUint()
+{
+  Uint32 value = 0;
+
+  for (int shift = 0; shift < 35; shift += 7)
+  {
+    Uint32 byte = readBits(8);
+    value |= (byte & 0x7F) << shift;
+
+    if (!(byte & 0x80) || underflow)
+      break;
+  }
+
+  return value;
+}
+
+Sint32 BitReader::readVarInt()
+{
+  Uint32 value = readVarUint();
+  return (Sint32)(value >> 1) ^ -(Sint32)(value & 1);
+}
+
+void BitReader::align()
+{
+  scratch = 0;
+  scratchBits = 0;
+}
+
+Uint32 BitReader::wordsRead()
+{
+  return readPos;
+}
+
+bool BitReader::underflowed()
+{
+  return underflow;
+}
@@ -0,0 +1,145 @@
+/*
+  NetBitStream: Bit-packed reading and writing of messages sent with NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  BitWriter and BitReader pack values into as few bits as they need instead of a whole 32 bit message each.
+
+  Bits are packed most significant first into 32 bit messages, which are written with addToSendBuf and read back
+  with readMessage, or to and from an array of words. Values must be read back in the same order and with the same
+  sizes as they were written.
+
+  Floats can be sent losslessly as their IEEE bits or quantized to a fixed number of bits over a known range.
+  Integers can be sent as zigzag varints which take 8 bits for values from -64 to 63.
+  */
+
+#pragma once
+
+#include "NetworkConnection.h"
+
+class BitWriter
+{
+public:
+  // Writes messages to the send buffer of a connection
+  BitWriter(NetworkConnection* net);
+
+  // Writes messages to an array
+  // Parameters:
+  // words - the array to write to
+  // maxWords - the size of the array
+  BitWriter(Uint32* words, Uint32 maxWords);
+
+  // Writes the lowest bits of a value
+  // Parameters:
+  // value - the value to be written
+  // bits - the number of bits to write, from 1 to 32
+  // Returns 1 on success, 0 if there is no more space
+  int writeBits(Uint32 value, int bits);
+
+  // Writes a single bit
+  int writeBool(bool value);
+
+  // Writes a float losslessly as its 32 IEEE bits
+  int writeFloat(float value);
+
+  // Writes a float quantized to the given number of bits over a range, values outside the range are clamped
+  // Parameters:
+  // value - the float to be written
+  // min, max - the range of values to be sent
+  // bits - the precision in bits, from 1 to 32
+  int writeQuantized(float value, float min, float max, int bits);
+
+  // Writes an unsigned integer 7 bits at a time with a continuation bit, small values take fewer bits
+  int writeVarUint(Uint32 value);
+
+  // Writes a signed integer as a zigzag varint, small values of either sign take fewer bits
+  int writeVarInt(Sint32 value);
+
+  // Writes any partially filled message, padding it with zeros
+  // Call after the last value of a packet
+  // Returns 1 on success, 0 if there is no more space
+  int flush();
+
+  // Returns the number of whole messages written so far
+  Uint32 wordsWritten();
+
+  // Returns true if a write failed due to lack of space
+  bool overflowed();
+
+private:
+  int putWord(Uint32 word);
+
+  NetworkConnection* net;
+  Uint32* words;
+  Uint32 maxWords;
+  Uint32 numWords;
+
+  Uint64 scratch;
+  int scratchBits;
+  bool overflow;
+};
+
+class BitReader
+{
+public:
+  // Reads messages from a connection with readMessage, waiting for them to arrive if needed
+  BitReader(NetworkConnection* net);
+
+  // Reads messages from an array, such as one filled by pullMessages
+  // Parameters:
+  // words - the array to read from
+  // numWords - the number of messages in the array
+  BitReader(const Uint32* words, Uint32 numWords);
+
+  // Reads a value written with writeBits
+  // Parameters:
+  // bits - the number of bits to read, from 1 to 32
+  // Returns the value, or 0 if there was no more data
+  Uint32 readBits(int bits);
+
+  // Reads values written with the matching BitWriter functions
+  bool readBool();
+  float readFloat();
+  float readQuantized(float min, float max, int bits);
+  Uint32 readVarUint();
+  Sint32 readVarInt();
+
+  // Discards the padding at the end of a partially used message
+  // Call after the last value of a packet written with flush
+  void align();
+
+  // Returns the number of messages read so far
+  Uint32 wordsRead();
+
+  // Returns true if a read went past the end of the data
+  bool underflowed();
+
+private:
+  Uint32 getWord();
+
+  NetworkConnection* net;
+  const Uint32* words;
+  Uint32 numWords;
+  Uint32 readPos;
+
+  Uint64 scratch;
+  int scratchBits;
+  bool underflow;
+};
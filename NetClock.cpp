@@ -0,0 +1,124 @@
+/*
+  NetClock: Estimates a partner's clock from the round trips of check packets
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NetClock.h"
+
+NetClock::NetClock()
+{
+  reset();
+}
+
+void NetClock::reset()
+{
+  memset(samples, 0, sizeof(samples));
+  sampleNum = 0;
+  memset(&driftFrom, 0, sizeof(driftFrom));
+  drift = 0;
+  driftWeight = 0;
+  estimate.reset();
+}
+
+void NetClock::addSample(Uint64 sent, Uint64 remote, Uint64 received)
+{
+  if (received < sent)
+    return;
+
+  Sample *s = &samples[sampleNum % NET_CLOCK_SAMPLES];
+  s->delay = (Uint32)(received - sent);
+  s->time = sent + s->delay / 2;
+  s->offset = (Sint64)(remote - s->time);
+  sampleNum++;
+
+  // Use the sample with the shortest round trip, it spent the least time queued
+  Sample *best = &samples[0];
+  for (Uint32 i = 1; i < NET_CLOCK_SAMPLES && i < sampleNum; i++)
+  {
+    if (samples[i].delay < best->delay)
+      best = &samples[i];
+  }
+
+  // Measure the drift across the best samples of spans at least NET_CLOCK_DRIFT_INTERVAL long
+  if (!driftFrom.time)
+    driftFrom = *best;
+  else if (best->time > driftFrom.time && best->time - driftFrom.time >= NET_CLOCK_DRIFT_INTERVAL)
+  {
+    double span = (double)(best->time - driftFrom.time);
+    double measured = (double)(best->offset - driftFrom.offset) / span;
+    if (measured > NET_CLOCK_MAX_DRIFT / 1000000.0)
+      measured = NET_CLOCK_MAX_DRIFT / 1000000.0;
+    if (measured < -NET_CLOCK_MAX_DRIFT / 1000000.0)
+      measured = -NET_CLOCK_MAX_DRIFT / 1000000.0;
+
+    // Each measurement is out by up to the two samples' errors over the span, so measurements are weighted by
+    // how precise they are, with older ones counting for less so changes in drift are followed
+    double uncertainty = (best->delay + driftFrom.delay) / 2.0 / span + 0.000001;
+    double weight = 1.0 / (uncertainty * uncertainty);
+    driftWeight *= 0.9;
+    drift = (drift * driftWeight + measured * weight) / (driftWeight + weight);
+    driftWeight += weight;
+    driftFrom = *best;
+  }
+
+  Estimate *e = estimate.beginWrite();
+  e->offset = best->offset;
+  e->time = best->time;
+  e->drift = drift;
+  e->error = best->delay / 2;
+  e->samples = sampleNum;
+  estimate.endWrite();
+}
+
+Uint64 NetClock::remoteTime(Uint64 local)
+{
+  Estimate e;
+  estimate.read(&e);
+
+  if (!e.samples)
+    return local;
+
+  Sint64 age = (Sint64)(local - e.time);
+
+  return local + e.offset + (Sint64)(e.drift * age);
+}
+
+bool NetClock::isSynced()
+{
+  Estimate e;
+  estimate.read(&e);
+
+  return e.samples > 0;
+}
+
+Uint32 NetClock::getError()
+{
+  Estimate e;
+  estimate.read(&e);
+
+  return e.error;
+}
+
+float NetClock::getDrift()
+{
+  Estimate e;
+  estimate.read(&e);
+
+  return (float)(e.drift * 1000000.0);
+}
@@ -0,0 +1,105 @@
+/*
+  NetClock: Estimates a partner's clock from the round trips of check packets
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  Works the same way as NTP. Each reply to a check packet carries the time on the partner's clock when it was
+  sent. Assuming the reply was sent halfway through the round trip, the offset between the clocks is the partner's
+  time less the midpoint of the local send and receive times. The error is at most half the round trip.
+
+  Queuing only ever delays packets, so of the last few samples the one with the shortest round trip is the most
+  accurate and is the one used. Clocks tick at slightly different rates, so the drift is measured from how the
+  offset changes over longer spans and the offset is carried forward along it between samples.
+
+  Samples are added by the network thread and the estimate is read by any thread without locking.
+  */
+
+#pragma once
+
+#include "SDL.h"
+#include "NetStats.h"
+
+// Number of recent samples the one with the shortest round trip is chosen from
+#define NET_CLOCK_SAMPLES 8
+
+// Shortest time in microseconds between the samples the drift is measured across
+#define NET_CLOCK_DRIFT_INTERVAL 10000000
+
+// Largest drift believed, in parts per million, anything more is taken to be noise
+#define NET_CLOCK_MAX_DRIFT 500
+
+class NetClock
+{
+public:
+  NetClock();
+
+  // Forgets all samples, as when a new partner is found
+  // Only call from the network thread
+  void reset();
+
+  // Adds a measurement of the partner's clock
+  // Only call from the network thread
+  // Parameters:
+  // sent - the local time in microseconds the check packet was sent
+  // remote - the partner's time in microseconds when it replied
+  // received - the local time in microseconds the reply arrived
+  void addSample(Uint64 sent, Uint64 remote, Uint64 received);
+
+  // Converts a local time to the partner's clock
+  // Parameters:
+  // local - a time in microseconds from netMicros
+  // Returns the partner's time in microseconds, the local time unchanged until a sample has been taken
+  Uint64 remoteTime(Uint64 local);
+
+  // Returns true once at least one sample has been taken
+  bool isSynced();
+
+  // Returns the most the estimate can be out by in microseconds, half the round trip of the sample used
+  Uint32 getError();
+
+  // Returns how fast the partner's clock runs compared to the local one in parts per million
+  float getDrift();
+
+private:
+  struct Sample {
+    Sint64 offset;
+    Uint64 time;
+    Uint32 delay;
+  };
+
+  // The estimate read by remoteTime, the offset at a local time and the drift to carry it forward with
+  struct Estimate {
+    Sint64 offset;
+    Uint64 time;
+    double drift;
+    Uint32 error;
+    Uint32 samples;
+  };
+
+  // Only touched by the network thread, driftFrom is the sample the drift is next measured from and driftWeight
+  // the total weight of the measurements the drift is made up of
+  Sample samples[NET_CLOCK_SAMPLES];
+  Uint32 sampleNum;
+  Sample driftFrom;
+  double drift;
+  double driftWeight;
+
+  NetSeqLock<Estimate> estimate;
+};
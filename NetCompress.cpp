@@ -0,0 +1,340 @@
+/*
+  NetCompress: Fast compression of packet payloads against a shared dictionary
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetCompress.h"
+#include "NetHash.h"
+#include "string.h"
+#include "stdlib.h"
+
+// Shortest match worth sending, anything shorter costs more than the literal bytes
+#define NET_COMPRESS_MIN_MATCH 4
+
+// Length of the runs trainDictionary counts
+#define NET_COMPRESS_TRAIN_RUN 16
+
+static Uint32 read32(const Uint8 *p)
+{
+  Uint32 v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static Uint32 hashSequence(Uint32 v)
+{
+  return (v * 2654435761U) >> 21 & (NET_COMPRESS_TABLE - 1);
+}
+
+// Writes the part of a length that does not fit in its 4 bits of the token, as bytes of 255 and then the rest
+static Uint8* writeLength(Uint8 *op, Uint32 len)
+{
+  len -= 15;
+  while (len >= 255)
+  {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (Uint8)len;
+
+  return op;
+}
+
+NetCompressor::NetCompressor()
+{
+  setDictionary(NULL, 0);
+}
+
+void NetCompressor::setDictionary(const void *dictionary, Uint32 len)
+{
+  const Uint8 *bytes = (const Uint8*)dictionary;
+
+  if (!bytes)
+    len = 0;
+  if (len > NET_COMPRESS_MAX_DICT)
+  {
+    bytes += len - NET_COMPRESS_MAX_DICT;
+    len = NET_COMPRESS_MAX_DICT;
+  }
+
+  dictLen = len;
+  if (len)
+  {
+    memcpy(compressWindow, bytes, len);
+    memcpy(decompressWindow, bytes, len);
+  }
+
+  dictID = netHashBytes(bytes, len, 0x4c5a3401);
+  if (!dictID)
+    dictID = 1;
+
+  // Later positions overwrite earlier ones so matches are as close as possible
+  memset(dictTable, 0xFF, sizeof(dictTable));
+  for (Uint32 i = 0; i + NET_COMPRESS_MIN_MATCH <= len; i++)
+    dictTable[hashSequence(read32(&compressWindow[i]))] = (Uint16)i;
+}
+
+Uint32 NetCompressor::getDictionaryID()
+{
+  return dictID;
+}
+
+// Each sequence is a token byte holding the number of literals in its high 4 bits and the match length less
+// NET_COMPRESS_MIN_MATCH in its low 4 bits, either extended by writeLength when it is 15
+// The literals follow, then the match's distance back as 2 little endian bytes
+// The last sequence has only literals and ends the data
+int NetCompressor::compress(const Uint8 *src, int len, Uint8 *dst, int cap)
+{
+  if (len <= 0 || len > NET_COMPRESS_MAX_INPUT)
+    return 0;
+
+  Uint8 *window = compressWindow;
+  memcpy(&window[dictLen], src, len);
+  memcpy(table, dictTable, sizeof(table));
+
+  // Give up as soon as the output reaches the input's size, leaving room for one sequence to be written
+  Uint32 limit = cap < len ? cap : len;
+  if (limit < 16)
+    return 0;
+  Uint8 *op = dst;
+  Uint8 *opEnd = dst + limit - 8;
+
+  Uint32 end = dictLen + len;
+  Uint32 ip = dictLen;
+  Uint32 anchor = ip;
+
+  while (ip + NET_COMPRESS_MIN_MATCH <= end)
+  {
+    Uint32 seq = read32(&window[ip]);
+    Uint32 h = hashSequence(seq);
+    Uint32 ref = table[h];
+    table[h] = (Uint16)ip;
+
+    if (ref == 0xFFFF || ref >= ip || read32(&window[ref]) != seq)
+    {
+      ip++;
+      continue;
+    }
+
+    Uint32 matchLen = NET_COMPRESS_MIN_MATCH;
+    while (ip + matchLen < end && window[ref + matchLen] == window[ip + matchLen])
+      matchLen++;
+
+    Uint32 literals = ip - anchor;
+    if (op + literals + literals / 255 > opEnd)
+      return 0;
+
+    Uint8 *token = op++;
+    *token = (Uint8)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+      op = writeLength(op, literals);
+    memcpy(op, &window[anchor], literals);
+    op += literals;
+
+    Uint32 offset = ip - ref;
+    *op++ = (Uint8)offset;
+    *op++ = (Uint8)(offset >> 8);
+
+    Uint32 extra = matchLen - NET_COMPRESS_MIN_MATCH;
+    *token |= (Uint8)(extra < 15 ? extra : 15);
+    if (extra >= 15)
+      op = writeLength(op, extra);
+
+    ip += matchLen;
+    anchor = ip;
+  }
+
+  Uint32 literals = end - anchor;
+  if (op + 1 + literals + literals / 255 + 1 > dst + limit - 1)
+    return 0;
+
+  Uint8 *token = op++;
+  *token = (Uint8)((literals < 15 ? literals : 15) << 4);
+  if (literals >= 15)
+    op = writeLength(op, literals);
+  memcpy(op, &window[anchor], literals);
+  op += literals;
+
+  return (int)(op - dst);
+}
+
+int NetCompressor::decompress(const Uint8 *src, int len, Uint8 *dst, int cap)
+{
+  if (cap > NET_COMPRESS_MAX_INPUT)
+    cap = NET_COMPRESS_MAX_INPUT;
+
+  Uint8 *window = decompressWindow;
+  Uint32 op = dictLen;
+  Uint32 opEnd = dictLen + cap;
+  int ip = 0;
+
+  while (ip < len)
+  {
+    Uint8 token = src[ip++];
+
+    Uint32 literals = token >> 4;
+    if (literals == 15)
+    {
+      Uint8 b;
+      do
+      {
+        if (ip >= len)
+          return -1;
+        b = src[ip++];
+        literals += b;
+      } while (b == 255);
+    }
+
+    if (literals > (Uint32)(len - ip) || literals > opEnd - op)
+      return -1;
+
+    memcpy(&window[op], &src[ip], literals);
+    ip += literals;
+    op += literals;
+
+    // The last sequence has no match
+    if (ip == len)
+      break;
+
+    if (ip + 2 > len)
+      return -1;
+
+    Uint32 offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+
+    Uint32 matchLen = (token & 15) + NET_COMPRESS_MIN_MATCH;
+    if ((token & 15) == 15)
+    {
+      Uint8 b;
+      do
+      {
+        if (ip >= len)
+          return -1;
+        b = src[ip++];
+        matchLen += b;
+      } while (b == 255);
+    }
+
+    if (matchLen > opEnd - op)
+      return -1;
+
+    // Byte by byte where the match overlaps what it is writing, repeating its first offset bytes
+    Uint32 ref = op - offset;
+    if (offset >= matchLen)
+      memcpy(&window[op], &window[ref], matchLen);
+    else
+    {
+      for (Uint32 i = 0; i < matchLen; i++)
+        window[op + i] = window[ref + i];
+    }
+    op += matchLen;
+  }
+
+  Uint32 size = op - dictLen;
+  memcpy(dst, &window[dictLen], size);
+
+  return (int)size;
+}
+
+struct TrainRun {
+  Uint32 pos;
+  Uint32 count;
+};
+
+static int compareRuns(const void *a, const void *b)
+{
+  const TrainRun *ra = (const TrainRun*)a;
+  const TrainRun *rb = (const TrainRun*)b;
+
+  if (ra->count != rb->count)
+    return ra->count < rb->count ? 1 : -1;
+
+  return ra->pos < rb->pos ? -1 : ra->pos > rb->pos;
+}
+
+Uint32 NetCompressor::trainDictionary(const Uint8 *samples, Uint32 len, Uint8 *dictionary, Uint32 cap)
+{
+  if (cap > NET_COMPRESS_MAX_DICT)
+    cap = NET_COMPRESS_MAX_DICT;
+  if (!samples || len < NET_COMPRESS_TRAIN_RUN || cap < NET_COMPRESS_TRAIN_RUN)
+    return 0;
+
+  // Count the runs starting on each word, in an open addressed table at most half full
+  Uint32 runNum = (len - NET_COMPRESS_TRAIN_RUN) / 4 + 1;
+  Uint32 size = 16;
+  while (size < runNum * 2)
+    size *= 2;
+
+  TrainRun *runs = new TrainRun[size];
+  memset(runs, 0xFF, size * sizeof(TrainRun));
+
+  for (Uint32 p = 0; p + NET_COMPRESS_TRAIN_RUN <= len; p += 4)
+  {
+    Uint32 slot = netHashBytes(&samples[p], NET_COMPRESS_TRAIN_RUN) & (size - 1);
+
+    while (runs[slot].pos != 0xFFFFFFFF
+      && memcmp(&samples[runs[slot].pos], &samples[p], NET_COMPRESS_TRAIN_RUN) != 0)
+    {
+      slot = (slot + 1) & (size - 1);
+    }
+
+    if (runs[slot].pos == 0xFFFFFFFF)
+    {
+      runs[slot].pos = p;
+      runs[slot].count = 1;
+    }
+    else
+      runs[slot].count++;
+  }
+
+  // Most common first, runs seen once are no use
+  Uint32 kept = 0;
+  for (Uint32 i = 0; i < size; i++)
+  {
+    if (runs[i].pos != 0xFFFFFFFF && runs[i].count > 1)
+      runs[kept++] = runs[i];
+  }
+  qsort(runs, kept, sizeof(TrainRun), compareRuns);
+
+  // Fill from the end, skipping runs already in the dictionary
+  Uint32 start = cap;
+  for (Uint32 i = 0; i < kept && start >= NET_COMPRESS_TRAIN_RUN; i++)
+  {
+    const Uint8 *run = &samples[runs[i].pos];
+
+    bool found = false;
+    for (Uint32 d = start; d + NET_COMPRESS_TRAIN_RUN <= cap && !found; d++)
+      found = memcmp(&dictionary[d], run, NET_COMPRESS_TRAIN_RUN) == 0;
+
+    if (found)
+      continue;
+
+    start -= NET_COMPRESS_TRAIN_RUN;
+    memcpy(&dictionary[start], run, NET_COMPRESS_TRAIN_RUN);
+  }
+
+  delete[] runs;
+
+  memmove(dictionary, &dictionary[start], cap - start);
+
+  return cap - start;
+}
@@ -0,0 +1,100 @@
+/*
+  NetCompress: Fast compression of packet payloads against a shared dictionary
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  Packets are compressed in the style of LZ4, as runs of literal bytes each followed by a copy of earlier bytes
+  given by how far back they start and how long they are. Matches are found through a table of where each 4 byte
+  sequence was last seen, with no searching, so compressing a packet takes around a microsecond.
+
+  A single packet is too short to repeat itself much, so matches can also reach back into a dictionary shared by
+  both players, a few kilobytes of the kind of data the game sends. Entity IDs, message types and values that
+  change little then cost a few bytes each. trainDictionary builds one from recorded traffic.
+
+  The compressor and decompressor each keep a window of the dictionary followed by the packet being worked on,
+  so a NetCompressor can compress on one thread and decompress on another at the same time.
+  */
+
+#pragma once
+
+#include "SDL.h"
+
+// Largest packet that can be compressed, the same as NET_MAX_PACKET_SIZE
+#define NET_COMPRESS_MAX_INPUT 512
+
+// Largest dictionary, matches reach back at most this far before the start of a packet
+#define NET_COMPRESS_MAX_DICT 4096
+
+// Number of entries in the table of 4 byte sequences, must be a power of 2
+#define NET_COMPRESS_TABLE 2048
+
+class NetCompressor
+{
+public:
+  NetCompressor();
+
+  // Sets the dictionary, which must be the same for both players
+  // Parameters:
+  // dictionary - the dictionary bytes, NULL for none
+  // len - the number of bytes, only the last NET_COMPRESS_MAX_DICT are used
+  void setDictionary(const void *dictionary, Uint32 len);
+
+  // Returns an ID for the dictionary, the same for players with the same dictionary and never 0
+  Uint32 getDictionaryID();
+
+  // Compresses data
+  // Parameters:
+  // src - the data to compress, up to NET_COMPRESS_MAX_INPUT bytes
+  // len - the number of bytes
+  // dst - receives the compressed data
+  // cap - the space at dst
+  // Returns the compressed length, or 0 if it would not be smaller than len
+  int compress(const Uint8 *src, int len, Uint8 *dst, int cap);
+
+  // Decompresses data written by compress with the same dictionary
+  // Parameters:
+  // src - the compressed data
+  // len - the number of bytes
+  // dst - receives the data
+  // cap - the space at dst, up to NET_COMPRESS_MAX_INPUT bytes
+  // Returns the decompressed length, or -1 if the data is damaged or does not fit
+  int decompress(const Uint8 *src, int len, Uint8 *dst, int cap);
+
+  // Builds a dictionary from a recording of packet payloads
+  // The most common 16 byte runs are kept, the most common of all at the end where they are quickest to reach
+  // Parameters:
+  // samples - the recorded payloads one after another
+  // len - the number of bytes recorded
+  // dictionary - receives the dictionary
+  // cap - the largest dictionary wanted, up to NET_COMPRESS_MAX_DICT
+  // Returns the length of the dictionary
+  static Uint32 trainDictionary(const Uint8 *samples, Uint32 len, Uint8 *dictionary, Uint32 cap);
+
+private:
+  Uint32 dictLen;
+  Uint32 dictID;
+
+  // Windows hold the dictionary followed by the packet, and dictTable the table positions within the dictionary
+  Uint8 compressWindow[NET_COMPRESS_MAX_DICT + NET_COMPRESS_MAX_INPUT];
+  Uint8 decompressWindow[NET_COMPRESS_MAX_DICT + NET_COMPRESS_MAX_INPUT];
+  Uint16 dictTable[NET_COMPRESS_TABLE];
+  Uint16 table[NET_COMPRESS_TABLE];
+};
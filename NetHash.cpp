@@ -0,0 +1,147 @@
+/*
+  NetHash: Fast hashing of game state for sync checks
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetHash.h"
+#include "string.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define NET_HASH_X86
+#include <nmmintrin.h>
+
+// Lets the SSE4.2 functions be built without the whole program needing it, they only run where it is supported
+#if defined(__GNUC__) || defined(__clang__)
+#define NET_HASH_SSE42 __attribute__((target("sse4.2")))
+#else
+#define NET_HASH_SSE42
+#endif
+#endif
+
+// Tables for the CRC32C polynomial, crcTable[0] steps a byte and crcTable[n] a byte followed by n zero bytes,
+// so a word is stepped with one lookup per byte
+static Uint32 crcTable[4][256];
+
+static bool buildTables()
+{
+  for (Uint32 i = 0; i < 256; i++)
+  {
+    Uint32 crc = i;
+    for (int b = 0; b < 8; b++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    crcTable[0][i] = crc;
+  }
+
+  for (Uint32 i = 0; i < 256; i++)
+  {
+    for (int n = 1; n < 4; n++)
+      crcTable[n][i] = (crcTable[n - 1][i] >> 8) ^ crcTable[0][crcTable[n - 1][i] & 0xff];
+  }
+
+#ifdef NET_HASH_X86
+  return SDL_HasSSE42() == SDL_TRUE;
+#else
+  return false;
+#endif
+}
+
+// Built when the program starts, before any thread can hash
+static bool useSSE42 = buildTables();
+
+static Uint32 stepWord(Uint32 crc, Uint32 word)
+{
+  crc ^= word;
+
+  return crcTable[3][crc & 0xff] ^ crcTable[2][(crc >> 8) & 0xff] ^ crcTable[1][(crc >> 16) & 0xff]
+    ^ crcTable[0][crc >> 24];
+}
+
+#ifdef NET_HASH_X86
+// x86 is little endian, so pairs of words in memory are hashed as one 64 bit value the same as one at a time
+NET_HASH_SSE42 static Uint32 hashSSE42(Uint32 crc, const Uint8 *data, Uint32 len)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  Uint64 crc64 = crc;
+  while (len >= 8)
+  {
+    Uint64 v;
+    memcpy(&v, data, 8);
+    crc64 = _mm_crc32_u64(crc64, v);
+    data += 8;
+    len -= 8;
+  }
+  crc = (Uint32)crc64;
+#endif
+
+  while (len >= 4)
+  {
+    Uint32 v;
+    memcpy(&v, data, 4);
+    crc = _mm_crc32_u32(crc, v);
+    data += 4;
+    len -= 4;
+  }
+
+  while (len > 0)
+  {
+    crc = _mm_crc32_u8(crc, *data);
+    data++;
+    len--;
+  }
+
+  return crc;
+}
+#endif
+
+Uint32 netHashWords(const Uint32 *words, Uint32 count, Uint32 seed)
+{
+  Uint32 crc = ~seed;
+
+#ifdef NET_HASH_X86
+  if (useSSE42)
+    return ~hashSSE42(crc, (const Uint8*)words, count * 4);
+#endif
+
+  for (Uint32 i = 0; i < count; i++)
+    crc = stepWord(crc, words[i]);
+
+  return ~crc;
+}
+
+Uint32 netHashBytes(const void *data, Uint32 len, Uint32 seed)
+{
+  Uint32 crc = ~seed;
+  const Uint8 *bytes = (const Uint8*)data;
+
+#ifdef NET_HASH_X86
+  if (useSSE42)
+    return ~hashSSE42(crc, bytes, len);
+#endif
+
+  for (Uint32 i = 0; i < len; i++)
+    crc = (crc >> 8) ^ crcTable[0][(crc ^ bytes[i]) & 0xff];
+
+  return ~crc;
+}
+
+bool netHashAccelerated()
+{
+  return useSSE42;
+}
@@ -0,0 +1,53 @@
+/*
+  NetHash: Fast hashing of game state for sync checks
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  Hashes are CRC32C, which x86 processors with SSE4.2 work out in hardware 8 bytes at a time. Elsewhere a table
+  driven version is used that works through a word at a time. Both give the same results, so players on
+  different machines can compare hashes.
+
+  Hashes can be worked out in parts, passing the hash of everything before as the seed of the next part, so a
+  state can be hashed as it is written or kept in chunks where only the changed ones are hashed again, as
+  StateSync does.
+  */
+
+#pragma once
+
+#include "SDL.h"
+
+// Returns the hash of a run of 32 bit words
+// Each word is hashed by value, so the result is the same on big and little endian machines
+// Parameters:
+// words - the words to hash
+// count - the number of words
+// seed - the hash of any words before these, or 0 to start a new hash
+Uint32 netHashWords(const Uint32 *words, Uint32 count, Uint32 seed = 0);
+
+// Returns the hash of a run of bytes as they are laid out in memory
+// Parameters:
+// data - the bytes to hash
+// len - the number of bytes
+// seed - the hash of any bytes before these, or 0 to start a new hash
+Uint32 netHashBytes(const void *data, Uint32 len, Uint32 seed = 0);
+
+// Returns true if hashes are worked out by the processor's CRC32 instruction
+bool netHashAccelerated();
@@ -0,0 +1,346 @@
+/*
+  NetInputSync: Lockstep and rollback exchange of player inputs over a NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NetInputSync.h"
+
+// Value of rollbackFrom when no prediction has been found wrong
+#define NET_INPUT_NO_ROLLBACK 0xFFFFFFFF
+
+InputSync::InputSync(int inputSize)
+{
+  if (inputSize < 1)
+    inputSize = 1;
+  if (inputSize > NET_INPUT_MAX_SIZE)
+    inputSize = NET_INPUT_MAX_SIZE;
+
+  this->inputSize = inputSize;
+
+  localInputs = new Uint32[NET_INPUT_HISTORY * inputSize];
+  remoteInputs = new Uint32[NET_INPUT_HISTORY * inputSize];
+  predicted = new Uint32[NET_INPUT_HISTORY * inputSize];
+
+  // Room for the header and every input in the history along with its changed bit
+  encodeSize = 4 + NET_INPUT_HISTORY * (inputSize + 1);
+  encodeBuf = new Uint32[encodeSize];
+
+  // Most inputs that fit in a packet with every one changed, after the three varints starting the message
+  // Counted on a packet with a trace block and an order word, so the limit holds on any channel
+  Uint32 packetBits = (NET_MAX_PACKET_SIZE - NET_DATA_HEADER - NET_TRACE_SIZE - 4) * 8 - 3 * 40;
+  packetInputs = packetBits / (inputSize * 32 + 1);
+
+  inputDelay = 2;
+  redundancy = NET_INPUT_REDUNDANCY;
+  maxRollback = 0;
+  memset(&callbacks, 0, sizeof(callbacks));
+
+  reset(false);
+}
+
+InputSync::~InputSync()
+{
+  delete[] localInputs;
+  delete[] remoteInputs;
+  delete[] predicted;
+  delete[] encodeBuf;
+}
+
+void InputSync::reset(bool isHost)
+{
+  host = isHost;
+
+  // The ticks before the first input takes effect run with empty inputs, they are sent like any others
+  memset(localInputs, 0, NET_INPUT_HISTORY * inputSize * 4);
+  localNext = inputDelay;
+  partnerAck = 0;
+
+  memset(remoteInputs, 0, NET_INPUT_HISTORY * inputSize * 4);
+  memset(remoteTicks, 0, sizeof(remoteTicks));
+  remoteNext = 0;
+  memset(predicted, 0, NET_INPUT_HISTORY * inputSize * 4);
+
+  simTick = 0;
+  rollbackFrom = NET_INPUT_NO_ROLLBACK;
+  rollbacks = 0;
+}
+
+void InputSync::setCallbacks(const InputSyncCallbacks *callbacks)
+{
+  this->callbacks = *callbacks;
+}
+
+void InputSync::setInputDelay(Uint32 ticks)
+{
+  inputDelay = ticks < NET_INPUT_HISTORY / 4 ? ticks : NET_INPUT_HISTORY / 4;
+}
+
+void InputSync::setRedundancy(Uint32 ticks)
+{
+  if (ticks < 1)
+    ticks = 1;
+  if (ticks > NET_INPUT_HISTORY)
+    ticks = NET_INPUT_HISTORY;
+
+  redundancy = ticks;
+}
+
+void InputSync::setRollback(Uint32 maxTicks)
+{
+  maxRollback = maxTicks < NET_INPUT_HISTORY / 4 ? maxTicks : NET_INPUT_HISTORY / 4;
+}
+
+Uint32 InputSync::delayFor(NetworkConnection* net, Uint32 tickMicros)
+{
+  NetStats stats;
+  net->getStats(&stats);
+
+  if (!tickMicros)
+    return 1;
+
+  // Inputs are late by the one-way delay, plus the jitter so most arrive in time
+  Uint32 rtt = stats.rttP50 ? stats.rttP50 : stats.rttSmoothed;
+  Uint32 ticks = (rtt / 2 + stats.jitter + tickMicros - 1) / tickMicros;
+
+  if (ticks < 1)
+    ticks = 1;
+  if (ticks > NET_INPUT_HISTORY / 4)
+    ticks = NET_INPUT_HISTORY / 4;
+
+  return ticks;
+}
+
+Uint32* InputSync::localInput(Uint32 tick)
+{
+  return &localInputs[(tick & (NET_INPUT_HISTORY - 1)) * inputSize];
+}
+
+Uint32* InputSync::remoteInput(Uint32 tick)
+{
+  return &remoteInputs[(tick & (NET_INPUT_HISTORY - 1)) * inputSize];
+}
+
+int InputSync::addLocalInput(const Uint32* input)
+{
+  // Hold back while the game is waiting on the partner, or the oldest unacknowledged input would be overwritten
+  if (localNext > simTick + inputDelay || localNext - partnerAck >= NET_INPUT_HISTORY)
+    return 0;
+
+  memcpy(localInput(localNext), input, inputSize * 4);
+  localNext++;
+
+  return 1;
+}
+
+int InputSync::write(NetworkConnection* net)
+{
+  // Send the inputs the partner has not acknowledged from the oldest, as the partner cannot move past a tick
+  // until its input has arrived, up to redundancy of them and no more than fit in a packet
+  Uint32 from = partnerAck;
+  Uint32 count = localNext - from;
+  if (count > redundancy)
+    count = redundancy;
+  if (count > packetInputs)
+    count = packetInputs;
+
+  BitWriter writer(encodeBuf, encodeSize);
+
+  writer.writeVarUint(from);
+  writer.writeVarUint(count);
+  writer.writeVarUint(remoteNext);
+
+  // Inputs often stay the same from tick to tick, so after the first each is a bit saying whether it changed
+  for (Uint32 i = 0; i < count; i++)
+  {
+    const Uint32* input = localInput(from + i);
+
+    if (i > 0)
+    {
+      bool changed = memcmp(input, localInput(from + i - 1), inputSize * 4) != 0;
+      writer.writeBool(changed);
+      if (!changed)
+        continue;
+    }
+
+    for (int w = 0; w < inputSize; w++)
+      writer.writeBits(input[w], 32);
+  }
+
+  writer.flush();
+
+  if (writer.overflowed())
+    return 0;
+
+  Uint32 size = writer.wordsWritten();
+  char* buf = net->reserve(size * 4);
+  if (!buf)
+    return 0;
+
+  for (Uint32 i = 0; i < size; i++)
+    SDLNet_Write32(encodeBuf[i], &buf[i * 4]);
+
+  return 1;
+}
+
+int InputSync::read(NetworkConnection* net)
+{
+  BitReader reader(net);
+  return read(&reader);
+}
+
+int InputSync::read(BitReader* reader)
+{
+  Uint32 from = reader->readVarUint();
+  Uint32 count = reader->readVarUint();
+  Uint32 ack = reader->readVarUint();
+
+  if (count > NET_INPUT_HISTORY)
+    return 0;
+
+  // Decode the whole message before using any of it so a damaged one is dropped, encodeBuf is only used by write
+  Uint32* decoded = encodeBuf;
+
+  for (Uint32 i = 0; i < count; i++)
+  {
+    Uint32* input = &decoded[i * inputSize];
+
+    if (i > 0 && !reader->readBool())
+    {
+      memcpy(input, &decoded[(i - 1) * inputSize], inputSize * 4);
+      continue;
+    }
+
+    for (int w = 0; w < inputSize; w++)
+      input[w] = reader->readBits(32);
+  }
+
+  reader->align();
+
+  if (reader->underflowed())
+    return 0;
+
+  for (Uint32 i = 0; i < count; i++)
+    receiveInput(from + i, &decoded[i * inputSize]);
+
+  if (ack > partnerAck && ack <= localNext)
+    partnerAck = ack;
+
+  return 1;
+}
+
+// Stores an input from the partner and moves remoteNext past any run of inputs now complete
+// Where a tick was already run on a prediction that turned out wrong, it is marked to be rolled back to
+void InputSync::receiveInput(Uint32 tick, const Uint32* input)
+{
+  // The slot before remoteNext is kept to predict from
+  if (tick < remoteNext || tick >= remoteNext + NET_INPUT_HISTORY - 1)
+    return;
+
+  memcpy(remoteInput(tick), input, inputSize * 4);
+  remoteTicks[tick & (NET_INPUT_HISTORY - 1)] = tick + 1;
+
+  while (remoteTicks[remoteNext & (NET_INPUT_HISTORY - 1)] == remoteNext + 1)
+  {
+    if (remoteNext < simTick && remoteNext < rollbackFrom
+      && memcmp(remoteInput(remoteNext), &predicted[(remoteNext & (NET_INPUT_HISTORY - 1)) * inputSize],
+      inputSize * 4) != 0)
+    {
+      rollbackFrom = remoteNext;
+    }
+
+    remoteNext++;
+  }
+}
+
+// Runs the next tick, predicting the partner will repeat its last input if its input has not arrived
+void InputSync::runTick()
+{
+  const Uint32* local = localInput(simTick);
+  const Uint32* remote;
+
+  if (simTick < remoteNext)
+    remote = remoteInput(simTick);
+  else
+  {
+    Uint32* guess = &predicted[(simTick & (NET_INPUT_HISTORY - 1)) * inputSize];
+    if (remoteNext > 0)
+      memcpy(guess, remoteInput(remoteNext - 1), inputSize * 4);
+    else
+      memset(guess, 0, inputSize * 4);
+    remote = guess;
+
+    callbacks.saveState(simTick, callbacks.userData);
+  }
+
+  if (host)
+    callbacks.advance(simTick, local, remote, callbacks.userData);
+  else
+    callbacks.advance(simTick, remote, local, callbacks.userData);
+
+  simTick++;
+}
+
+int InputSync::update()
+{
+  if (!callbacks.advance)
+    return 0;
+
+  bool canRollback = callbacks.saveState && callbacks.loadState;
+  Uint32 ahead = canRollback ? maxRollback : 0;
+
+  // Go back to the first wrong prediction and run the ticks since again with what is now known
+  if (rollbackFrom < simTick)
+  {
+    Uint32 end = simTick;
+
+    callbacks.loadState(rollbackFrom, callbacks.userData);
+    simTick = rollbackFrom;
+    rollbacks++;
+
+    while (simTick < end)
+      runTick();
+  }
+
+  rollbackFrom = NET_INPUT_NO_ROLLBACK;
+
+  // In lockstep ahead is 0 and ticks only run once the partner's input is known
+  int run = 0;
+  while (simTick < localNext && simTick < remoteNext + ahead)
+  {
+    runTick();
+    run++;
+  }
+
+  return run;
+}
+
+Uint32 InputSync::getTick()
+{
+  return simTick;
+}
+
+Uint32 InputSync::getConfirmedTick()
+{
+  return remoteNext < simTick ? remoteNext : simTick;
+}
+
+Uint32 InputSync::getRollbacks()
+{
+  return rollbacks;
+}
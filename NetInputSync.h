@@ -0,0 +1,178 @@
+/*
+  NetInputSync: Lockstep and rollback exchange of player inputs over a NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  An InputSync runs a deterministic game from both players' inputs, one fixed size input per player per tick.
+
+  Each message carries every local input the partner has not yet acknowledged, oldest first and up to a limit,
+  along with an acknowledgement of the partner's inputs. A lost packet is covered by the next one, so messages
+  should be written on the unreliable sequenced channel and no loss ever waits a round trip for a resend. A message
+  always fits in one packet, so large inputs are sent fewer at a time, a single one for the largest.
+
+  Local inputs are scheduled a set number of ticks ahead, the input delay. In lockstep a tick runs once both
+  players' inputs for it have arrived, so with an input delay covering the one-way delay between the players
+  the game never waits, see delayFor. With rollback a tick can run ahead of the partner's input by predicting it
+  from the last input received. When the real input turns out different the game state is loaded from before
+  the mispredicted tick and the ticks since are run again, hiding the delay at the cost of the extra ticks.
+
+  Each side keeps its own InputSync. Ticks are started with addLocalInput once per tick of the shared clock and
+  run by update through the advance callback, with the host's input first on both sides.
+  */
+
+#pragma once
+
+#include "NetworkConnection.h"
+#include "NetBitStream.h"
+
+// Number of ticks of inputs kept, must be a power of 2
+#define NET_INPUT_HISTORY 128
+
+// Maximum number of 32 bit words in an input
+#define NET_INPUT_MAX_SIZE 64
+
+// Default most unacknowledged inputs sent in each message
+#define NET_INPUT_REDUNDANCY 32
+
+// Functions called by InputSync::update to run the game
+// advance runs a tick with both players' inputs and is always needed, saveState and loadState are only needed with
+// rollback and must keep a copy of the game state at the start of a tick, for at least as many ticks as the
+// rollback limit
+struct InputSyncCallbacks {
+  void (*advance)(Uint32 tick, const Uint32 *hostInput, const Uint32 *clientInput, void *userData);
+  void (*saveState)(Uint32 tick, void *userData);
+  void (*loadState)(Uint32 tick, void *userData);
+  void *userData;
+};
+
+class InputSync
+{
+public:
+  // Parameters:
+  // inputSize - the number of 32 bit words in each player's input, up to NET_INPUT_MAX_SIZE
+  InputSync(int inputSize);
+  ~InputSync();
+
+  // Clears all inputs and starts again from tick 0
+  // Call on both sides when a new game starts, after setting the input delay
+  // Parameters:
+  // isHost - true on the host, whose inputs are passed first to advance
+  void reset(bool isHost);
+
+  // Sets the functions that run the game
+  void setCallbacks(const InputSyncCallbacks *callbacks);
+
+  // Sets how many ticks ahead local inputs are scheduled, takes effect from the next reset
+  // The players do not need to use the same delay
+  // Parameters:
+  // ticks - the input delay, up to a quarter of NET_INPUT_HISTORY
+  void setInputDelay(Uint32 ticks);
+
+  // Sets the most unacknowledged inputs sent in each message, oldest first
+  // Fewer are sent when that many do not fit in a packet. Inputs past the limit wait for the older ones to be
+  // acknowledged, so it should cover the round trip and the input delay in ticks to keep up a tick per tick
+  // Parameters:
+  // ticks - the number of inputs, from 1 to NET_INPUT_HISTORY
+  void setRedundancy(Uint32 ticks);
+
+  // Sets how far ticks can run ahead of the partner's inputs, 0 for lockstep
+  // Parameters:
+  // maxTicks - the most ticks that can be run on predicted inputs, up to a quarter of NET_INPUT_HISTORY
+  void setRollback(Uint32 maxTicks);
+
+  // Returns an input delay that covers the one-way delay to the partner, from the median round trip and jitter
+  // measured by the connection
+  // Parameters:
+  // net - the connection to the partner
+  // tickMicros - the length of a tick in microseconds
+  static Uint32 delayFor(NetworkConnection* net, Uint32 tickMicros);
+
+  // Adds the local player's input for the next tick, which runs after the input delay
+  // Call once per tick, it is refused while the game is waiting on the partner so inputs do not pile up
+  // Parameters:
+  // input - the input, inputSize words
+  // Returns 1 if the input was added, 0 if the game is waiting on the partner
+  int addLocalInput(const Uint32* input);
+
+  // Writes the unacknowledged local inputs and the acknowledgement of the partner's to the send buffer
+  // The message is written as a whole or not at all
+  // Parameters:
+  // net - the connection to write to
+  // Returns 1 on success, 0 if there is not enough space left in the packet
+  int write(NetworkConnection* net);
+
+  // Reads a message written by write from the message queue
+  // Parameters:
+  // net - the connection to read from, waits for the messages if needed
+  // Returns 1 on success, 0 if the message could not be decoded
+  int read(NetworkConnection* net);
+
+  // Reads a message from a BitReader, such as one over messages from pullMessages
+  int read(BitReader* reader);
+
+  // Runs every tick whose inputs are known, or can be predicted within the rollback limit, rolling back first
+  // if a prediction was wrong
+  // Returns the number of new ticks run
+  int update();
+
+  // Returns the next tick to be run
+  Uint32 getTick();
+
+  // Returns the tick up to which the partner's inputs have all arrived, ticks before it will not be rolled back
+  Uint32 getConfirmedTick();
+
+  // Returns the number of times the game has been rolled back
+  Uint32 getRollbacks();
+
+private:
+  int inputSize;
+  bool host;
+  Uint32 inputDelay;
+  Uint32 redundancy;
+  Uint32 packetInputs;
+  Uint32 maxRollback;
+  InputSyncCallbacks callbacks;
+
+  // Local inputs are held for ticks localNext - NET_INPUT_HISTORY up to localNext, partnerAck is the tick up to
+  // which the partner has all of them
+  Uint32* localInputs;
+  Uint32 localNext;
+  Uint32 partnerAck;
+
+  // Partner inputs, remoteTicks holds each slot's tick plus 1 and remoteNext is the first tick not yet received
+  // predicted holds the inputs the partner was predicted to have for ticks run ahead of it
+  Uint32* remoteInputs;
+  Uint32 remoteTicks[NET_INPUT_HISTORY];
+  Uint32 remoteNext;
+  Uint32* predicted;
+
+  // simTick is the next tick to be run and rollbackFrom the first tick run on a wrong prediction
+  Uint32 simTick;
+  Uint32 rollbackFrom;
+  Uint32 rollbacks;
+
+  Uint32* encodeBuf;
+  Uint32 encodeSize;
+
+  Uint32* localInput(Uint32 tick);
+  Uint32* remoteInput(Uint32 tick);
+  void receiveInput(Uint32 tick, const Uint32* input);
+  void runTick();
+};
@@ -0,0 +1,217 @@
+/*
+  NetRing: Lock-free ring buffers used by NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  A fixed-size ring buffer for passing data from one thread to another without locking.
+
+  Only one thread may push and only one thread may pop. Indices run freely and are published with SDL atomics,
+  so the producer never touches the read index except to check for space and vice versa.
+
+  The size must be a power of 2.
+  */
+
+#pragma once
+
+#include "SDL.h"
+
+template <typename T, Uint32 N>
+class NetRing
+{
+public:
+  NetRing()
+  {
+    SDL_AtomicSet(&head, 0);
+    SDL_AtomicSet(&tail, 0);
+  }
+
+  // Returns the number of items waiting to be popped
+  Uint32 size()
+  {
+    return (Uint32)SDL_AtomicGet(&tail) - (Uint32)SDL_AtomicGet(&head);
+  }
+
+  // Returns the number of items that can be pushed without overwriting unread data
+  // Only call from the producing thread
+  Uint32 space()
+  {
+    return N - size();
+  }
+
+  // Returns the number of items pushed so far, wrapping at 2^32
+  // Only call from the producing thread
+  Uint32 pushed()
+  {
+    return (Uint32)SDL_AtomicGet(&tail);
+  }
+
+  // Returns the number of items popped so far, wrapping at 2^32
+  // Only call from the consuming thread
+  Uint32 popped()
+  {
+    return (Uint32)SDL_AtomicGet(&head);
+  }
+
+  // Pushes count items onto the ring
+  // Only call from the producing thread
+  // Returns 1 on success, 0 if there is not enough space for all of the items, in which case nothing is pushed
+  int push(const T* items, Uint32 count)
+  {
+    Uint32 t = (Uint32)SDL_AtomicGet(&tail);
+
+    if (N - (t - (Uint32)SDL_AtomicGet(&head)) < count)
+      return 0;
+
+    for (Uint32 i = 0; i < count; i++)
+      data[(t + i) & (N - 1)] = items[i];
+
+    // Make the items visible before the new tail
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&tail, (int)(t + count));
+
+    return 1;
+  }
+
+  // Pops up to max items off the ring into out
+  // Only call from the consuming thread
+  // Returns the number of items popped
+  Uint32 pop(T* out, Uint32 max)
+  {
+    Uint32 h = (Uint32)SDL_AtomicGet(&head);
+    Uint32 count = (Uint32)SDL_AtomicGet(&tail) - h;
+    SDL_MemoryBarrierAcquire();
+
+    if (count > max)
+      count = max;
+
+    for (Uint32 i = 0; i < count; i++)
+      out[i] = data[(h + i) & (N - 1)];
+
+    // Finish reading before the slots are handed back to the producer
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&head, (int)(h + count));
+
+    return count;
+  }
+
+private:
+  // The data sits between the indices to keep them on separate cache lines
+  SDL_atomic_t head;
+  T data[N];
+  SDL_atomic_t tail;
+};
+
+/*
+  A fixed-size ring buffer that any number of threads can push to and one thread pops from, without locking.
+
+  Each slot carries a sequence number saying whose turn it is. A producer claims a slot by advancing the tail
+  with a compare-and-swap, fills it and then publishes it by moving its sequence on, so the consumer only sees
+  slots that have been completely written.
+
+  The size must be a power of 2.
+  */
+
+template <typename T, Uint32 N>
+class NetMultiRing
+{
+public:
+  NetMultiRing()
+  {
+    SDL_AtomicSet(&head, 0);
+    SDL_AtomicSet(&tail, 0);
+
+    for (Uint32 i = 0; i < N; i++)
+      SDL_AtomicSet(&slots[i].seq, (int)i);
+  }
+
+  // Pushes an item onto the ring, from any thread
+  // Returns 1 on success, 0 if the ring is full
+  int push(const T &item)
+  {
+    Uint32 pos = (Uint32)SDL_AtomicGet(&tail);
+
+    while (true)
+    {
+      Slot *slot = &slots[pos & (N - 1)];
+      int diff = SDL_AtomicGet(&slot->seq) - (int)pos;
+
+      if (diff == 0)
+      {
+        // The slot is free, claim it unless another producer got there first
+        if (SDL_AtomicCAS(&tail, (int)pos, (int)(pos + 1)))
+        {
+          slot->data = item;
+
+          // Make the item visible before the slot is handed to the consumer
+          SDL_MemoryBarrierRelease();
+          SDL_AtomicSet(&slot->seq, (int)(pos + 1));
+          return 1;
+        }
+      }
+      else if (diff < 0)
+      {
+        // The consumer has not yet read the item a full lap behind
+        return 0;
+      }
+
+      pos = (Uint32)SDL_AtomicGet(&tail);
+    }
+  }
+
+  // Pops up to max items off the ring into out
+  // Only call from the consuming thread
+  // Returns the number of items popped
+  Uint32 pop(T* out, Uint32 max)
+  {
+    Uint32 h = (Uint32)SDL_AtomicGet(&head);
+    Uint32 count = 0;
+
+    while (count < max)
+    {
+      Slot *slot = &slots[h & (N - 1)];
+
+      // Stop at the first slot that has not been published, even if later ones have
+      if (SDL_AtomicGet(&slot->seq) != (int)(h + 1))
+        break;
+
+      SDL_MemoryBarrierAcquire();
+      out[count++] = slot->data;
+
+      // Finish reading before the slot is handed back to the producers for their next lap
+      SDL_MemoryBarrierRelease();
+      SDL_AtomicSet(&slot->seq, (int)(h + N));
+      h++;
+    }
+
+    SDL_AtomicSet(&head, (int)h);
+
+    return count;
+  }
+
+private:
+  struct Slot {
+    SDL_atomic_t seq;
+    T data;
+  };
+
+  SDL_atomic_t head;
+  Slot slots[N];
+  SDL_atomic_t tail;
+};
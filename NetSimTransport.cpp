@@ -0,0 +1,429 @@
+/*
+  NetSimTransport: An in-process network with simulated latency, loss and bandwidth limits
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetSimTransport.h"
+#include "NetworkManager.h"
+#include "string.h"
+
+NetSimNetwork::NetSimNetwork(Uint64 seed)
+{
+  this->seed = seed;
+  memset(&defaults, 0, sizeof(defaults));
+  memset(endpoints, 0, sizeof(endpoints));
+  nextPort = NET_SIM_FIRST_PORT;
+  order = 0;
+  memset(&stats, 0, sizeof(stats));
+  mut = SDL_CreateMutex();
+  cond = SDL_CreateCond();
+}
+
+NetSimNetwork::~NetSimNetwork()
+{
+  for (int i = 0; i < NET_SIM_MAX_ENDPOINTS; i++)
+    delete[] endpoints[i].inbox;
+
+  SDL_DestroyCond(cond);
+  SDL_DestroyMutex(mut);
+}
+
+void NetSimNetwork::setConditions(const NetSimConditions *conditions)
+{
+  SDL_LockMutex(mut);
+
+  defaults = *conditions;
+  for (int i = 0; i < NET_SIM_MAX_ENDPOINTS; i++)
+    endpoints[i].conditions = *conditions;
+
+  SDL_UnlockMutex(mut);
+}
+
+int NetSimNetwork::setConditions(Uint16 port, const NetSimConditions *conditions)
+{
+  SDL_LockMutex(mut);
+
+  Endpoint *e = findEndpoint(port);
+  if (e)
+    e->conditions = *conditions;
+
+  SDL_UnlockMutex(mut);
+
+  return e ? 1 : 0;
+}
+
+void NetSimNetwork::getStats(NetSimStats *stats)
+{
+  SDL_LockMutex(mut);
+  *stats = this->stats;
+  SDL_UnlockMutex(mut);
+}
+
+IPaddress NetSimNetwork::getAddress(Uint16 port)
+{
+  IPaddress address;
+  SDLNet_Write32(0x7F000001, &address.host);
+  SDLNet_Write16(port, &address.port);
+
+  return address;
+}
+
+NetSimNetwork::Endpoint* NetSimNetwork::findEndpoint(Uint16 port)
+{
+  for (int i = 0; i < NET_SIM_MAX_ENDPOINTS; i++)
+  {
+    if (endpoints[i].transport && endpoints[i].port == port)
+      return &endpoints[i];
+  }
+
+  return NULL;
+}
+
+// Opens a transport on the network, on the next free port if port is 0
+// Returns the port, or 0 if the port is taken or the network is full
+Uint16 NetSimNetwork::attach(NetSimTransport *transport, Uint16 port)
+{
+  SDL_LockMutex(mut);
+
+  if (!port)
+  {
+    while (findEndpoint(nextPort))
+      nextPort++;
+    port = nextPort++;
+  }
+
+  Endpoint *e = NULL;
+  if (!findEndpoint(port))
+  {
+    for (int i = 0; i < NET_SIM_MAX_ENDPOINTS && !e; i++)
+    {
+      if (!endpoints[i].transport)
+        e = &endpoints[i];
+    }
+  }
+
+  if (!e)
+  {
+    SDL_UnlockMutex(mut);
+    return 0;
+  }
+
+  if (!e->inbox)
+    e->inbox = new SimPacket[NET_SIM_QUEUE_SIZE];
+
+  e->transport = transport;
+  e->port = port;
+  e->inboxSize = 0;
+  e->conditions = defaults;
+  e->random = seed ^ ((Uint64)port * 0x9E3779B97F4A7C15ULL);
+  e->bad = false;
+  e->busyUntil = 0;
+  e->lastDelivery = 0;
+
+  SDL_UnlockMutex(mut);
+
+  return port;
+}
+
+void NetSimNetwork::detach(NetSimTransport *transport)
+{
+  SDL_LockMutex(mut);
+
+  for (int i = 0; i < NET_SIM_MAX_ENDPOINTS; i++)
+  {
+    if (endpoints[i].transport == transport)
+    {
+      endpoints[i].transport = NULL;
+      endpoints[i].inboxSize = 0;
+    }
+  }
+
+  SDL_UnlockMutex(mut);
+}
+
+// Returns a random number from 0 up to but not including 1 from a transport's generator
+float NetSimNetwork::chance(Endpoint *e)
+{
+  return (float)(randomUpTo(e, 0xFFFFFF) / 16777216.0);
+}
+
+// Returns a random number from 0 to max from a transport's generator, a splitmix64 sequence
+Uint32 NetSimNetwork::randomUpTo(Endpoint *e, Uint32 max)
+{
+  e->random += 0x9E3779B97F4A7C15ULL;
+  Uint64 z = e->random;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+
+  return max == 0xFFFFFFFF ? (Uint32)z : (Uint32)(z % ((Uint64)max + 1));
+}
+
+// Adds a packet to a transport's inbox, keeping the earliest delivery at the top of the heap
+void NetSimNetwork::push(Endpoint *to, Uint64 deliverAt, Uint16 fromPort, const void *data, int len)
+{
+  if (to->inboxSize >= NET_SIM_QUEUE_SIZE)
+  {
+    stats.queueDrops++;
+    return;
+  }
+
+  Uint32 i = to->inboxSize++;
+  SimPacket *p = &to->inbox[i];
+  p->deliverAt = deliverAt;
+  p->order = order++;
+  p->from = getAddress(fromPort);
+  p->len = len;
+  memcpy(p->data, data, len);
+
+  while (i > 0)
+  {
+    Uint32 parent = (i - 1) / 2;
+    SimPacket *a = &to->inbox[parent];
+    SimPacket *b = &to->inbox[i];
+    if (a->deliverAt < b->deliverAt || (a->deliverAt == b->deliverAt && a->order < b->order))
+      break;
+
+    SimPacket tmp = *a;
+    *a = *b;
+    *b = tmp;
+    i = parent;
+  }
+}
+
+// Removes the packet at the top of a transport's inbox
+void NetSimNetwork::pop(Endpoint *e)
+{
+  e->inboxSize--;
+  if (!e->inboxSize)
+    return;
+
+  e->inbox[0] = e->inbox[e->inboxSize];
+
+  Uint32 i = 0;
+  while (true)
+  {
+    Uint32 first = i;
+    for (Uint32 c = i * 2 + 1; c <= i * 2 + 2 && c < e->inboxSize; c++)
+    {
+      SimPacket *a = &e->inbox[c];
+      SimPacket *b = &e->inbox[first];
+      if (a->deliverAt < b->deliverAt || (a->deliverAt == b->deliverAt && a->order < b->order))
+        first = c;
+    }
+
+    if (first == i)
+      break;
+
+    SimPacket tmp = e->inbox[i];
+    e->inbox[i] = e->inbox[first];
+    e->inbox[first] = tmp;
+    i = first;
+  }
+}
+
+int NetSimNetwork::send(NetSimTransport *transport, const void *data, int len, IPaddress address)
+{
+  if (len <= 0 || len > NET_SIM_PACKET_SIZE)
+    return 0;
+
+  Uint64 now = netMicros();
+
+  SDL_LockMutex(mut);
+
+  Endpoint *from = findEndpoint(transport->getPort());
+  if (!from || from->transport != transport)
+  {
+    SDL_UnlockMutex(mut);
+    return 0;
+  }
+
+  stats.sent++;
+
+  // The link is good or bad for the packet before it is sent, whether or not it arrives
+  NetSimConditions *c = &from->conditions;
+  if (from->bad)
+    from->bad = chance(from) >= c->burstEnd;
+  else
+    from->bad = chance(from) < c->burstStart;
+
+  if (chance(from) < (from->bad ? c->burstLoss : c->loss))
+  {
+    stats.lost++;
+    SDL_UnlockMutex(mut);
+    return 1;
+  }
+
+  // Packets leave one after another at the bandwidth, queueing behind those still being sent
+  Uint64 departs = now;
+  if (c->bandwidth)
+  {
+    Uint64 start = from->busyUntil > now ? from->busyUntil : now;
+    if (c->queueLimit && (start - now) * c->bandwidth / 1000000 > c->queueLimit)
+    {
+      stats.queueDrops++;
+      SDL_UnlockMutex(mut);
+      return 1;
+    }
+
+    from->busyUntil = start + (Uint64)len * 1000000 / c->bandwidth;
+    departs = from->busyUntil;
+  }
+
+  Uint64 deliverAt = departs + c->latency + (c->jitter ? randomUpTo(from, c->jitter) : 0);
+
+  // Jitter alone does not reorder packets, only held back packets are overtaken
+  if (c->reorder > 0 && chance(from) < c->reorder)
+  {
+    deliverAt += c->reorderDelay;
+    stats.reordered++;
+  }
+  else
+  {
+    if (deliverAt < from->lastDelivery)
+      deliverAt = from->lastDelivery;
+    from->lastDelivery = deliverAt;
+  }
+
+  Endpoint *to = findEndpoint(SDLNet_Read16(&address.port));
+  if (!to)
+  {
+    stats.unreachable++;
+    SDL_UnlockMutex(mut);
+    return 1;
+  }
+
+  push(to, deliverAt, from->port, data, len);
+
+  if (c->duplicate > 0 && chance(from) < c->duplicate)
+  {
+    push(to, deliverAt + randomUpTo(from, c->latency / 4 + 1), from->port, data, len);
+    stats.duplicated++;
+  }
+
+  SDL_CondBroadcast(cond);
+  SDL_UnlockMutex(mut);
+
+  return 1;
+}
+
+int NetSimNetwork::receive(NetSimTransport *transport, UDPpacket *pack)
+{
+  Uint64 now = netMicros();
+
+  SDL_LockMutex(mut);
+
+  Endpoint *e = findEndpoint(transport->getPort());
+  if (!e || e->transport != transport || !e->inboxSize || e->inbox[0].deliverAt > now)
+  {
+    SDL_UnlockMutex(mut);
+    return 0;
+  }
+
+  SimPacket *p = &e->inbox[0];
+  memcpy(pack->data, p->data, p->len);
+  pack->len = p->len;
+  pack->address = p->from;
+  pack->channel = -1;
+  pop(e);
+
+  stats.delivered++;
+
+  SDL_UnlockMutex(mut);
+
+  return 1;
+}
+
+void NetSimNetwork::wait(NetSimTransport *transport, Uint32 timeoutMs)
+{
+  Uint64 now = netMicros();
+
+  SDL_LockMutex(mut);
+
+  // Sleep until the next packet is due, or a new one is sent that might be due sooner
+  Endpoint *e = findEndpoint(transport->getPort());
+  if (e && e->inboxSize)
+  {
+    Uint64 due = e->inbox[0].deliverAt;
+    if (due <= now)
+    {
+      SDL_UnlockMutex(mut);
+      return;
+    }
+
+    Uint32 dueMs = (Uint32)((due - now + 999) / 1000);
+    if (dueMs < timeoutMs)
+      timeoutMs = dueMs;
+  }
+
+  SDL_CondWaitTimeout(cond, mut, timeoutMs);
+
+  SDL_UnlockMutex(mut);
+}
+
+NetSimTransport::NetSimTransport(NetSimNetwork *network)
+{
+  this->network = network;
+  port = 0;
+}
+
+NetSimTransport::~NetSimTransport()
+{
+  close();
+}
+
+int NetSimTransport::open(Uint16 port)
+{
+  if (this->port)
+    return 1;
+
+  this->port = network->attach(this, port);
+
+  return this->port ? 1 : 0;
+}
+
+void NetSimTransport::close()
+{
+  if (!port)
+    return;
+
+  network->detach(this);
+  port = 0;
+}
+
+int NetSimTransport::send(const void *data, int len, IPaddress address)
+{
+  return network->send(this, data, len, address);
+}
+
+int NetSimTransport::receive(UDPpacket *pack)
+{
+  return network->receive(this, pack);
+}
+
+void NetSimTransport::wait(Uint32 timeoutMs)
+{
+  network->wait(this, timeoutMs);
+}
+
+Uint16 NetSimTransport::getPort()
+{
+  return port;
+}
@@ -0,0 +1,177 @@
+/*
+  NetSimTransport: An in-process network with simulated latency, loss and bandwidth limits
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  A NetSimNetwork passes datagrams between NetSimTransports in the same process, impaired the way a real network
+  would impair them, so the reliability and congestion handling of connections can be tested and benchmarked
+  without real hardware. Give each side's NetworkManager its own NetSimTransport on the same network and connect
+  them with NetworkConnection::connectDirect using the address from getAddress.
+
+  Each packet sent is delayed by the latency plus a random jitter, and can be lost, held back so later packets
+  overtake it, or delivered twice. Loss follows a two state model, a good state losing packets at the loss rate
+  and a bad state entered and left at random that loses them at the burst loss rate, so losses come in bursts
+  as on real links. Packets are sent at most at the bandwidth, waiting in a queue of limited size behind the
+  packets before them and dropped when it is full.
+
+  Every random choice comes from a generator per sending transport seeded from the network's seed and its port,
+  so the same packets sent from a transport are always treated the same way whatever other transports do. Which
+  packets connections send depends on their timers, so for a run to repeat exactly the managers must be polled from
+  one thread with the network timing on a clock set with netSetClock that the caller advances between polls.
+
+  Transports only reach each other on the same network and are told apart by port, all on host 127.0.0.1.
+  */
+
+#pragma once
+
+#include "NetTransport.h"
+
+// Most transports on a network
+#define NET_SIM_MAX_ENDPOINTS 64
+
+// Most packets waiting to be delivered to each transport, more are dropped
+#define NET_SIM_QUEUE_SIZE 2048
+
+// Largest datagram carried, the same as NET_MAX_PACKET_SIZE
+#define NET_SIM_PACKET_SIZE 512
+
+// First port given out to transports opened on port 0
+#define NET_SIM_FIRST_PORT 40000
+
+// How packets sent from a transport are treated, times are in microseconds and chances from 0 to 1
+struct NetSimConditions {
+  Uint32 latency; // One-way delay
+  Uint32 jitter; // Largest random delay added to the latency, packets stay in order unless reordered
+  float loss; // Chance of a packet being lost in the good state
+  float burstStart; // Chance per packet of going from the good state to the bad state
+  float burstEnd; // Chance per packet of going from the bad state back to the good state
+  float burstLoss; // Chance of a packet being lost in the bad state
+  float reorder; // Chance of a packet being held back by reorderDelay, letting later ones overtake it
+  Uint32 reorderDelay; // Extra delay of reordered packets
+  float duplicate; // Chance of a packet being delivered twice
+  Uint32 bandwidth; // Bytes per second, 0 for no limit
+  Uint32 queueLimit; // Bytes that can wait to be sent at the bandwidth before packets are dropped, 0 for no limit
+};
+
+// Counts of what has happened to the packets sent on a network
+struct NetSimStats {
+  Uint64 sent;
+  Uint64 delivered;
+  Uint64 lost;
+  Uint64 queueDrops;
+  Uint64 reordered;
+  Uint64 duplicated;
+  Uint64 unreachable;
+};
+
+class NetSimTransport;
+
+class NetSimNetwork
+{
+public:
+  // Parameters:
+  // seed - the seed every random choice is made from
+  NetSimNetwork(Uint64 seed = 1);
+  ~NetSimNetwork();
+
+  // Sets how packets from every transport are treated, including transports opened later
+  void setConditions(const NetSimConditions *conditions);
+
+  // Sets how packets sent from one transport are treated
+  // Parameters:
+  // port - the port the transport is open on
+  // conditions - the conditions for its packets
+  // Returns 1 on success, 0 if no transport is open on the port
+  int setConditions(Uint16 port, const NetSimConditions *conditions);
+
+  // Fills in the counts of what has happened to packets so far
+  void getStats(NetSimStats *stats);
+
+  // Returns the address of the transport open on a port, to connect to
+  static IPaddress getAddress(Uint16 port);
+
+private:
+  struct SimPacket {
+    Uint64 deliverAt;
+    Uint32 order;
+    IPaddress from;
+    int len;
+    Uint8 data[NET_SIM_PACKET_SIZE];
+  };
+
+  // A transport's side of the network, its inbox is a heap ordered by delivery time
+  // The rest is the state of the link its packets are sent on
+  struct Endpoint {
+    NetSimTransport *transport;
+    Uint16 port;
+    SimPacket *inbox;
+    Uint32 inboxSize;
+
+    NetSimConditions conditions;
+    Uint64 random;
+    bool bad;
+    Uint64 busyUntil;
+    Uint64 lastDelivery;
+  };
+
+  Uint64 seed;
+  NetSimConditions defaults;
+  Endpoint endpoints[NET_SIM_MAX_ENDPOINTS];
+  Uint16 nextPort;
+  Uint32 order;
+  NetSimStats stats;
+
+  SDL_mutex *mut;
+  SDL_cond *cond;
+
+  Endpoint* findEndpoint(Uint16 port);
+  Uint16 attach(NetSimTransport *transport, Uint16 port);
+  void detach(NetSimTransport *transport);
+  int send(NetSimTransport *transport, const void *data, int len, IPaddress address);
+  int receive(NetSimTransport *transport, UDPpacket *pack);
+  void wait(NetSimTransport *transport, Uint32 timeoutMs);
+
+  float chance(Endpoint *e);
+  Uint32 randomUpTo(Endpoint *e, Uint32 max);
+  void push(Endpoint *to, Uint64 deliverAt, Uint16 fromPort, const void *data, int len);
+  void pop(Endpoint *e);
+
+  friend class NetSimTransport;
+};
+
+// A transport on a NetSimNetwork, to give to a NetworkManager
+class NetSimTransport : public NetTransport
+{
+public:
+  NetSimTransport(NetSimNetwork *network);
+  ~NetSimTransport();
+
+  int open(Uint16 port);
+  void close();
+  int send(const void *data, int len, IPaddress address);
+  int receive(UDPpacket *pack);
+  void wait(Uint32 timeoutMs);
+  Uint16 getPort();
+
+private:
+  NetSimNetwork *network;
+  Uint16 port;
+};
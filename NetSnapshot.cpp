@@ -0,0 +1,289 @@
+/*
+  NetSnapshot: Delta-compressed game state snapshots sent over a NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NetSnapshot.h"
+
+// Number of bits needed to hold a value
+static int significantBits(Uint32 value)
+{
+  int bits = 0;
+  while (value)
+  {
+    bits++;
+    value >>= 1;
+  }
+  return bits;
+}
+
+SnapshotChannel::SnapshotChannel(int numFields)
+{
+  if (numFields < 1)
+    numFields = 1;
+  if (numFields > NET_SNAPSHOT_MAX_FIELDS)
+    numFields = NET_SNAPSHOT_MAX_FIELDS;
+
+  this->numFields = numFields;
+
+  for (int i = 0; i < NET_SNAPSHOT_HISTORY; i++)
+  {
+    sent[i].fields = new Uint32[numFields];
+    received[i].fields = new Uint32[numFields];
+  }
+
+  // Room for a delta where every field changed, which can be larger than a full snapshot
+  encodeSize = numFields * 2 + 4;
+  encodeBuf = new Uint32[encodeSize];
+  lastSize = 0;
+
+  reset();
+}
+
+SnapshotChannel::~SnapshotChannel()
+{
+  for (int i = 0; i < NET_SNAPSHOT_HISTORY; i++)
+  {
+    delete[] sent[i].fields;
+    delete[] received[i].fields;
+  }
+
+  delete[] encodeBuf;
+}
+
+void SnapshotChannel::reset()
+{
+  for (int i = 0; i < NET_SNAPSHOT_HISTORY; i++)
+  {
+    sent[i].id = 0;
+    sent[i].packID = 0;
+    received[i].id = 0;
+  }
+
+  sendID = 0;
+}
+
+// Finds the newest sent snapshot whose packet has been acknowledged
+// Returns NULL if there is none still in the history
+SnapshotChannel::Snapshot* SnapshotChannel::findBaseline(NetworkConnection* net)
+{
+  Uint32 acked = net->getAckedPacketID();
+
+  for (Uint32 id = sendID; id > 0 && id + NET_SNAPSHOT_HISTORY > sendID; id--)
+  {
+    Snapshot* s = &sent[id & (NET_SNAPSHOT_HISTORY - 1)];
+    if (s->id == id && s->packID <= acked)
+      return s;
+  }
+
+  return NULL;
+}
+
+int SnapshotChannel::write(NetworkConnection* net, const Uint32* fields)
+{
+  // Snapshots are encoded to encodeBuf first so one that does not fit leaves the packet untouched
+  Snapshot* base = findBaseline(net);
+
+  if (base)
+  {
+    // Fall back to a full snapshot when nearly everything changed and the delta would be larger
+    encode(fields, base);
+    if (lastSize > (Uint32)numFields + 3)
+      base = NULL;
+  }
+
+  if (!base)
+    encode(fields, NULL);
+
+  if (!lastSize)
+    return 0;
+
+  // A snapshot too large for the packet is split into fragments by writeBytes, so check it fits first
+  Uint32 size = lastSize;
+  if (!net->canWrite(size * 4))
+    return 0;
+
+  for (Uint32 i = 0; i < size; i++)
+    SDLNet_Write32(encodeBuf[i], &encodeBuf[i]);
+
+  if (!net->writeBytes(encodeBuf, size * 4))
+    return 0;
+
+  sendID++;
+  Snapshot* s = &sent[sendID & (NET_SNAPSHOT_HISTORY - 1)];
+  s->id = sendID;
+  s->packID = net->getSendPacketID();
+  memcpy(s->fields, fields, numFields * 4);
+
+  return 1;
+}
+
+// Encodes a snapshot into encodeBuf as a delta against base, or in full if base is NULL
+// Sets lastSize to the number of messages used
+void SnapshotChannel::encode(const Uint32* fields, Snapshot* base)
+{
+  BitWriter writer(encodeBuf, encodeSize);
+
+  writer.writeVarUint(sendID + 1);
+  writer.writeVarUint(base ? base->id : 0);
+
+  if (!base)
+  {
+    for (int i = 0; i < numFields; i++)
+      writer.writeBits(fields[i], 32);
+  }
+  else
+  {
+    // Fields are grouped 32 at a time, each group has a bit saying whether it changed followed by a mask of
+    // which fields changed, so unchanged groups cost a single bit
+    for (int g = 0; g < numFields; g += 32)
+    {
+      int groupSize = numFields - g < 32 ? numFields - g : 32;
+      Uint32 mask = 0;
+
+      for (int i = 0; i < groupSize; i++)
+      {
+        if (fields[g + i] != base->fields[g + i])
+          mask |= 1u << i;
+      }
+
+      writer.writeBool(mask != 0);
+      if (!mask)
+        continue;
+
+      writer.writeBits(mask, groupSize);
+
+      for (int i = 0; i < groupSize; i++)
+      {
+        if (!(mask & (1u << i)))
+          continue;
+
+        Uint32 x = fields[g + i] ^ base->fields[g + i];
+        Sint32 diff = (Sint32)(fields[g + i] - base->fields[g + i]);
+        Uint32 zigzag = ((Uint32)diff << 1) ^ (Uint32)(diff >> 31);
+
+        int groups = (significantBits(zigzag) + 6) / 7;
+        int varBits = (groups ? groups : 1) * 8;
+        int xorBits = 5 + significantBits(x);
+
+        // Small numeric changes suit a varint difference, changes in the low bits of floats suit an XOR
+        if (varBits <= xorBits)
+        {
+          writer.writeBool(false);
+          writer.writeVarInt(diff);
+        }
+        else
+        {
+          writer.writeBool(true);
+          writer.writeBits(significantBits(x) - 1, 5);
+          writer.writeBits(x, significantBits(x));
+        }
+      }
+    }
+  }
+
+  writer.flush();
+
+  lastSize = writer.overflowed() ? 0 : writer.wordsWritten();
+}
+
+int SnapshotChannel::read(NetworkConnection* net, Uint32* fields)
+{
+  BitReader reader(net);
+  return read(&reader, fields);
+}
+
+int SnapshotChannel::read(BitReader* reader, Uint32* fields)
+{
+  Uint32 id = reader->readVarUint();
+  Uint32 baseID = reader->readVarUint();
+
+  Snapshot* base = NULL;
+
+  if (baseID)
+  {
+    base = &received[baseID & (NET_SNAPSHOT_HISTORY - 1)];
+    if (base->id != baseID)
+      base = NULL;
+  }
+
+  // A delta against a baseline that is not held is still read to its end so the messages after it are not taken
+  // as part of it, into encodeBuf so fields is left as it was. encodeBuf is only used by write
+  Uint32* out = baseID && !base ? encodeBuf : fields;
+
+  if (!baseID)
+  {
+    for (int i = 0; i < numFields; i++)
+      out[i] = reader->readBits(32);
+  }
+  else
+  {
+    if (base)
+      memcpy(out, base->fields, numFields * 4);
+    else
+      memset(out, 0, numFields * 4);
+
+    for (int g = 0; g < numFields; g += 32)
+    {
+      int groupSize = numFields - g < 32 ? numFields - g : 32;
+
+      if (!reader->readBool())
+        continue;
+
+      Uint32 mask = reader->readBits(groupSize);
+
+      for (int i = 0; i < groupSize; i++)
+      {
+        if (!(mask & (1u << i)))
+          continue;
+
+        if (reader->readBool())
+        {
+          int bits = reader->readBits(5) + 1;
+          out[g + i] ^= reader->readBits(bits);
+        }
+        else
+        {
+          out[g + i] += (Uint32)reader->readVarInt();
+        }
+      }
+    }
+  }
+
+  reader->align();
+
+  // A delta against a baseline that is not held cannot be decoded, this side must have been reset
+  if (reader->underflowed() || (baseID && !base))
+    return 0;
+
+  // Keep the snapshot as a baseline unless a newer one already holds its slot
+  Snapshot* s = &received[id & (NET_SNAPSHOT_HISTORY - 1)];
+  if (id > s->id)
+  {
+    s->id = id;
+    memcpy(s->fields, fields, numFields * 4);
+  }
+
+  return 1;
+}
+
+Uint32 SnapshotChannel::lastWriteSize()
+{
+  return lastSize;
+}
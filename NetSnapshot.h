@@ -0,0 +1,102 @@
+/*
+  NetSnapshot: Delta-compressed game state snapshots sent over a NetworkConnection
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  A SnapshotChannel sends a fixed number of 32 bit state fields each tick, encoded as a delta against the newest
+  snapshot the partner has acknowledged.
+
+  Snapshots are acknowledged through the packet acknowledgements of NetworkConnection, a snapshot counts as received
+  once the packet it was written to has been. Only fields that changed are sent, each as a varint difference or as
+  the significant bits of an XOR with the baseline, whichever is smaller. A full snapshot is sent when there is no
+  acknowledged baseline, at the start or after losses longer than the snapshot history. Snapshots too large for one
+  packet are sent in fragments.
+
+  Each side keeps its own SnapshotChannel, write is called on the sender and read on the receiver where the game
+  expects the snapshot in its message stream. Snapshots must be written on a reliable channel as the unreliable
+  channel is never acknowledged.
+  */
+
+#pragma once
+
+#include "NetworkConnection.h"
+#include "NetBitStream.h"
+
+// Number of snapshots kept to use as baselines, must be a power of 2
+#define NET_SNAPSHOT_HISTORY 32
+
+// Maximum number of fields in a snapshot, a full snapshot of this many takes about 35 fragments
+#define NET_SNAPSHOT_MAX_FIELDS 4096
+
+class SnapshotChannel
+{
+public:
+  // Parameters:
+  // numFields - the number of 32 bit fields in each snapshot, up to NET_SNAPSHOT_MAX_FIELDS
+  SnapshotChannel(int numFields);
+  ~SnapshotChannel();
+
+  // Forgets all baselines so the next snapshot is sent in full
+  // Call on both sides when a new game starts
+  void reset();
+
+  // Writes a snapshot to the send buffer of the connection
+  // The snapshot is written as a whole or not at all
+  // Parameters:
+  // net - the connection to write to
+  // fields - the state to send, numFields long
+  // Returns 1 on success, 0 if there is not enough room left in the send window
+  int write(NetworkConnection* net, const Uint32* fields);
+
+  // Reads a snapshot written by write from the message queue
+  // Parameters:
+  // net - the connection to read from, waits for the messages if needed
+  // fields - receives the state, numFields long, left as it was if the snapshot cannot be used
+  // Returns 1 on success, 0 if the snapshot could not be decoded
+  // A delta against a baseline this side does not hold, as after a reset on this side only, is read past and 0 returned
+  int read(NetworkConnection* net, Uint32* fields);
+
+  // Reads a snapshot from a BitReader, such as one over messages from pullMessages
+  int read(BitReader* reader, Uint32* fields);
+
+  // Returns the number of messages taken by the last snapshot written
+  Uint32 lastWriteSize();
+
+private:
+  struct Snapshot {
+    Uint32 id;
+    Uint32 packID;
+    Uint32* fields;
+  };
+
+  int numFields;
+
+  Snapshot sent[NET_SNAPSHOT_HISTORY];
+  Uint32 sendID;
+
+  Snapshot received[NET_SNAPSHOT_HISTORY];
+
+  Uint32* encodeBuf;
+  Uint32 encodeSize;
+  Uint32 lastSize;
+
+  Snapshot* findBaseline(NetworkConnection* net);
+  void encode(const Uint32* fields, Snapshot* base);
+};
@@ -0,0 +1,495 @@
+/*
+  NetStateSync: Finds and repairs the parts of a game state that differ between two players
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetStateSync.h"
+#include "NetHash.h"
+
+// Kinds of message, the first thing in each
+enum state_msg {
+  state_msg_hashes, // Hashes of a level of the tree, sent to the authority
+  state_msg_want, // Nodes whose hashes differed, sent back for the hashes of their children
+  state_msg_chunk, // Part of a chunk from the authority's state
+  state_msg_done // The authority's root hash, once every differing chunk has been sent
+};
+
+StateSync::StateSync(Uint32 *state, Uint32 numWords, Uint32 chunkWords)
+{
+  if (chunkWords < 1)
+    chunkWords = 1;
+
+  this->state = state;
+  this->numWords = numWords;
+  this->chunkWords = chunkWords;
+  authority = false;
+
+  Uint32 count = (numWords + chunkWords - 1) / chunkWords;
+  if (count < 1)
+    count = 1;
+
+  levelNum = 0;
+  while (true)
+  {
+    levelCount[levelNum] = count;
+    levels[levelNum] = new Uint32[count];
+    dirty[levelNum] = new Uint8[count];
+    levelNum++;
+
+    if (count == 1)
+      break;
+    count = (count + NET_STATE_FANOUT - 1) / NET_STATE_FANOUT;
+  }
+
+  queue = new Uint32[levelCount[0]];
+  queueLen = 0;
+  queuePos = 0;
+  outType = state_msg_done;
+  outLevel = 0;
+  chunkOffset = 0;
+  outReady = false;
+  active = false;
+
+  chunksSent = 0;
+  chunksReceived = 0;
+
+  // Room for the largest message, a piece of a chunk or a batch of hashes with their indices
+  encodeSize = NET_MAX_PACKET_SIZE / 4;
+  encodeBuf = new Uint32[encodeSize];
+
+  rehash();
+}
+
+StateSync::~StateSync()
+{
+  for (Uint32 l = 0; l < levelNum; l++)
+  {
+    delete[] levels[l];
+    delete[] dirty[l];
+  }
+
+  delete[] queue;
+  delete[] encodeBuf;
+}
+
+void StateSync::setAuthority(bool authority)
+{
+  this->authority = authority;
+}
+
+void StateSync::rehash()
+{
+  memset(dirty[0], 1, levelCount[0]);
+  anyDirty = true;
+}
+
+void StateSync::markChanged(Uint32 firstWord, Uint32 count)
+{
+  if (count == 0 || firstWord >= numWords)
+    return;
+
+  Uint32 last = firstWord + count - 1;
+  if (last >= numWords || last < firstWord)
+    last = numWords - 1;
+
+  for (Uint32 c = firstWord / chunkWords; c <= last / chunkWords; c++)
+    dirty[0][c] = 1;
+
+  anyDirty = true;
+}
+
+Uint32 StateSync::getRootHash()
+{
+  updateTree();
+  return levels[levelNum - 1][0];
+}
+
+Uint32 StateSync::getChunkCount()
+{
+  return levelCount[0];
+}
+
+void StateSync::chunkSpan(Uint32 chunk, Uint32 *first, Uint32 *count)
+{
+  *first = chunk * chunkWords;
+  *count = numWords - *first < chunkWords ? numWords - *first : chunkWords;
+}
+
+Uint32 StateSync::hashNode(Uint32 level, Uint32 index)
+{
+  if (level == 0)
+  {
+    Uint32 first, count;
+    chunkSpan(index, &first, &count);
+    return netHashWords(&state[first], count);
+  }
+
+  Uint32 first = index * NET_STATE_FANOUT;
+  Uint32 count = levelCount[level - 1] - first < NET_STATE_FANOUT ? levelCount[level - 1] - first : NET_STATE_FANOUT;
+
+  return netHashWords(&levels[level - 1][first], count, level);
+}
+
+// Hashes the changed chunks again and every node above them
+void StateSync::updateTree()
+{
+  if (!anyDirty)
+    return;
+
+  for (Uint32 l = 0; l < levelNum; l++)
+  {
+    for (Uint32 i = 0; i < levelCount[l]; i++)
+    {
+      if (!dirty[l][i])
+        continue;
+
+      levels[l][i] = hashNode(l, i);
+      dirty[l][i] = 0;
+
+      if (l + 1 < levelNum)
+        dirty[l + 1][i / NET_STATE_FANOUT] = 1;
+    }
+  }
+
+  anyDirty = false;
+}
+
+void StateSync::startResync()
+{
+  if (authority)
+    return;
+
+  // Start from the lowest level small enough to send in a few messages
+  Uint32 level = 0;
+  while (levelCount[level] > NET_STATE_START_NODES)
+    level++;
+
+  for (Uint32 i = 0; i < levelCount[level]; i++)
+    queue[i] = i;
+
+  queueLen = levelCount[level];
+  queuePos = 0;
+  outType = state_msg_hashes;
+  outLevel = level;
+  outReady = true;
+  active = true;
+}
+
+bool StateSync::resyncing()
+{
+  return active;
+}
+
+bool StateSync::hasPending()
+{
+  return outReady;
+}
+
+int StateSync::write(NetworkConnection* net)
+{
+  if (!outReady)
+    return 0;
+
+  updateTree();
+
+  BitWriter writer(encodeBuf, encodeSize);
+  writer.writeVarUint(outType);
+
+  Uint32 n = 0;
+  Uint32 pieceCount = 0;
+  bool final = false;
+
+  if (outType == state_msg_hashes || outType == state_msg_want)
+  {
+    n = queueLen - queuePos < NET_STATE_BATCH ? queueLen - queuePos : NET_STATE_BATCH;
+    final = queuePos + n == queueLen;
+
+    writer.writeVarUint(outLevel);
+    writer.writeVarUint(n);
+    writer.writeBool(final);
+
+    // Indices go up, so each is sent as the difference from the one before
+    Uint32 prev = 0;
+    for (Uint32 i = 0; i < n; i++)
+    {
+      Uint32 index = queue[queuePos + i];
+      writer.writeVarUint(index - prev);
+      prev = index;
+
+      if (outType == state_msg_hashes)
+        writer.writeBits(levels[outLevel][index], 32);
+    }
+  }
+  else if (outType == state_msg_chunk)
+  {
+    Uint32 chunk = queue[queuePos];
+    Uint32 first, count;
+    chunkSpan(chunk, &first, &count);
+    pieceCount = count - chunkOffset < NET_STATE_PIECE_WORDS ? count - chunkOffset : NET_STATE_PIECE_WORDS;
+
+    writer.writeVarUint(chunk);
+    writer.writeVarUint(chunkOffset);
+    writer.writeVarUint(pieceCount);
+    for (Uint32 i = 0; i < pieceCount; i++)
+      writer.writeBits(state[first + chunkOffset + i], 32);
+  }
+  else
+  {
+    writer.writeBits(levels[levelNum - 1][0], 32);
+  }
+
+  writer.flush();
+
+  if (writer.overflowed())
+    return 0;
+
+  Uint32 size = writer.wordsWritten();
+  char* buf = net->reserve(size * 4);
+  if (!buf)
+    return 0;
+
+  for (Uint32 i = 0; i < size; i++)
+    SDLNet_Write32(encodeBuf[i], &buf[i * 4]);
+
+  // Move on only once the message is in the send buffer
+  if (outType == state_msg_hashes || outType == state_msg_want)
+  {
+    queuePos += n;
+    if (final)
+    {
+      // Wait for the partner's reply, which fills the queue again
+      queueLen = 0;
+      queuePos = 0;
+      outReady = false;
+    }
+  }
+  else if (outType == state_msg_chunk)
+  {
+    Uint32 first, count;
+    chunkSpan(queue[queuePos], &first, &count);
+
+    chunkOffset += pieceCount;
+    if (chunkOffset == count)
+    {
+      chunkOffset = 0;
+      queuePos++;
+      chunksSent++;
+
+      if (queuePos == queueLen)
+        outType = state_msg_done;
+    }
+  }
+  else
+  {
+    queueLen = 0;
+    queuePos = 0;
+    outReady = false;
+  }
+
+  return 1;
+}
+
+int StateSync::read(NetworkConnection* net)
+{
+  BitReader reader(net);
+  return read(&reader);
+}
+
+int StateSync::read(BitReader* reader)
+{
+  Uint32 type = reader->readVarUint();
+
+  int result = 0;
+  if (type == state_msg_hashes)
+    result = readHashes(reader);
+  else if (type == state_msg_want)
+    result = readWant(reader);
+  else if (type == state_msg_chunk)
+    result = readChunk(reader);
+  else if (type == state_msg_done)
+    result = readDone(reader);
+
+  reader->align();
+
+  return result;
+}
+
+// Queues the reply to a level of the partner's hashes once all have arrived
+// The differing nodes are asked about further, or if they are chunks sent, and if none differ the resync is done
+void StateSync::finishRound(Uint32 level)
+{
+  queuePos = 0;
+  chunkOffset = 0;
+
+  if (queueLen == 0)
+    outType = state_msg_done;
+  else if (level == 0)
+    outType = state_msg_chunk;
+  else
+    outType = state_msg_want;
+
+  outLevel = level;
+  outReady = true;
+}
+
+// Compares the partner's hashes with this side's, on the authority, gathering the nodes that differ
+int StateSync::readHashes(BitReader* reader)
+{
+  Uint32 level = reader->readVarUint();
+  Uint32 n = reader->readVarUint();
+  bool final = reader->readBool();
+
+  if (level >= levelNum || n > NET_STATE_BATCH)
+    return 0;
+
+  Uint32 indices[NET_STATE_BATCH];
+  Uint32 hashes[NET_STATE_BATCH];
+  Uint32 index = 0;
+
+  for (Uint32 i = 0; i < n; i++)
+  {
+    index += reader->readVarUint();
+    indices[i] = index;
+    hashes[i] = reader->readBits(32);
+  }
+
+  if (reader->underflowed() || !authority)
+    return 0;
+
+  updateTree();
+
+  for (Uint32 i = 0; i < n; i++)
+  {
+    if (indices[i] < levelCount[level] && levels[level][indices[i]] != hashes[i] && queueLen < levelCount[0])
+      queue[queueLen++] = indices[i];
+  }
+
+  if (final)
+    finishRound(level);
+
+  return 1;
+}
+
+// Gathers the children of the nodes the authority found differing, to send their hashes next
+int StateSync::readWant(BitReader* reader)
+{
+  Uint32 level = reader->readVarUint();
+  Uint32 n = reader->readVarUint();
+  bool final = reader->readBool();
+
+  if (level == 0 || level >= levelNum || n > NET_STATE_BATCH)
+    return 0;
+
+  Uint32 parents[NET_STATE_BATCH];
+  Uint32 index = 0;
+
+  for (Uint32 i = 0; i < n; i++)
+  {
+    index += reader->readVarUint();
+    parents[i] = index;
+  }
+
+  if (reader->underflowed() || authority)
+    return 0;
+
+  for (Uint32 i = 0; i < n; i++)
+  {
+    if (parents[i] >= levelCount[level])
+      continue;
+
+    Uint32 child = parents[i] * NET_STATE_FANOUT;
+    for (Uint32 c = 0; c < NET_STATE_FANOUT && child + c < levelCount[level - 1]; c++)
+    {
+      if (queueLen < levelCount[0])
+        queue[queueLen++] = child + c;
+    }
+  }
+
+  if (final)
+  {
+    queuePos = 0;
+    outType = state_msg_hashes;
+    outLevel = level - 1;
+    outReady = true;
+  }
+
+  return 1;
+}
+
+// Writes part of a chunk from the authority into the state
+int StateSync::readChunk(BitReader* reader)
+{
+  Uint32 chunk = reader->readVarUint();
+  Uint32 offset = reader->readVarUint();
+  Uint32 count = reader->readVarUint();
+
+  if (chunk >= levelCount[0] || count > NET_STATE_PIECE_WORDS)
+    return 0;
+
+  Uint32 first, chunkCount;
+  chunkSpan(chunk, &first, &chunkCount);
+  if (offset > chunkCount || count > chunkCount - offset)
+    return 0;
+
+  Uint32 words[NET_STATE_PIECE_WORDS];
+  for (Uint32 i = 0; i < count; i++)
+    words[i] = reader->readBits(32);
+
+  if (reader->underflowed() || authority)
+    return 0;
+
+  memcpy(&state[first + offset], words, count * 4);
+  dirty[0][chunk] = 1;
+  anyDirty = true;
+
+  if (offset + count == chunkCount)
+    chunksReceived++;
+
+  return 1;
+}
+
+// Finishes the resync if the states now match, or starts again from the top if they do not
+int StateSync::readDone(BitReader* reader)
+{
+  Uint32 root = reader->readBits(32);
+
+  if (reader->underflowed() || authority)
+    return 0;
+
+  if (!active)
+    return 1;
+
+  if (getRootHash() == root)
+    active = false;
+  else
+    startResync();
+
+  return 1;
+}
+
+Uint32 StateSync::getChunksSent()
+{
+  return chunksSent;
+}
+
+Uint32 StateSync::getChunksReceived()
+{
+  return chunksReceived;
+}
@@ -0,0 +1,161 @@
+/*
+  NetStateSync: Finds and repairs the parts of a game state that differ between two players
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  A StateSync keeps a tree of hashes over a game state held as 32 bit words, so that when the players' states
+  differ only the parts that differ are sent to repair it.
+
+  The state is split into chunks of a fixed number of words. Each chunk is hashed with netHashWords, and each node
+  above hashes up to NET_STATE_FANOUT of the nodes below it, up to a single root hash over the whole state. The root
+  hash is given to NetworkConnection::updateHash each tick along with the tick, so a desync is found on the first
+  tick the states differ. Only chunks marked as changed are hashed again, so the root hash is cheap to keep up to
+  date even for a state of several megabytes.
+
+  One player is the authority, whose state is kept. When a desync is found the other player starts a resync and
+  sends the hashes of a level of the tree near the top. The authority answers with the nodes whose hashes differ,
+  the other player sends the hashes of their children, and so on down to the chunks, which the authority sends.
+  The resync finishes once the root hashes match. It takes a round trip per level and sends only the differing
+  chunks, where sending the whole state would take the time to send all of it.
+
+  Messages must be written on the reliable ordered channel and the game should not run while a resync is going on,
+  so both states stay the same until it finishes. Each side keeps its own StateSync over its own copy of the state.
+  */
+
+#pragma once
+
+#include "NetworkConnection.h"
+#include "NetBitStream.h"
+
+// Number of children of each node of the hash tree
+#define NET_STATE_FANOUT 16
+
+// Most nodes in the level of the tree a resync starts from
+#define NET_STATE_START_NODES 64
+
+// Most hashes or node indices sent in one message
+#define NET_STATE_BATCH 32
+
+// Most words of a chunk sent in one message
+#define NET_STATE_PIECE_WORDS 64
+
+// Most levels in the hash tree, enough for 2^32 chunks
+#define NET_STATE_MAX_LEVELS 9
+
+class StateSync
+{
+public:
+  // Parameters:
+  // state - the game state, kept by the game, which a resync writes into
+  // numWords - the number of 32 bit words in the state
+  // chunkWords - the number of words in each chunk, the smallest part of the state that is sent
+  StateSync(Uint32 *state, Uint32 numWords, Uint32 chunkWords);
+  ~StateSync();
+
+  // Sets whether this side's state is the one kept when the states differ
+  // Parameters:
+  // authority - true on the side whose state is kept, usually the host
+  void setAuthority(bool authority);
+
+  // Marks the whole state as changed, such as when a new game starts
+  void rehash();
+
+  // Marks part of the state as changed so its chunks are hashed again
+  // Parameters:
+  // firstWord - the first word changed
+  // count - the number of words changed
+  void markChanged(Uint32 firstWord, Uint32 count);
+
+  // Returns the hash of the whole state, hashing any chunks changed since it was last worked out
+  Uint32 getRootHash();
+
+  // Returns the number of chunks the state is split into
+  Uint32 getChunkCount();
+
+  // Starts a resync, to be called on the side that is not the authority once a desync has been found
+  void startResync();
+
+  // Returns true while a resync started on this side has not finished
+  bool resyncing();
+
+  // Returns true while there are messages waiting to be written
+  bool hasPending();
+
+  // Writes the next waiting message to the send buffer
+  // Call while hasPending returns true, sending packets as they fill
+  // Parameters:
+  // net - the connection to write to
+  // Returns 1 if a message was written, 0 if none is waiting or there is not enough space left in the packet
+  int write(NetworkConnection* net);
+
+  // Reads a message written by write from the message queue
+  // Parameters:
+  // net - the connection to read from, waits for the messages if needed
+  // Returns 1 on success, 0 if the message could not be decoded
+  int read(NetworkConnection* net);
+
+  // Reads a message from a BitReader, such as one over messages from pullMessages
+  int read(BitReader* reader);
+
+  // Returns the number of chunks sent and received by resyncs so far
+  Uint32 getChunksSent();
+  Uint32 getChunksReceived();
+
+private:
+  Uint32 *state;
+  Uint32 numWords;
+  Uint32 chunkWords;
+  bool authority;
+
+  // Hash tree, levels[0] holds the chunk hashes and the single node of the top level is the root
+  // dirty marks the nodes to be hashed again, anyDirty whether there are any
+  Uint32 *levels[NET_STATE_MAX_LEVELS];
+  Uint8 *dirty[NET_STATE_MAX_LEVELS];
+  Uint32 levelCount[NET_STATE_MAX_LEVELS];
+  Uint32 levelNum;
+  bool anyDirty;
+
+  // Nodes being sent or gathered from the partner's messages, outType is the kind of message they go out as and
+  // outReady is set once they are all known. chunkOffset is the word of the current chunk sent up to
+  Uint32 *queue;
+  Uint32 queueLen;
+  Uint32 queuePos;
+  Uint32 outType;
+  Uint32 outLevel;
+  Uint32 chunkOffset;
+  bool outReady;
+  bool active;
+
+  Uint32 chunksSent;
+  Uint32 chunksReceived;
+
+  Uint32 *encodeBuf;
+  Uint32 encodeSize;
+
+  void updateTree();
+  Uint32 hashNode(Uint32 level, Uint32 index);
+  void chunkSpan(Uint32 chunk, Uint32 *first, Uint32 *count);
+  void finishRound(Uint32 level);
+  int readHashes(BitReader* reader);
+  int readWant(BitReader* reader);
+  int readChunk(BitReader* reader);
+  int readDone(BitReader* reader);
+};
@@ -0,0 +1,77 @@
+/*
+  NetStats: Connection statistics kept by the network thread and read without locking
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NetStats.h"
+
+// Times below 8us get a bucket each, above that each power of 2 is split into four buckets by the two bits
+// below the highest set bit
+Uint32 netRttBucket(Uint32 rtt)
+{
+  if (rtt < 8)
+    return rtt;
+
+  Uint32 e = 3;
+  while (e < 31 && (rtt >> (e + 1)))
+    e++;
+
+  Uint32 bucket = 8 + (e - 3) * 4 + ((rtt >> (e - 2)) & 3);
+
+  return bucket < NET_STATS_RTT_BUCKETS ? bucket : NET_STATS_RTT_BUCKETS - 1;
+}
+
+Uint32 netRttBucketValue(Uint32 bucket)
+{
+  if (bucket < 8)
+    return bucket;
+
+  Uint32 e = (bucket - 8) / 4 + 3;
+  Uint32 sub = (bucket - 8) & 3;
+  Uint32 width = 1u << (e - 2);
+
+  return ((4 + sub) << (e - 2)) + width / 2;
+}
+
+Uint32 netRttPercentile(const Uint32 *histogram, float fraction)
+{
+  Uint64 total = 0;
+  for (Uint32 i = 0; i < NET_STATS_RTT_BUCKETS; i++)
+    total += histogram[i];
+
+  if (!total)
+    return 0;
+
+  // The sample the percentile lands on, counting from 1
+  Uint64 rank = (Uint64)(fraction * total + 0.5f);
+  if (rank < 1)
+    rank = 1;
+  if (rank > total)
+    rank = total;
+
+  Uint64 count = 0;
+  for (Uint32 i = 0; i < NET_STATS_RTT_BUCKETS; i++)
+  {
+    count += histogram[i];
+    if (count >= rank)
+      return netRttBucketValue(i);
+  }
+
+  return netRttBucketValue(NET_STATS_RTT_BUCKETS - 1);
+}
@@ -0,0 +1,210 @@
+/*
+  NetStats: Connection statistics kept by the network thread and read without locking
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  Counters are updated by whichever thread is already holding the lock that covers what they count, so keeping
+  them adds no locking to the network thread. Each group of counters sits behind a sequence lock. The writer
+  makes the sequence odd while it changes the counters and even again once it is done. A reader copies the
+  counters and retries if the sequence was odd or moved while it was copying, so reading never blocks the writer.
+
+  Round trip times are counted in a histogram with four buckets per power of 2, so percentiles are found to
+  within about 12% without keeping every sample.
+  */
+
+#pragma once
+
+#include "SDL.h"
+#include "string.h"
+
+// Number of buckets in the round trip time histogram, the last holds everything from about 29s up
+#define NET_STATS_RTT_BUCKETS 96
+
+// A snapshot of a connection's statistics, returned by NetworkConnection::getStats
+// Counts run from when the partner was found, times are in microseconds unless marked otherwise
+struct NetStats {
+  // Round trip times, 0 until the first has been measured
+  // rttSmoothed is the moving average the retransmission timer uses and jitter the mean difference between
+  // consecutive samples
+  Uint32 rttSamples;
+  Uint32 rttMin;
+  Uint32 rttMax;
+  Uint32 rttAvg;
+  Uint32 rttSmoothed;
+  Uint32 rttP50;
+  Uint32 rttP99;
+  Uint32 jitter;
+  Uint32 rttHistogram[NET_STATS_RTT_BUCKETS];
+
+  // Datagrams and bytes on the wire, including handshakes, checks and acknowledgements
+  Uint64 packetsSent;
+  Uint64 packetsReceived;
+  Uint64 bytesSent;
+  Uint64 bytesReceived;
+
+  // Reliable packets sent for the first time, packets found lost, resends and received packets that were
+  // already held or had already been passed
+  // lossRate and retransmitRate are lost and retransmits as a fraction of dataPacketsSent
+  Uint64 dataPacketsSent;
+  Uint64 lost;
+  Uint64 retransmits;
+  Uint64 duplicates;
+  float lossRate;
+  float retransmitRate;
+
+  // Data packets sent compressed, counting each once however often it is resent, and the payload bytes saved
+  // decompressFailures counts compressed packets received that could not be decompressed and were dropped
+  Uint64 packetsCompressed;
+  Uint64 bytesSaved;
+  Uint64 decompressFailures;
+
+  // Queue depths when the snapshot was taken
+  // sendWindowUsed is the number of packets in the send window waiting to be acknowledged or sent, and
+  // receiveQueued the number of messages waiting to be read by the game
+  Uint32 sendWindowUsed;
+  Uint32 bytesInFlight;
+  Uint32 congestionWindow;
+  Uint32 receiveQueued;
+  Uint32 eventsDropped;
+
+  // Time in ms spent exchanging data through the server and directly with the partner
+  Uint32 relayedTime;
+  Uint32 p2pTime;
+};
+
+// Counters for sending and round trip times, written with the connection's sendMut held
+struct NetSendStats {
+  Uint64 packetsSent;
+  Uint64 bytesSent;
+  Uint64 dataPacketsSent;
+  Uint64 lost;
+  Uint64 retransmits;
+  Uint64 packetsCompressed;
+  Uint64 bytesSaved;
+  Uint32 sendWindowUsed;
+  Uint32 bytesInFlight;
+  Uint32 congestionWindow;
+  Uint32 rttSamples;
+  Uint32 rttMin;
+  Uint32 rttMax;
+  Uint64 rttTotal;
+  Uint32 rttLast;
+  Uint32 rttSmoothed;
+  Uint32 jitter;
+  Uint32 rttHistogram[NET_STATS_RTT_BUCKETS];
+};
+
+// Counters for receiving and for the packets the connection sends itself, written with the manager's sessionMut
+// held, which the network thread holds whenever it runs the connection
+struct NetLinkStats {
+  Uint64 packetsSent;
+  Uint64 bytesSent;
+  Uint64 packetsReceived;
+  Uint64 bytesReceived;
+  Uint64 duplicates;
+  Uint64 decompressFailures;
+  Uint32 relayedTime;
+  Uint32 p2pTime;
+};
+
+/*
+  Guards a block of data written by one thread at a time and read by any number of threads without locking.
+  Writers must be kept apart by the caller, readers retry until they get a copy no writer was part way through.
+  */
+
+template <typename T>
+class NetSeqLock
+{
+public:
+  NetSeqLock()
+  {
+    SDL_AtomicSet(&seq, 0);
+    memset(&data, 0, sizeof(T));
+  }
+
+  // Starts a change to the data
+  // Only one thread may write at a time
+  // Returns the data to change, call endWrite once finished
+  T* beginWrite()
+  {
+    SDL_AtomicAdd(&seq, 1);
+    SDL_MemoryBarrierRelease();
+
+    return &data;
+  }
+
+  // Finishes a change started with beginWrite, publishing it to readers
+  void endWrite()
+  {
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&seq, 1);
+  }
+
+  // Copies the data as it was between changes
+  // Parameters:
+  // out - receives the data
+  void read(T *out)
+  {
+    while (true)
+    {
+      int start = SDL_AtomicGet(&seq);
+      SDL_MemoryBarrierAcquire();
+
+      if (!(start & 1))
+      {
+        memcpy(out, (const void*)&data, sizeof(T));
+        SDL_MemoryBarrierAcquire();
+
+        if (SDL_AtomicGet(&seq) == start)
+          return;
+      }
+    }
+  }
+
+  // Clears the data
+  // Only call from the writing thread
+  void reset()
+  {
+    beginWrite();
+    memset(&data, 0, sizeof(T));
+    endWrite();
+  }
+
+private:
+  SDL_atomic_t seq;
+  T data;
+};
+
+// Returns the histogram bucket a round trip time falls in
+// Parameters:
+// rtt - the round trip time in microseconds
+Uint32 netRttBucket(Uint32 rtt);
+
+// Returns the round trip time in microseconds at the middle of a histogram bucket
+// Parameters:
+// bucket - the bucket's index
+Uint32 netRttBucketValue(Uint32 bucket);
+
+// Finds a percentile of the round trip times counted in a histogram
+// Parameters:
+// histogram - the counts of NET_STATS_RTT_BUCKETS buckets
+// fraction - the fraction of samples below the result, 0.5 for the median
+// Returns the round trip time in microseconds, 0 if the histogram is empty
+Uint32 netRttPercentile(const Uint32 *histogram, float fraction);
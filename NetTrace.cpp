@@ -0,0 +1,102 @@
+/*
+  NetTrace: Per-stage latency of messages traced from one game to the other
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetTrace.h"
+
+void netTraceAdd(NetTraceStats *stats, net_trace_stage stage, Uint32 micros)
+{
+  stats->count[stage]++;
+  stats->total[stage] += micros;
+  if (micros > stats->max[stage])
+    stats->max[stage] = micros;
+  stats->histogram[stage][netRttBucket(micros)]++;
+}
+
+// Times are compared as differences of their low 32 bits, so they only need to be within about an hour of each other
+void netTraceFinish(NetTraceStats *stats, const NetTraceRecord *trace, Uint32 read)
+{
+  stats->traced++;
+  if (trace->transmissions > 1)
+    stats->retransmitted++;
+
+  netTraceAdd(stats, net_trace_send, trace->firstSent - trace->written);
+  netTraceAdd(stats, net_trace_resend, trace->sent - trace->firstSent);
+  if (trace->server)
+    netTraceAdd(stats, net_trace_server, trace->server);
+  netTraceAdd(stats, net_trace_hold, trace->queued - trace->arrived);
+  netTraceAdd(stats, net_trace_read, read - trace->queued);
+
+  // The sender's times can only be set against the receiver's once the partner's clock has been measured
+  if (!trace->synced)
+  {
+    stats->unsynced++;
+    return;
+  }
+
+  // The clock estimate can put a fast packet's transmission a little after its arrival
+  Sint32 network = (Sint32)(trace->arrived - trace->sent);
+  Sint32 total = (Sint32)(read - trace->written);
+
+  netTraceAdd(stats, trace->server ? net_trace_relayed : net_trace_direct, network > 0 ? network : 0);
+  netTraceAdd(stats, net_trace_total, total > 0 ? total : 0);
+}
+
+const char* netTraceStageName(net_trace_stage stage)
+{
+  static const char *names[NET_TRACE_STAGES] = {
+    "send", "resend", "direct", "relayed", "server", "hold", "read", "total"
+  };
+
+  return stage < NET_TRACE_STAGES ? names[stage] : "";
+}
+
+int netTraceFormat(const NetTraceStats *stats, char *out, int size)
+{
+  if (size <= 0)
+    return 0;
+
+  int len = SDL_snprintf(out, size, "%-8s %8s %9s %9s %9s %9s\n", "stage", "count", "mean_us", "p50_us", "p99_us",
+    "max_us");
+
+  for (int i = 0; i < NET_TRACE_STAGES && len < size; i++)
+  {
+    Uint32 count = stats->count[i];
+    Uint32 mean = count ? (Uint32)(stats->total[i] / count) : 0;
+    Uint32 max = stats->max[i];
+
+    // Percentiles are taken from the middle of their bucket, which can be past the longest sample
+    Uint32 p50 = netRttPercentile(stats->histogram[i], 0.5f);
+    Uint32 p99 = netRttPercentile(stats->histogram[i], 0.99f);
+
+    len += SDL_snprintf(out + len, size - len, "%-8s %8u %9u %9u %9u %9u\n", netTraceStageName((net_trace_stage)i),
+      count, mean, p50 < max ? p50 : max, p99 < max ? p99 : max, max);
+  }
+
+  if (len < size)
+  {
+    len += SDL_snprintf(out + len, size - len, "traced %llu unsynced %llu retransmitted %llu dropped %u\n",
+      (unsigned long long)stats->traced, (unsigned long long)stats->unsynced,
+      (unsigned long long)stats->retransmitted, stats->dropped);
+  }
+
+  return len < size ? len : size - 1;
+}
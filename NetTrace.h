@@ -0,0 +1,126 @@
+/*
+  NetTrace: Per-stage latency of messages traced from one game to the other
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  Follows sampled packets from the game writing them on one side to the game reading them on the other, to show
+  where the time goes between the two.
+
+  A traced packet carries a block after its acknowledgement words holding its trace ID, when its first message was
+  written, when it was first transmitted, when the copy carrying the block was transmitted and how many times it
+  has been. The times are on the sender's clock. The server adds how long it held the packet when relaying it. The
+  receiver moves the sender's times onto its own clock with its estimate of the partner's clock, notes when the
+  packet arrived and when its messages were queued, and once the game has read the last of them splits the whole
+  time into stages.
+
+  The sender's stages come from its own clock so are exact. The time on the network and the total depend on the
+  clock estimate, so are only counted once the clocks are synced and are out by up to NetworkConnection's
+  getClockError.
+
+  Each stage is counted in a histogram with the same buckets as round trip times, see netRttBucket.
+  */
+
+#pragma once
+
+#include "SDL.h"
+#include "NetStats.h"
+
+// Packets are traced when their header has this flag, with the block following the acknowledgement words
+// The block holds the trace ID, the times in microseconds the first message was written, the packet was first
+// transmitted and this copy was transmitted, and a word with the number of transmissions in the top 8 bits and
+// the time in microseconds the server held it in the low 24, 0 when it was not relayed
+#define NET_FLAG_TRACED 0x04000000
+#define NET_TRACE_SIZE 20
+#define NET_TRACE_SERVER_MASK 0x00FFFFFF
+
+// Number of traced packets whose messages can wait to be read by the game, must be a power of 2
+#define NET_TRACE_QUEUE_SIZE 256
+
+// The stages a traced packet's time is split into, all in microseconds
+enum net_trace_stage {
+  net_trace_send, // From the first message being written to the packet's first transmission
+  net_trace_resend, // From the first transmission to the one that arrived, 0 unless it was lost
+  net_trace_direct, // On the network from the sender to the receiver, when sent peer-to-peer
+  net_trace_relayed, // On the network through the server, including the time in the server
+  net_trace_server, // Held in the server while it was relayed
+  net_trace_hold, // From arriving to being queued for the game, waiting for earlier packets or other fragments
+  net_trace_read, // Waiting in the message queue until the game read the last of the packet's messages
+  net_trace_total, // From the first message being written to the game reading the last of them
+
+  NET_TRACE_STAGES
+};
+
+// A traced packet on its way through the receiver, built by the network thread and finished by the game thread
+// Times are in microseconds on the receiver's clock, end is the message queue's push count after its messages
+struct NetTraceRecord {
+  Uint32 id;
+  Uint32 end;
+  Uint32 written;
+  Uint32 firstSent;
+  Uint32 sent;
+  Uint32 arrived;
+  Uint32 queued;
+  Uint32 server;
+  Uint8 transmissions;
+  bool synced;
+};
+
+// Latencies of the traced packets read so far, returned by NetworkConnection::getTraceStats
+struct NetTraceStats {
+  // Packets traced through to the game, those that arrived before the clocks were synced and so have no network
+  // or total time, those that arrived on a resend and traces lost because too many were waiting to be read
+  Uint64 traced;
+  Uint64 unsynced;
+  Uint64 retransmitted;
+  Uint32 dropped;
+
+  // Per stage, the number of samples, their total and the longest, and the histogram they fall in
+  Uint32 count[NET_TRACE_STAGES];
+  Uint64 total[NET_TRACE_STAGES];
+  Uint32 max[NET_TRACE_STAGES];
+  Uint32 histogram[NET_TRACE_STAGES][NET_STATS_RTT_BUCKETS];
+};
+
+// Adds a sample to a stage's histogram
+// Parameters:
+// stats - the statistics to add to
+// stage - the stage the sample is from
+// micros - the time in microseconds
+void netTraceAdd(NetTraceStats *stats, net_trace_stage stage, Uint32 micros);
+
+// Adds a finished trace to the statistics
+// Parameters:
+// stats - the statistics to add to
+// trace - the trace, with every time on the receiver's clock
+// read - the time in microseconds the game read the last of its messages
+void netTraceFinish(NetTraceStats *stats, const NetTraceRecord *trace, Uint32 read);
+
+// Returns a stage's name, as shown by netTraceFormat
+const char* netTraceStageName(net_trace_stage stage);
+
+// Writes the statistics as a table with a line per stage giving the count, mean, median, 99th percentile and
+// maximum in microseconds, for logging or showing on demand
+// Parameters:
+// stats - the statistics to write
+// out - the buffer to write to, always terminated
+// size - the size of the buffer in bytes
+// Returns the number of characters written, the table is cut short if the buffer is too small
+int netTraceFormat(const NetTraceStats *stats, char *out, int size);
@@ -0,0 +1,108 @@
+/*
+  NetTransport: The datagram transport a NetworkManager sends and receives through
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetTransport.h"
+
+NetUdpTransport::NetUdpTransport()
+{
+  udpSD = NULL;
+  socketSet = NULL;
+}
+
+NetUdpTransport::~NetUdpTransport()
+{
+  close();
+}
+
+int NetUdpTransport::open(Uint16 port)
+{
+  if (udpSD)
+    return 1;
+
+  udpSD = SDLNet_UDP_Open(port);
+  if (!udpSD)
+  {
+    //printf("SDLNet_UDP_Open: %s\n", SDLNet_GetError());
+    return 0;
+  }
+
+  socketSet = SDLNet_AllocSocketSet(1);
+  if (socketSet)
+    SDLNet_UDP_AddSocket(socketSet, udpSD);
+
+  return 1;
+}
+
+void NetUdpTransport::close()
+{
+  if (socketSet)
+    SDLNet_FreeSocketSet(socketSet);
+  socketSet = NULL;
+
+  if (udpSD)
+    SDLNet_UDP_Close(udpSD);
+  udpSD = NULL;
+}
+
+int NetUdpTransport::send(const void *data, int len, IPaddress address)
+{
+  if (!udpSD)
+    return 0;
+
+  UDPpacket out;
+  out.channel = -1;
+  out.data = (Uint8*)data;
+  out.len = len;
+  out.maxlen = len;
+  out.address = address;
+
+  return SDLNet_UDP_Send(udpSD, -1, &out) ? 1 : 0;
+}
+
+int NetUdpTransport::receive(UDPpacket *pack)
+{
+  if (!udpSD)
+    return 0;
+
+  return SDLNet_UDP_Recv(udpSD, pack) > 0 ? 1 : 0;
+}
+
+void NetUdpTransport::wait(Uint32 timeoutMs)
+{
+  if (socketSet)
+    SDLNet_CheckSockets(socketSet, timeoutMs);
+  else
+    SDL_Delay(timeoutMs);
+}
+
+Uint16 NetUdpTransport::getPort()
+{
+  if (!udpSD)
+    return 0;
+
+  // Channel -1 gives the address the socket is bound to, the port is in network byte order
+  IPaddress *address = SDLNet_UDP_GetPeerAddress(udpSD, -1);
+  if (!address)
+    return 0;
+
+  return SDLNet_Read16(&address->port);
+}
@@ -0,0 +1,90 @@
+/*
+  NetTransport: The datagram transport a NetworkManager sends and receives through
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  A NetworkManager does all of its socket work through a NetTransport, so connections can run over something
+  other than a real UDP socket. NetUdpTransport is the SDL_net socket managers use by default, and
+  NetSimTransport in NetSimTransport.h passes datagrams between managers in the same process over a simulated
+  network.
+
+  send may be called from any thread, the manager serialises the calls. receive and wait are only called by the
+  thread running the manager.
+  */
+
+#pragma once
+
+#include "SDL.h"
+#include "SDL_net.h"
+
+class NetTransport
+{
+public:
+  virtual ~NetTransport() {}
+
+  // Opens the transport, called as the manager starts
+  // Parameters:
+  // port - the port to listen on, 0 to choose a free one
+  // Returns 1 on success, 0 on errors
+  virtual int open(Uint16 port) = 0;
+
+  // Closes the transport, called as the manager stops
+  virtual void close() = 0;
+
+  // Sends a datagram
+  // Returns 1 on success, 0 on failure
+  virtual int send(const void *data, int len, IPaddress address) = 0;
+
+  // Takes the next datagram waiting to be received
+  // Parameters:
+  // pack - receives the datagram and the address it came from, it must hold at least NET_MAX_PACKET_SIZE bytes
+  // Returns 1 if a datagram was received, 0 if none is waiting
+  virtual int receive(UDPpacket *pack) = 0;
+
+  // Waits until a datagram may be waiting or the time runs out
+  // Parameters:
+  // timeoutMs - the longest time to wait in ms
+  virtual void wait(Uint32 timeoutMs) = 0;
+
+  // Returns the port the transport is open on, 0 if it is not open
+  virtual Uint16 getPort() = 0;
+};
+
+// A UDP socket opened through SDL_net
+class NetUdpTransport : public NetTransport
+{
+public:
+  NetUdpTransport();
+  ~NetUdpTransport();
+
+  int open(Uint16 port);
+  void close();
+  int send(const void *data, int len, IPaddress address);
+  int receive(UDPpacket *pack);
+  void wait(Uint32 timeoutMs);
+  Uint16 getPort();
+
+private:
+  UDPsocket udpSD;
+
+  // Lets wait sleep until a packet arrives rather than spinning
+  SDLNet_SocketSet socketSet;
+};
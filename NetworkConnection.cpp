@@ -21,31 +21,198 @@
 
 #include "NetworkConnection.h"
 
-NetworkConnection::NetworkConnection()
+// Returns the size of a data packet's header up to its channel words, including the trace block if it has one
+static int dataHeaderSize(const char *data)
+{
+  return SDLNet_Read32(data) & NET_FLAG_TRACED ? NET_DATA_HEADER + NET_TRACE_SIZE : NET_DATA_HEADER;
+}
+
+NetworkConnection::NetworkConnection(NetworkManager *manager)
 {
-  netMut = SDL_CreateMutex();
   msgMut = SDL_CreateMutex();
-  lastPackID = 0;
-  sendSize = 0;
-  sendCount = 0;
+  msgCond = SDL_CreateCond();
+  SDL_AtomicSet(&msgWaiting, 0);
+  sendMut = SDL_CreateMutex();
+  sentPackets = new PacketData[NET_SEND_WINDOW];
+  fragBuf = NULL;
+  reorderBuf = NULL;
+  reorderTrace = NULL;
+  sendChannel = net_channel_reliableUnordered;
+  sendMode = net_send_immediate;
+  maxSendDelay = 0;
+  pendingSince = 0;
+  msgOpen = false;
+  sendOpen = false;
   connectedToInternetServer = false;
-  packet = NULL;
+  serverBound = false;
+  partnerBound = false;
   p2p = false;
+  direct = false;
+  state = nc_state_idle;
+  afterConnect = nc_state_idle;
+  stateSent = 0;
+  stateEnd = 0;
+  sdlEventType = SDL_USEREVENT;
+  eventCallback = NULL;
+  eventUserData = NULL;
+  SDL_AtomicSet(&eventsDropped, 0);
+  partnerAlive = true;
+  lastCheckSent = 0;
+  lastReceived = 0;
+  lastServerPing = 0;
+  lastStatsTime = 0;
+  isHost = false;
   hashInterval = 250;
   startTime = SDL_GetTicks();
+  gameStart = 0;
+  tickLength = 16667;
+  lastSharedTime = 0;
   pauseTime = 0;
-  pingTime = 0;
-  resetTime = 0;
-  inSync = true;
+  HashHistory *history = hashHistory.beginWrite();
+  history->latestTick = NET_HASH_NO_TICK;
+  memset(history->ticks, 0xFF, sizeof(history->ticks));
+  hashHistory.endWrite();
+  SDL_AtomicSet(&hashUpdates, 0);
+  SDL_AtomicSet(&desyncTick, (int)NET_HASH_NO_TICK);
+  partnerHashTick = NET_HASH_NO_TICK;
+  partnerHash = 0;
+  lastHashSent = 0;
+  hashUpdatesSent = 0;
+  compressID = 0;
+  compressSend = false;
+  traceInterval = 0;
+  traceNum = 0;
+  sendTraced = false;
+  fragTrace.id = 0;
+  traceHeld = false;
+  SDL_AtomicSet(&tracesDropped, 0);
   serverURL = "";
+  fragNum = 0;
+  msgDropped = false;
+
+  resetSession();
+  restartSendBuf();
+
+  ownsManager = manager == NULL;
+  this->manager = ownsManager ? new NetworkManager() : manager;
+  sessionID = (Uint32)this->manager->addSession(this);
 }
 
 NetworkConnection::~NetworkConnection()
 {
-  SDLNet_FreePacket(packet);
-  SDLNet_UDP_Close(udpSD);
+  SDL_LockMutex(manager->sessionMut);
+  leaveSession();
+  if (serverBound)
+    manager->unbindAddress(serverAddress, this);
+  serverBound = false;
+  SDL_UnlockMutex(manager->sessionMut);
+
+  manager->removeSession(this);
+  if (ownsManager)
+    delete manager;
+
+  delete[] sentPackets;
+  delete[] fragBuf;
+  delete[] reorderBuf;
+  delete[] reorderTrace;
+  SDL_DestroyMutex(sendMut);
+  SDL_DestroyCond(msgCond);
   SDL_DestroyMutex(msgMut);
-  SDL_DestroyMutex(netMut);
+}
+
+// Clears the sequence numbers, acknowledgements and congestion state ready for a new partner
+// Called as a partner is found, before the game starts sending to it
+void NetworkConnection::resetSession()
+{
+  SDL_LockMutex(sendMut);
+
+  ackedPackID = 0;
+  sendWindowFull = false;
+  compressSend = false;
+  memset(recvBits, 0, sizeof(recvBits));
+  lastPackID = 0;
+  minPackRcvd = 0;
+  maxPackRcvd = 0;
+  sendCount = 0;
+  fragFirstID = 0;
+  fragCount = 0;
+  fragReceived = 0;
+  orderedSendCount = 0;
+  unreliableSendCount = 0;
+  memset(reorderNum, 0, sizeof(reorderNum));
+  nextOrder = 1;
+  lastUnreliableSeq = 0;
+  sentCount = 0;
+  resendPending = 0;
+  congestionWindow = NET_CC_INITIAL_WINDOW * NET_MAX_PACKET_SIZE;
+  bytesInFlight = 0;
+  srtt = 0;
+  rttVar = 0;
+  rto = NET_RTO_INITIAL * 1000;
+  memset(delaySamples, 0, sizeof(delaySamples));
+  delaySampleNum = 0;
+  baseDelay[0] = 0;
+  baseDelay[1] = 0;
+  baseDelayTime = 0;
+  lastLossTime = 0;
+  pacerTokens = NET_CC_PACER_BURST * NET_MAX_PACKET_SIZE;
+  pacerTime = 0;
+  latestAckedSentAt = 0;
+  lastTimerCheck = 0;
+  ackWords[0] = 0;
+  ackWords[1] = 0;
+  ackPending = 0;
+  ackDue = 0;
+  lastAckSent = 0;
+  pingTime = 0;
+  resetTime = 0;
+  inSync = true;
+  hashFail = 0;
+  partnerHashTick = NET_HASH_NO_TICK;
+  SDL_AtomicSet(&desyncTick, (int)NET_HASH_NO_TICK);
+  sendStats.reset();
+  linkStats.reset();
+  clock.reset();
+  lastStatsTime = netTicks();
+
+  // The packet being written belongs to the game thread, which starts it again on its next write
+  SDL_AtomicSet(&sendReset, 1);
+
+  SDL_UnlockMutex(sendMut);
+}
+
+// Starts the send buffer again after resetSession, as the packet being written was numbered for the old partner
+// A message part written when the session was reset is marked to be dropped when it is committed
+// Only call from the game thread
+void NetworkConnection::restartSendBuf()
+{
+  SDL_LockMutex(sendMut);
+  SDL_AtomicSet(&sendReset, 0);
+  fragNum = 0;
+  msgDropped = msgOpen;
+  startSendBuf();
+  SDL_UnlockMutex(sendMut);
+}
+
+// Throws away the message being written, the rest of one started before the session was reset
+// Only call from the game thread
+void NetworkConnection::dropMessage()
+{
+  SDL_LockMutex(sendMut);
+
+  if (fragNum)
+  {
+    fragNum = 0;
+    startSendBuf();
+  }
+  else
+    sendSize = sendCommitted;
+
+  sendOpen = false;
+  SDL_UnlockMutex(sendMut);
+
+  msgOpen = false;
+  msgDropped = false;
 }
 
 
@@ -60,1001 +227,2843 @@ int NetworkConnection::setServerURL(char* url)
   return 0;
 }
 
-int NetworkConnection::connectToInternetServer()
+// Resolves the server's address and starts sending it connect messages on the network thread
+// Parameters:
+// next - the stage to move on to once the server replies, idle to stop there
+// Returns 1 if the attempt has started, 0 on errors
+int NetworkConnection::beginConnect(nc_state next)
 {
   IPaddress ip;
 
-  if (!connectedToInternetServer)
+  if (sessionID >= NET_MAX_SESSIONS)
+    return 0;
+
+  // obtain address information for server
+  if (SDLNet_ResolveHost(&ip, serverURL, 55777) < 0)
   {
-    // obtain address information for server
-    if (SDLNet_ResolveHost(&ip, serverURL, 55777) < 0)
-    {
-      //printf("SDLNet_ResolveHost: %s\n", SDLNet_GetError());
-      return 0;
-    }
+    //printf("SDLNet_ResolveHost: %s\n", SDLNet_GetError());
+    return 0;
+  }
 
-    //set the packet size to maximum to give it a large buffer
-    if (!packet)
-      packet = SDLNet_AllocPacket(NET_MAX_PACKET_SIZE);
+  if (!manager->start())
+    return 0;
 
-    if (!packet)
-    {
-      //printf("SDLNet_AllocPacket: %s\n", SDLNet_GetError());
-      return 0;
-    }
+  SDL_LockMutex(manager->sessionMut);
 
-    serverAddress = ip;
-    packet->address = ip;
+  leaveSession();
 
-    // create a socket descriptor listening on port 55777
-    if (!udpSD)
-      udpSD = SDLNet_UDP_Open(55777);
-  }
-  else
-  {
-    packet->address = serverAddress;
-    p2p = false;
-  }
+  if (serverBound)
+    manager->unbindAddress(serverAddress, this);
 
-  // send a "connect" message to the server to start a connection
-  char buf[4];
-  SDLNet_Write32(message_type_connect, buf);
-  memcpy(packet->data, buf, 4);
-  packet->len = 4;
+  serverAddress = ip;
+  serverBound = manager->bindAddress(ip, this) == 1;
 
-  if (!SDLNet_UDP_Send(udpSD, -1, packet))
+  if (!serverBound)
   {
-    //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
+    // Another connection on this manager is already using the server
+    SDL_UnlockMutex(manager->sessionMut);
     return 0;
   }
 
-  //set up timer for time-outs
-  Uint32 startTime = SDL_GetTicks();
-  Uint32 lastTime = startTime;
-  Uint32 currentTime;
+  connectedToInternetServer = false;
+  afterConnect = next;
+  setState(nc_state_connecting);
+
+  SDL_UnlockMutex(manager->sessionMut);
+
+  return 1;
+}
+
+int NetworkConnection::connectToInternetServer()
+{
+  if (!beginConnect(nc_state_idle))
+    return 0;
 
   // listen for confirmation packet from server
-  while (!SDLNet_UDP_Recv(udpSD, packet))
+  while (state == nc_state_connecting)
   {
-    currentTime = SDL_GetTicks();
+    if (manager->isPolled())
+      manager->poll();
 
-    //resend packet every 500ms if no confirmation recieved
-    if (currentTime > lastTime + 500)
-    {
-      SDLNet_Write32(message_type_connect, buf);
-      memcpy(packet->data, buf, 4);
-      packet->len = 4;
+    SDL_Delay(1);
+  }
 
-      if (!SDLNet_UDP_Send(udpSD, -1, packet))
-      {
-        //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
-        return 0;
-      }
+  return connectedToInternetServer ? 1 : 0;
+}
 
-      lastTime = currentTime;
-    }
+int NetworkConnection::startInternetHost()
+{
+  isHost = true;
 
-    // time-out if not recieved within 10s
-    if (currentTime > startTime + 10000)
-      return 0;
+  if (!beginConnect(nc_state_requestingHost))
+  {
+    pushEvent(nc_event_connectionFailed);
+    return 0;
   }
 
-  //printf("Packet recieved: address - %i", packet->address.host);
+  return 1;
+}
+
+int NetworkConnection::connectToHost()
+{
+  isHost = false;
 
-  connectedToInternetServer = true;
-  netFlag = 0;
+  if (!connectedToInternetServer)
+  {
+    if (!beginConnect(nc_state_findingHost))
+    {
+      pushEvent(nc_event_connectionFailed);
+      return 0;
+    }
 
-  //gThreadNet = SDL_CreateThread(netSendRecUDP, NULL, NULL);
+    return 1;
+  }
 
-  // set-up the send buffer to start a new message starting with send order
-  SDLNet_Write32(sendCount + 1, buf);
-  memcpy(sendBuff, buf, 4);
-  sendSize = 4;
+  SDL_LockMutex(manager->sessionMut);
+  leaveSession();
+  pushEvent(nc_event_connectedToServer);
+  setState(nc_state_findingHost);
+  SDL_UnlockMutex(manager->sessionMut);
 
   return 1;
 }
 
-int NetworkConnection::startInternetHost()
+int NetworkConnection::connectDirect(IPaddress address, bool host)
 {
-  threadNet = SDL_CreateThread(netStartHost, NULL, this);
-  if (!threadNet)
+  if (sessionID >= NET_MAX_SESSIONS || !manager->start())
     return 0;
 
-  return 1;
-}
+  SDL_LockMutex(manager->sessionMut);
 
-int NetworkConnection::connectToHost()
-{
-  threadNet = SDL_CreateThread(netConnectToHost, NULL, this);
-  if (!threadNet)
+  leaveSession();
+  isHost = host;
+
+  if (!startHolePunch(address, true))
+  {
+    SDL_UnlockMutex(manager->sessionMut);
     return 0;
+  }
+
+  SDL_UnlockMutex(manager->sessionMut);
 
   return 1;
 }
 
 int NetworkConnection::closeConnection()
 {
+  SDL_LockMutex(manager->sessionMut);
+
   if (connectedToInternetServer)
   {
     for (int i = 0; i < 3; i++)
       sendUdpMessage(message_type_quit, serverAddress);
+  }
 
-    if (p2p)
-    {
-      for (int i = 0; i < 3; i++)
-        sendUdpMessage(message_type_quit, partnerAddress);
-      p2p = false;
-    }
-
-    netFlag = -1;
-    SDL_WaitThread(threadNet, NULL);
-    threadNet = NULL;
+  if (p2p)
+  {
+    for (int i = 0; i < 3; i++)
+      sendUdpMessage(message_type_quit, partnerAddress);
   }
 
+  leaveSession();
+
+  SDL_UnlockMutex(manager->sessionMut);
+
   return 1;
 }
 
+nc_state NetworkConnection::getState()
+{
+  return state;
+}
 
-void NetworkConnection::addToSendBuf(Uint32 data)
+NetworkManager* NetworkConnection::getManager()
 {
-  if (sendSize >= NET_MAX_PACKET_SIZE)
-    return;
+  return manager;
+}
 
-  char buf[4];
-  SDLNet_Write32(data, buf);
-  memcpy(&sendBuff[sendSize], buf, 4);
+Uint32 NetworkConnection::getSessionID()
+{
+  return sessionID;
+}
 
-  //printf("Message Written: %i", data);
+int NetworkConnection::poll(NetEvent *events, int max)
+{
+  manager->poll();
 
-  sendSize += 4;
+  return pollEvents(events, max);
 }
 
-void NetworkConnection::sendUdpPacket()
+// Drops the partner and goes back to idle, the server address stays bound so the server can still be used
+// Call with the manager's sessionMut held
+void NetworkConnection::leaveSession()
 {
-  if (!packet)
-    return;
-  
-  if (packet->maxlen < sendSize)
-    return;
+  if (partnerBound)
+    manager->unbindAddress(partnerAddress, this);
 
-  memcpy(packet->data, sendBuff, sendSize);
-  packet->len = sendSize;
+  partnerBound = false;
+  p2p = false;
+  direct = false;
+  setState(nc_state_idle);
+}
 
-  // copy send buffer and push it to the sentPackets list
-  char* buf2 = new char[sendSize];
-  memcpy(buf2, sendBuff, sendSize);
-  PacketData pd;
-  pd.data = buf2;
-  pd.size = sendSize;
-  sentPackets.push_front(pd);
+// Moves to a new stage of the connection and sends its first message
+// Call with the manager's sessionMut held
+void NetworkConnection::setState(nc_state newState)
+{
+  Uint32 now = netTicks();
 
-  SDL_LockMutex(netMut);
+  state = newState;
+  stateSent = now;
 
-  if (p2p)
-    packet->address = partnerAddress;
+  if (state == nc_state_holePunching)
+    stateEnd = now + (direct ? NET_DIRECT_TIMEOUT : 1000);
+  else if (state == nc_state_connecting || state == nc_state_requestingHost || state == nc_state_findingHost)
+    stateEnd = now + 10000;
   else
-    packet->address = serverAddress;
-
-  SDL_UnlockMutex(netMut);
+    stateEnd = 0;
 
-  // Reset the send buffer by adding the new packet ID at the start
-  char buf[4];
-  sendCount++;
-  SDLNet_Write32(sendCount + 1, buf);
-  memcpy(sendBuff, buf, 4);
-  sendSize = 4;
+  sendStateMessage();
 }
 
-
-// Encodes a float as an int by multiplying it by 100000, thereby losing some precision
-// and also limiting the size of floats to be encoded
-// the size range should suit most purposes though
-// TODO: modify code to be lossless using a float standard
-int NetworkConnection::encodeFloat(float f)
+// Sends the message for the current stage, resent by update until it is answered
+void NetworkConnection::sendStateMessage()
 {
-  if (f > 21474.0 || f < -21474.0)
+  switch (state)
   {
-    //printf("encodeFloat error: number too large");
+  case nc_state_connecting:
+    sendUdpMessage(message_type_connect, serverAddress);
+    break;
+  case nc_state_requestingHost:
+    sendUdpMessage(message_type_startHost, serverAddress);
+    break;
+  case nc_state_hostWaiting:
+    sendUdpMessage(message_type_checkHost, serverAddress);
+    break;
+  case nc_state_findingHost:
+    sendUdpMessage(message_type_requestHost, serverAddress);
+    break;
+  case nc_state_holePunching:
+    sendUdpMessage(message_type_connect, partnerAddress);
+    break;
+  default:
+    break;
   }
-  return (int)(f*100000.0);
 }
 
-Uint32 NetworkConnection::readMessage()
+// Routes packets from an address to this connection as its partner, in place of any earlier partner address
+// Call with the manager's sessionMut held
+// Returns 1 on success, 0 if the address belongs to another connection on the manager
+int NetworkConnection::bindPartner(IPaddress address)
 {
-  Uint32 msg;
+  if (partnerBound)
+    manager->unbindAddress(partnerAddress, this);
 
-  while (!pullMessage(&msg))
-  {
-    SDL_Delay(10);
-  }
+  partnerAddress = address;
+  partnerBound = manager->bindAddress(address, this) == 1;
 
-  return msg;
+  return partnerBound ? 1 : 0;
 }
 
-bool NetworkConnection::pullMessage(Uint32 *msg)
+// Returns true once a partner has been found and data can be sent to it
+bool NetworkConnection::hasPartner()
 {
+  return state == nc_state_holePunching || state == nc_state_connected;
+}
 
+// Attempts to form a peer-to-peer connection with the client the server has paired this one with
+// To do this we use udp hole punching, both clients send connect messages to each other's address as seen by the
+// server and reply to any that get through with a ping
+// Parameters:
+// pack - the server's message holding the partner's address
+void NetworkConnection::startHolePunch(UDPpacket *pack)
+{
+  IPaddress address;
 
-  if (messageQueue.empty())
-    return false;
-
-  if (SDL_LockMutex(msgMut) == -1)
-  {
-    //printf("msgMut lock failed");
-    return false;
-  }
-
-  *msg = messageQueue.front();
-  messageQueue.pop();
-
-  SDL_UnlockMutex(msgMut);
+  // get the address of target client from packet data
+  address.host = SDLNet_Read32(&pack->data[4]);
+  address.port = SDLNet_Read16(&pack->data[8]);
 
-  //printf("Message Read: %i", *msg);
-  return true;
+  startHolePunch(address, false);
 }
 
-// Decodes a float encoded by encodeFloat
-float NetworkConnection::decodeFloat(int u)
+// Starts hole punching with a partner
+// Call with the manager's sessionMut held
+// Parameters:
+// address - the partner's address
+// direct - true when there is no server to fall back on, data then only goes to the partner
+// Returns 1 on success, 0 if the address belongs to another connection on the manager
+int NetworkConnection::startHolePunch(IPaddress address, bool direct)
 {
-  return ((float)u) / 100000.0;
-}
+  resetSession();
+  if (!bindPartner(address) && direct)
+    return 0;
 
+  this->direct = direct;
+  p2p = direct;
 
-void NetworkConnection::updateHash(Uint32 hash)
-{
-  memmove(&this->hash[1], &this->hash, HASH_NUM - 1);
-  this->hash[0] = hash;
-}
+  // Data and checks already go through the server while hole punching
+  Uint32 now = netTicks();
+  partnerAlive = true;
+  lastCheckSent = now;
+  lastReceived = now;
+  lastServerPing = now;
 
-bool NetworkConnection::playersInSync()
-{
-  return inSync;
+  setState(nc_state_holePunching);
+
+  return 1;
 }
 
-void NetworkConnection::pause()
+// Starts exchanging data with the partner once hole punching has worked or timed out
+void NetworkConnection::finishHolePunch()
 {
-  //set pause time to max Uint32 value
-  pauseTime = (Uint32)-1;
+  setState(nc_state_connected);
+
+  if (isHost)
+    pushEvent(nc_event_foundClient, &partnerAddress);
+  else if (direct)
+    pushEvent(nc_event_foundHost, &partnerAddress);
 }
 
-void NetworkConnection::pause(Uint32 time)
+void NetworkConnection::addToSendBuf(Uint32 data)
 {
-  pauseTime = SDL_GetTicks() + time;
+  writeU32(data);
 }
 
-void NetworkConnection::unpause()
+int NetworkConnection::sendUdpPacket()
 {
-  pauseTime = 0;
+  return commit();
 }
 
-bool NetworkConnection::paused()
+// Points the send buffer at the slot in the send window for the next packet and writes its header
+// If the window is full the packet is written to sendBuff and copied into the window once there is room
+// Unreliable packets are not kept so are written to unreliableBuff
+// Fragments after the first of a large message take the slots following it
+void NetworkConnection::startSendBuf()
 {
-  if (pauseTime)
+  Uint32 header = NET_PACKET_DATA | ((Uint32)sendChannel << NET_CHANNEL_SHIFT);
+
+  if (sendChannel == net_channel_unreliableSequenced)
   {
-    if (SDL_GetTicks() < pauseTime)
-    {
-      return true;
-    }
+    sendData = unreliableBuff;
+    header |= (unreliableSendCount + 1) & NET_SEQ_MASK;
+  }
+  else
+  {
+    SDL_LockMutex(sendMut);
+
+    if (sendCount + fragNum - ackedPackID < NET_SEND_WINDOW)
+      sendData = sentPackets[(sendCount + 1 + fragNum) & (NET_SEND_WINDOW - 1)].data;
     else
-    {
-      pauseTime = 0;
-    }
+      sendData = sendBuff;
+
+    SDL_UnlockMutex(sendMut);
+
+    header |= (sendCount + 1 + fragNum) & NET_SEQ_MASK;
   }
 
-  return false;
-}
+  // Fragments are marked so they can be put back together before they are read
+  if (fragNum)
+    header |= NET_FLAG_FRAGMENT;
 
-float NetworkConnection::getPingTime()
-{
-  return pingTime;
-}
+  // Every traceInterval-th packet sent is traced, its times are filled in as it is written and transmitted
+  // traceNum only counts packets once they are sent, so a packet started again gets the same ID
+  sendTraced = traceInterval && !fragNum && (traceNum + 1) % traceInterval == 0;
+  if (sendTraced)
+  {
+    header |= NET_FLAG_TRACED;
+    SDLNet_Write32(traceNum + 1, &sendData[NET_DATA_HEADER]);
+    memset(&sendData[NET_DATA_HEADER + 4], 0, NET_TRACE_SIZE - 4);
+  }
 
-void NetworkConnection::newGame()
-{
-  startTime = SDL_GetTicks();
+  // The acknowledgement words are filled in as the packet is transmitted
+  SDLNet_Write32(header, sendData);
+  sendSize = NET_DATA_HEADER + (sendTraced ? NET_TRACE_SIZE : 0);
+
+  if (sendChannel == net_channel_reliableOrdered)
+  {
+    SDLNet_Write32(orderedSendCount + 1 + fragNum, &sendData[sendSize]);
+    sendSize += 4;
+  }
+
+  if (fragNum)
+  {
+    // The fragment count is filled in once the message is finished
+    SDLNet_Write32(fragNum << 16, &sendData[sendSize]);
+    sendSize += 4;
+  }
+
+  sendHeaderSize = sendSize;
+  sendCommitted = sendSize;
 }
 
-// Sends a packet with information on number of packs recieved and missing packs
-// Also contains hash state information for sync checking
-int NetworkConnection::sendCheckPacket(UDPpacket* packet)
+// Ends the current packet as a fragment of the message being written and moves on to the next slot
+// Fragments are not sent until the whole message is committed
+// Returns 1 on success, 0 if the message cannot be fragmented or the send window has no room
+int NetworkConnection::startFragment()
 {
-  char buf[512];
-  SDLNet_Write32(65535, buf);
-  SDLNet_Write32(SDL_GetTicks() - startTime, &buf[4]);
-  SDLNet_Write32(hash[0], &buf[8]);
-  SDLNet_Write32(minPackRcvd, &buf[12]);
-  SDLNet_Write32(sendCount, &buf[16]);
+  if (sendChannel == net_channel_unreliableSequenced || fragNum + 1 >= NET_MAX_FRAGMENTS || sendData == sendBuff)
+    return 0;
+
+  SDL_LockMutex(sendMut);
+  bool room = sendCount + fragNum + 1 - ackedPackID < NET_SEND_WINDOW;
+  SDL_UnlockMutex(sendMut);
+
+  if (!room)
+    return 0;
 
-  int n = 5;
+  // Fragments must hold whole messages, so any part written word is carried over to the next one
+  // along with the last word of the first fragment, to make room for its fragment word
+  bool insertWord = fragNum == 0;
+  Uint32 carry = (sendSize & 3) + (insertWord ? 4 : 0);
 
-  // Iterate over missingPackList and write the packet IDs to the check message
-  for (std::list<Uint32>::iterator it = missingPackList.begin(); it != missingPackList.end(); ++it)
+  if (sendSize - sendHeaderSize < carry + 4)
+    return 0;
+
+  char tail[8];
+  memcpy(tail, &sendData[sendSize - carry], carry);
+  sendSize -= carry;
+
+  if (insertWord)
   {
-    SDLNet_Write32(*it, &buf[n * 4]);
-    n++;
+    memmove(&sendData[sendHeaderSize + 4], &sendData[sendHeaderSize], sendSize - sendHeaderSize);
+    SDLNet_Write32(SDLNet_Read32(sendData) | NET_FLAG_FRAGMENT, sendData);
+    SDLNet_Write32(0, &sendData[sendHeaderSize]);
+    sendSize += 4;
   }
 
-  if (SDL_LockMutex(netMut) == -1)
+  sentPackets[(sendCount + 1 + fragNum) & (NET_SEND_WINDOW - 1)].size = sendSize;
+
+  fragNum++;
+  startSendBuf();
+
+  memcpy(&sendData[sendSize], tail, carry);
+  sendSize += carry;
+
+  return 1;
+}
+
+int NetworkConnection::setSendChannel(net_channel channel)
+{
+  if (channel == sendChannel)
+    return 1;
+
+  if (!flush())
     return 0;
 
-  memcpy(packet->data, buf, n * 4);
-  packet->len = n * 4;
+  sendChannel = channel;
+  startSendBuf();
 
-  if (p2p)
-    packet->address = partnerAddress;
-  else
-    packet->address = serverAddress;
+  return 1;
+}
 
-  if (!SDLNet_UDP_Send(udpSD, -1, packet))
-  {
-    //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
+int NetworkConnection::setSendMode(net_send_mode mode, Uint32 maxDelay)
+{
+  if (!flush())
     return 0;
-  }
 
-  SDL_UnlockMutex(netMut);
+  SDL_LockMutex(sendMut);
+  sendMode = mode;
+  maxSendDelay = maxDelay;
+  SDL_UnlockMutex(sendMut);
 
   return 1;
 }
 
-// The main function for handling incoming messages
-int sendRecUDP(void* data)
+int NetworkConnection::flush()
 {
-  NetworkConnection *net = (NetworkConnection*)data;
-  char buf[512];
-  static int id = 123000;
-  int thisId = id++;
-  UDPpacket *pack, *packetOut;
-  Uint32 minPackRvd = 0;
+  if (!hasPartner())
+    return 0;
+
+  if (SDL_AtomicGet(&sendReset))
+    restartSendBuf();
+
+  if (msgDropped)
+    dropMessage();
+
+  if (sendSize == sendHeaderSize)
+    return 1;
 
-  pack = SDLNet_AllocPacket(512);
-  pack->address = net->packet->address;
-  packetOut = SDLNet_AllocPacket(512);
-  packetOut->address = net->packet->address;
+  // Anything written so far is treated as a complete message
+  padSendBuf();
 
-  bool connected = true;
-  Uint32 time = SDL_GetTicks();
-  Uint32 lastTime = time;
-  Uint32 lastCheck = time;
-  Uint32 lastTimeServer = time;
+  SDL_LockMutex(sendMut);
+  sendCommitted = sendSize;
+  sendOpen = false;
+  int result = closePacket();
+  SDL_UnlockMutex(sendMut);
 
-  bool acceptLastPack = false;
+  msgOpen = false;
 
-  int hashFail = 0;
+  return result;
+}
+
+char* NetworkConnection::reserve(Uint32 size)
+{
+  if (SDL_AtomicGet(&sendReset))
+    restartSendBuf();
 
-  Uint32 playerTime = 0;
-    
-  while (net->netFlag >= 0) // Exits when netFlag is set to less than 0
+  if (!msgOpen)
   {
-    Uint32 currentTime = SDL_GetTicks();
+    msgOpen = true;
 
-    int timeLen;
-        
-    if (connected && currentTime > lastCheck + 2000)
+    // Stop the network thread sending coalesced messages while this one is part written
+    if (sendMode == net_send_coalesce)
     {
-      // No message has been received in the last 2 seconds
-      net->pushEvent(nc_event_connectionLost);
-      connected = false;
+      SDL_LockMutex(sendMut);
+      sendOpen = true;
+      SDL_UnlockMutex(sendMut);
     }
+  }
 
-    if (minPackRvd == net->sendCount)
-      timeLen = 500;
-    else
-      timeLen = 200; // Send checks out faster while waiting for missing packets
+  // Try again for a window slot if the packet was started while the window was full
+  if (sendData == sendBuff && sendSize == sendHeaderSize)
+    startSendBuf();
 
-    // Send regular check packets
-    if (currentTime > lastTime + timeLen)
+  if (sendSize + size > NET_MAX_PACKET_SIZE)
+  {
+    if (sendCommitted > sendHeaderSize)
     {
-      lastTime = currentTime;
+      // Send the coalesced messages and carry the part written message over to a new packet
+      char partial[NET_MAX_PACKET_SIZE];
+      Uint32 partialSize = sendSize - sendCommitted;
+      memcpy(partial, &sendData[sendCommitted], partialSize);
 
-      net->sendCheckPacket(pack);
-    }
+      SDL_LockMutex(sendMut);
+      sendSize = sendCommitted;
+      int sent = closePacket();
+      SDL_UnlockMutex(sendMut);
 
-    // Send packets to server during peer-to-peer connection to maintain connection
-    if (net->p2p)
-    {
-      if (currentTime > lastTimeServer + 30000)
+      if (!sent)
       {
-        lastTimeServer = currentTime;
-        net->sendUdpMessage(message_type_ping, net->serverAddress);
+        sendSize += partialSize;
+        return NULL;
       }
+
+      // The carried over message is the first in the new packet
+      if (sendTraced)
+        SDLNet_Write32((Uint32)netMicros(), &sendData[NET_DATA_HEADER + 4]);
+
+      memcpy(&sendData[sendSize], partial, partialSize);
+      sendSize += partialSize;
     }
 
-    // Handel incoming packets
-    if (SDLNet_UDP_Recv(net->udpSD, pack))
+    // Messages too large for one packet are split into fragments
+    if (sendSize + size > NET_MAX_PACKET_SIZE)
     {
-      lastCheck = currentTime;
+      if (!startFragment() || sendSize + size > NET_MAX_PACKET_SIZE)
+        return NULL;
+    }
+  }
 
-      if (!connected)
-      {
-        connected = true;
-        net->pushEvent(nc_event_reconnected);
-      }
+  // A traced packet's time starts as its first message is written
+  if (sendTraced && sendSize == sendHeaderSize)
+    SDLNet_Write32((Uint32)netMicros(), &sendData[NET_DATA_HEADER + 4]);
 
-      if (pack->len >= 4)
-      {
-        memcpy(buf, pack->data, pack->len);
+  char* data = &sendData[sendSize];
+  sendSize += size;
 
-        bool check = false;
+  return data;
+}
 
-        for (int i = 0; i < pack->len / 4; i++)
-        {
-          char u[4];
-          memcpy(u, &buf[i * 4], 4);
+int NetworkConnection::writeU8(Uint8 data)
+{
+  char* buf = reserve(1);
+  if (!buf)
+    return 0;
 
-          if (i == 0)
-          {
-            Uint32 packID = SDLNet_Read32(u);
-            //if (packID != message_type_check)
-            //  printf("Packet received id:%i length:%i port:%i\n", packID, pack->len, pack->address.port);
-
-            if (packID == message_type_check)
-            {
-              check = true;
-            }
-            else if (packID == message_type_quit)
-            {
-              net->pushEvent(nc_event_playerQuit);
-            }
-            else if (packID == message_type_ping)
-            {
-              if (pack->len == 8)
-              {
-                memcpy(u, &buf[4], 4);
-                int t = SDLNet_Read32(u);
-                t = SDL_GetTicks() - net->startTime - SDLNet_Read32(u);
-
-                //printf("T: %u", t);
-
-                i++;
-                if (net->pingTime == 0)
-                {
-                  net->pingTime = t;
-                }
-                else
-                {
-                  net->pingTime = (net->pingTime * 15 + t) / 16.0;
-                  //printf("Pingtime: %f", net->pingTime);
-                }
-              }
-            }
-            else if (packID > 10000 || (packID == net->lastPackID && !acceptLastPack))
-              break;
-            else if (packID <= net->lastPackID) // if packet is out of order
-            {
-              if (packID == net->lastPackID)
-                acceptLastPack = false;
-
-              int size = net->missingPackList.size();
-
-              net->missingPackList.remove(packID);
-
-              if (size == net->missingPackList.size())
-                break;
-            }
-            else
-            {
-              if (packID > net->lastPackID + 1) // if packet number is larger than expected
-              {
-                for (int i = net->lastPackID + 1; i < packID; i++)
-                {
-                  net->missingPackList.push_front(i);
-                }
-              }
-
-              lastTime = 0;
-
-              net->lastPackID = packID;
-              if (net->missingPackList.empty())
-                net->minPackRcvd = packID;
-              acceptLastPack = false;
-            }
+  *buf = (char)data;
+  return 1;
+}
 
-          }
-          else if (check) // If it is a check packet
-          {
-            if (i == 1) // Time packet was sent
-            {
-              playerTime = SDLNet_Read32(u);
-
-              SDLNet_Write32(message_type_ping, buf);
-              SDLNet_Write32(playerTime, &buf[4]);
-
-              memcpy(packetOut->data, buf, 8);
-
-              packetOut->len = 8;
-
-              if (net->p2p)
-                packetOut->address = net->partnerAddress;
-              else
-                packetOut->address = net->serverAddress;
-
-              SDL_LockMutex(net->netMut);
-              SDLNet_UDP_Send(net->udpSD, -1, packetOut);
-              SDL_UnlockMutex(net->netMut);
-
-            }
-            else if (i == 2) // State hash
-            {
-              int hash1 = SDLNet_Read32(u);
-
-              int n = 0;
-
-              //printf("My Hash = %i    Their Hash = %i", net->hash[0], hash1);
-
-              if (n < HASH_NUM && net->pauseTime == 0)
-              {
-                bool fail = true;
-
-                // Check against previous hashes for this client
-                for (n = 0; n < HASH_NUM; n++)
-                {
-                  if (net->hash[n] == hash1)
-                  {
-                    fail = false;
-                    break;
-                  }
-                }
-
-                if (fail)
-                {
-                  hashFail++;
-                  if (hashFail > 3)
-                  {
-                    net->inSync = false;
-                  }
-                }
-                else
-                {
-                  hashFail = 0;
-                  net->inSync = true;
-                }
-              }
-              else
-              {
-                hashFail = 0;
-              }
-            }
-            else if (i == 3) // All packets up to this number have been received, so are safe to clear
-            {
-              minPackRvd = SDLNet_Read32(u);              
-            }
-            else if (i == 4) // The total number of message packets sent
-            {
-              Uint32 numPacksSent = SDLNet_Read32(u);
-              if (numPacksSent > net->lastPackID)
-              {
-                for (int i = net->lastPackID + 1; i < numPacksSent + 1; i++)
-                {
-                  net->missingPackList.push_front((Uint32)i);
-                }
-                net->lastPackID = numPacksSent;
-                acceptLastPack = true;
-                lastTime = 0;
-              }
-            }
-            else // The rest are IDs of missing packets
-            {
-              Uint32 missingID = SDLNet_Read32(u);
-              
-              //Iterate through sentPackets
-              for (std::list<PacketData>::iterator it = net->sentPackets.begin(); it != net->sentPackets.end(); ++it)
-              {
-                PacketData pd = *it;
-                char tmp[4];
-                memcpy(tmp, pd.data, 4);
-                Uint32 id = SDLNet_Read32(tmp);
-
-                if (id == missingID)
-                {
-                  // Resend missing packets
-                  Uint32 size = pd.size;
-
-                  memcpy(packetOut->data, pd.data, size);
-
-                  packetOut->len = size;
-
-                  if (net->p2p)
-                    packetOut->address = net->partnerAddress;
-                  else
-                    packetOut->address = net->serverAddress;
-
-                  SDL_LockMutex(net->netMut);
-                  SDLNet_UDP_Send(net->udpSD, -1, packetOut);
-                  SDL_UnlockMutex(net->netMut);
-                }
-
-                // Erase packets that have definitely been received
-                if (id < minPackRvd)
-                {
-                  net->sentPackets.erase(it);
-                  delete(pd.data);
-                }
-              }
-            }
-          }
-          else // i != 0 and not a check packet
-          {
-            //char* data = new char[4];						
-            Uint32 data = SDLNet_Read32(u);
+int NetworkConnection::writeU16(Uint16 data)
+{
+  char* buf = reserve(2);
+  if (!buf)
+    return 0;
+
+  SDLNet_Write16(data, buf);
+  return 1;
+}
+
+int NetworkConnection::writeU32(Uint32 data)
+{
+  char* buf = reserve(4);
+  if (!buf)
+    return 0;
+
+  SDLNet_Write32(data, buf);
+  return 1;
+}
+
+int NetworkConnection::writeBytes(const void* data, Uint32 size)
+{
+  const char* src = (const char*)data;
+
+  // Write in pieces that fit the space left so large writes can be split across fragments
+  while (size > 0)
+  {
+    Uint32 chunk = NET_MAX_PACKET_SIZE - sendSize;
+    if (chunk > size)
+      chunk = size;
+    if (chunk == 0)
+      chunk = size < 4 ? size : 4;
+
+    char* buf = reserve(chunk);
+    if (!buf)
+      return 0;
+
+    memcpy(buf, src, chunk);
+    src += chunk;
+    size -= chunk;
+  }
+
+  return 1;
+}
+
+int NetworkConnection::commit()
+{
+  if (!hasPartner())
+    return 0;
+
+  if (SDL_AtomicGet(&sendReset))
+    restartSendBuf();
+
+  // The message was started for the partner before the session was reset
+  if (msgDropped)
+  {
+    dropMessage();
+    return 1;
+  }
+
+  padSendBuf();
+
+  msgOpen = false;
+
+  SDL_LockMutex(sendMut);
+
+  if (sendMode == net_send_coalesce)
+  {
+    // Hold the message to be sent with later ones unless it has waited long enough already
+    if (sendCommitted == sendHeaderSize)
+      pendingSince = netTicks();
+
+    sendCommitted = sendSize;
+    sendOpen = false;
+
+    // A fragmented message is sent straight away so nothing is coalesced with its last fragment
+    int result = 1;
+    if (fragNum || netTicks() - pendingSince >= maxSendDelay)
+      result = closePacket();
+
+    SDL_UnlockMutex(sendMut);
+    return result;
+  }
+
+  sendCommitted = sendSize;
+  int result = closePacket();
+
+  SDL_UnlockMutex(sendMut);
+
+  return result;
+}
+
+// Pad to a whole number of messages as they are read back 32 bits at a time
+void NetworkConnection::padSendBuf()
+{
+  while (sendSize & 3)
+    sendData[sendSize++] = 0;
+}
+
+// Sends the complete messages in the packet being written and starts a new packet
+// Reliable packets are published to the send window before they are sent
+// Call with sendMut held
+// Returns 1 on success, 0 if the send window is full, in which case the packet is left as it is
+int NetworkConnection::closePacket()
+{
+  // The packet was numbered for the partner before the session was reset, the game thread starts it again
+  if (SDL_AtomicGet(&sendReset))
+    return 0;
+
+  // Unreliable packets are sent straight away and forgotten, they are not held back by the congestion window
+  // but still use up the pacer's allowance
+  if (sendChannel == net_channel_unreliableSequenced)
+  {
+    Uint64 now = netMicros();
+    refillPacer(now);
+    pacerTokens -= sendCommitted;
+    stampTrace(sendData, now, 1);
+    sendDatagram(sendData, compressPacket(sendData, sendCommitted));
+    unreliableSendCount++;
+    traceNum++;
+    startSendBuf();
+    return 1;
+  }
+
+  if (sendCount - ackedPackID >= NET_SEND_WINDOW)
+  {
+    if (!sendWindowFull)
+      pushEvent(nc_event_sendWindowFull);
+
+    sendWindowFull = true;
+    return 0;
+  }
+
+  Uint32 packets = fragNum + 1;
+  PacketData *pd = &sentPackets[(sendCount + packets) & (NET_SEND_WINDOW - 1)];
+
+  // Only copied when the packet was written while the window was full
+  if (sendData != pd->data)
+    memcpy(pd->data, sendData, sendCommitted);
+
+  pd->size = sendCommitted;
+
+  // Now the message is finished each fragment can be given the fragment count, after the order word if it has one
+  if (fragNum)
+  {
+    int orderSize = sendChannel == net_channel_reliableOrdered ? 4 : 0;
+
+    for (Uint32 i = 0; i < packets; i++)
+    {
+      char* data = sentPackets[(sendCount + 1 + i) & (NET_SEND_WINDOW - 1)].data;
+      SDLNet_Write32((i << 16) | packets, &data[dataHeaderSize(data) + orderSize]);
+    }
+  }
+
+  // Compressed once here so resends go out compressed without compressing again
+  for (Uint32 i = 0; i < packets; i++)
+  {
+    pd = &sentPackets[(sendCount + 1 + i) & (NET_SEND_WINDOW - 1)];
+    pd->size = compressPacket(pd->data, pd->size);
+  }
+
+  for (Uint32 i = 0; i < packets; i++)
+  {
+    sendCount++;
+
+    if (sendChannel == net_channel_reliableOrdered)
+      orderedSendCount++;
+
+    pd = &sentPackets[sendCount & (NET_SEND_WINDOW - 1)];
+    pd->transmissions = 0;
+    pd->resend = false;
+    pd->sacked = false;
+  }
+
+  fragNum = 0;
+  traceNum++;
+  startSendBuf();
+
+  // Send what the congestion window allows now, the network thread sends the rest as it opens
+  pumpSends();
+
+  return 1;
+}
+
+// Compresses the payload of a data packet in place if the partner can decompress it and it comes out smaller
+// The header and any trace block stay as they are, so acknowledgements and times can still be written into them,
+// and the packet is flagged as compressed
+// Call with sendMut held
+// Returns the packet's new size
+int NetworkConnection::compressPacket(char *data, int len)
+{
+  int header = dataHeaderSize(data);
+
+  if (!compressSend || len <= header)
+    return len;
+
+  char out[NET_MAX_PACKET_SIZE];
+  int size = compressor.compress((const Uint8*)&data[header], len - header, (Uint8*)out,
+    NET_MAX_PACKET_SIZE - header);
+
+  if (!size)
+    return len;
+
+  memcpy(&data[header], out, size);
+  SDLNet_Write32(SDLNet_Read32(data) | NET_FLAG_COMPRESSED, data);
+
+  NetSendStats *st = sendStats.beginWrite();
+  st->packetsCompressed++;
+  st->bytesSaved += len - header - size;
+  sendStats.endWrite();
+
+  return header + size;
+}
+
+// Sends waiting packets as far as the congestion window and pacer allow
+// Packets found to be lost are resent first, they are already counted as in flight
+void NetworkConnection::pumpSends()
+{
+  SDL_LockMutex(sendMut);
+
+  Uint64 now = netMicros();
+  refillPacer(now);
+
+  Uint32 resent = 0;
+  Uint32 sent = 0;
+
+  // Retransmission timers only need checking about once a millisecond
+  if (now - lastTimerCheck >= 1000)
+  {
+    lastTimerCheck = now;
+    checkTimers(now);
+  }
+
+  for (Uint32 id = ackedPackID + 1; resendPending && id <= sentCount && pacerTokens > 0; id++)
+  {
+    PacketData *pd = &sentPackets[id & (NET_SEND_WINDOW - 1)];
+    if (!pd->resend)
+      continue;
+
+    pd->resend = false;
+    resendPending--;
+    pd->sentAt = now;
+    if (pd->transmissions < 255)
+      pd->transmissions++;
+    pacerTokens -= pd->size;
+    stampTrace(pd->data, now, pd->transmissions);
+    sendDatagram(pd->data, pd->size);
+    resent++;
+  }
+
+  while (sentCount < sendCount && pacerTokens > 0)
+  {
+    PacketData *pd = &sentPackets[(sentCount + 1) & (NET_SEND_WINDOW - 1)];
+
+    // Always allow one packet in flight so a small window cannot stall the connection
+    if (bytesInFlight > 0 && bytesInFlight + pd->size > congestionWindow)
+      break;
+
+    sentCount++;
+    pd->sentAt = now;
+    pd->transmissions = 1;
+    bytesInFlight += pd->size;
+    pacerTokens -= pd->size;
+    stampTrace(pd->data, now, 1);
+    sendDatagram(pd->data, pd->size);
+    sent++;
+  }
+
+  NetSendStats *st = sendStats.beginWrite();
+  st->dataPacketsSent += sent;
+  st->retransmits += resent;
+  st->sendWindowUsed = sendCount - ackedPackID;
+  st->bytesInFlight = bytesInFlight;
+  st->congestionWindow = (Uint32)congestionWindow;
+  sendStats.endWrite();
+
+  SDL_UnlockMutex(sendMut);
+}
+
+// Adds the pacer's allowance for the time since it was last refilled
+// The pacer sends a little faster than one window per round trip so it does not hold the window back
+// Call with sendMut held
+void NetworkConnection::refillPacer(Uint64 now)
+{
+  float burst = NET_CC_PACER_BURST * NET_MAX_PACKET_SIZE;
+
+  if (srtt == 0)
+    pacerTokens = burst;
+  else
+    pacerTokens += congestionWindow * 1.25f * (float)(now - pacerTime) / srtt;
+
+  if (pacerTokens > burst)
+    pacerTokens = burst;
+
+  pacerTime = now;
+}
+
+// Records a round trip time in microseconds measured by a check packet and its reply or by an acknowledgement
+// The retransmission timeout is the smoothed round trip time plus four times its mean deviation (Jacobson/Karels),
+// plus the time the partner may hold its acknowledgement so a delayed acknowledgement is not taken for a loss
+// The current delay is the lowest of the last few samples to filter out jitter and the base delay is the lowest
+// in the last one to two minutes, so the controller follows route changes
+void NetworkConnection::rttSample(Uint32 rtt)
+{
+  SDL_LockMutex(sendMut);
+
+  if (srtt == 0)
+  {
+    srtt = rtt;
+    rttVar = rtt / 2;
+  }
+  else
+  {
+    Uint32 err = rtt > srtt ? rtt - srtt : srtt - rtt;
+    rttVar = (Uint32)(((Uint64)rttVar * 3 + err) / 4);
+    srtt = (Uint32)(((Uint64)srtt * 7 + rtt) / 8);
+  }
+
+  rto = srtt + 4 * rttVar + NET_ACK_DELAY * 1000;
+  if (rto < NET_RTO_MIN * 1000)
+    rto = NET_RTO_MIN * 1000;
+  if (rto > NET_RTO_MAX * 1000)
+    rto = NET_RTO_MAX * 1000;
+
+  delaySamples[delaySampleNum % NET_CC_DELAY_SAMPLES] = rtt;
+  delaySampleNum++;
+
+  Uint64 now = netMicros();
+  if (baseDelayTime == 0 || now - baseDelayTime > 60000000)
+  {
+    baseDelay[1] = baseDelay[0];
+    baseDelay[0] = rtt;
+    baseDelayTime = now;
+  }
+  else if (rtt < baseDelay[0])
+    baseDelay[0] = rtt;
+
+  NetSendStats *st = sendStats.beginWrite();
+  if (st->rttSamples)
+  {
+    // Jitter as in RFC 3550, a running mean of the change between consecutive samples
+    Uint32 change = rtt > st->rttLast ? rtt - st->rttLast : st->rttLast - rtt;
+    st->jitter = (Uint32)(((Uint64)st->jitter * 15 + change) / 16);
+  }
+  if (!st->rttSamples || rtt < st->rttMin)
+    st->rttMin = rtt;
+  if (rtt > st->rttMax)
+    st->rttMax = rtt;
+  st->rttSamples++;
+  st->rttTotal += rtt;
+  st->rttLast = rtt;
+  st->rttSmoothed = srtt;
+  st->rttHistogram[netRttBucket(rtt)]++;
+  sendStats.endWrite();
+
+  SDL_UnlockMutex(sendMut);
+}
+
+// Grows or shrinks the congestion window in proportion to how far the queuing delay is from the target
+// The window only grows when it was limiting what could be sent
+// Parameters:
+// bytes - the number of bytes newly acknowledged
+// flight - the number of bytes in flight before they were acknowledged
+// Call with sendMut held
+void NetworkConnection::congestionAck(Uint32 bytes, Uint32 flight)
+{
+  float target = NET_CC_TARGET_DELAY * 1000.0f;
+  float offTarget = (target - queuingDelay()) / target;
+  if (offTarget < -1)
+    offTarget = -1;
+
+  if (offTarget > 0 && flight < congestionWindow / 2)
+    return;
+
+  congestionWindow += offTarget * bytes * NET_MAX_PACKET_SIZE / congestionWindow;
+
+  if (congestionWindow < NET_CC_MIN_WINDOW * NET_MAX_PACKET_SIZE)
+    congestionWindow = NET_CC_MIN_WINDOW * NET_MAX_PACKET_SIZE;
+  if (congestionWindow > NET_SEND_WINDOW * NET_MAX_PACKET_SIZE)
+    congestionWindow = NET_SEND_WINDOW * NET_MAX_PACKET_SIZE;
+}
+
+// Returns the current delay above the base delay in microseconds, 0 until the round trip time has been measured
+// The current delay is the lowest of the last few samples so jitter is not taken for queuing
+// Call with sendMut held
+Uint32 NetworkConnection::queuingDelay()
+{
+  if (!delaySampleNum)
+    return 0;
+
+  Uint32 current = delaySamples[0];
+  for (Uint32 i = 1; i < NET_CC_DELAY_SAMPLES && i < delaySampleNum; i++)
+  {
+    if (delaySamples[i] < current)
+      current = delaySamples[i];
+  }
+
+  Uint32 base = baseDelay[0];
+  if (baseDelay[1] && baseDelay[1] < base)
+    base = baseDelay[1];
+
+  return current > base ? current - base : 0;
+}
+
+// Shrinks the congestion window when a packet is lost, at most once per round trip
+// Loss along with queuing delay means the path is congested and the window is halved, loss on a path with
+// empty queues is more likely to be noise such as on wireless links so the window is only trimmed
+// Call with sendMut held
+void NetworkConnection::congestionLoss(Uint64 now)
+{
+  Uint32 rtt = srtt ? srtt : NET_CC_INITIAL_RTT * 1000;
+  if (lastLossTime && now - lastLossTime < rtt)
+    return;
+
+  lastLossTime = now;
+
+  if (queuingDelay() * 2 >= NET_CC_TARGET_DELAY * 1000)
+    congestionWindow /= 2;
+  else
+    congestionWindow *= 0.875f;
+  if (congestionWindow < NET_CC_MIN_WINDOW * NET_MAX_PACKET_SIZE)
+    congestionWindow = NET_CC_MIN_WINDOW * NET_MAX_PACKET_SIZE;
+}
+
+Uint32 NetworkConnection::getCongestionWindow()
+{
+  SDL_LockMutex(sendMut);
+  Uint32 window = (Uint32)congestionWindow;
+  SDL_UnlockMutex(sendMut);
+
+  return window;
+}
+
+Uint32 NetworkConnection::getSendRate()
+{
+  SDL_LockMutex(sendMut);
+  Uint32 rate = srtt ? (Uint32)(congestionWindow * 1.25f * 1000000.0f / srtt) : 0;
+  SDL_UnlockMutex(sendMut);
+
+  return rate;
+}
+
+Uint32 NetworkConnection::getRetransmitTimeout()
+{
+  SDL_LockMutex(sendMut);
+  Uint32 timeout = rto / 1000;
+  SDL_UnlockMutex(sendMut);
+
+  return timeout;
+}
+
+// Marks packets whose retransmission timer has run out to be resent
+// Each packet's timeout doubles with every time it has been sent, so a path that has stopped delivering
+// is not flooded with resends
+// Call with sendMut held
+void NetworkConnection::checkTimers(Uint64 now)
+{
+  for (Uint32 id = ackedPackID + 1; id <= sentCount; id++)
+  {
+    PacketData *pd = &sentPackets[id & (NET_SEND_WINDOW - 1)];
+    if (pd->sacked || pd->resend)
+      continue;
+
+    Uint64 timeout = (Uint64)rto << (pd->transmissions > 8 ? 7 : pd->transmissions - 1);
+    if (timeout > NET_RTO_MAX * 1000)
+      timeout = NET_RTO_MAX * 1000;
+
+    if (now - pd->sentAt >= timeout)
+    {
+      if (pd->transmissions == 1)
+      {
+        sendStats.beginWrite()->lost++;
+        sendStats.endWrite();
+      }
+
+      pd->resend = true;
+      resendPending++;
+      congestionLoss(now);
+    }
+  }
+}
+
+// Sends coalesced messages that have waited for the maximum delay
+// Called regularly by the network thread, messages being written by the game thread are left alone
+void NetworkConnection::flushDue()
+{
+  SDL_LockMutex(sendMut);
+
+  if (sendMode == net_send_coalesce && !sendOpen && sendCommitted > sendHeaderSize
+    && netTicks() - pendingSince >= maxSendDelay)
+  {
+    closePacket();
+  }
+
+  SDL_UnlockMutex(sendMut);
+}
+
+bool NetworkConnection::canSend()
+{
+  SDL_LockMutex(sendMut);
+  bool space = sendCount - ackedPackID < NET_SEND_WINDOW;
+  SDL_UnlockMutex(sendMut);
+
+  return space;
+}
+
+bool NetworkConnection::canWrite(Uint32 size)
+{
+  if (SDL_AtomicGet(&sendReset))
+    restartSendBuf();
+
+  if (sendSize + size <= NET_MAX_PACKET_SIZE)
+    return true;
+
+  // Anything already written of the message moves with it, and the complete messages before it are sent first
+  Uint32 total = sendSize - sendCommitted + size;
+  bool closeFirst = sendCommitted > sendHeaderSize;
+
+  // A packet started while the window was full has no slot to be split from until the window opens
+  if (sendData == sendBuff && !closeFirst && sendSize > sendHeaderSize)
+    return false;
+
+  // Counted as though every packet had a trace block
+  if (sendChannel == net_channel_unreliableSequenced)
+    return closeFirst && total <= NET_MAX_PACKET_SIZE - NET_DATA_HEADER - NET_TRACE_SIZE;
+
+  // Each fragment holds a packet less its header, trace block, order word and fragment word
+  Uint32 perFragment = NET_MAX_PACKET_SIZE - NET_DATA_HEADER - NET_TRACE_SIZE - 8;
+  Uint32 packets = (total + perFragment - 1) / perFragment;
+
+  if (fragNum + packets > NET_MAX_FRAGMENTS)
+    return false;
+
+  SDL_LockMutex(sendMut);
+  bool room = sendCount + fragNum + packets + (closeFirst ? 1 : 0) - ackedPackID <= NET_SEND_WINDOW;
+  SDL_UnlockMutex(sendMut);
+
+  return room;
+}
+
+Uint32 NetworkConnection::getSendPacketID()
+{
+  SDL_LockMutex(sendMut);
+  Uint32 packID = sendCount + 1 + fragNum;
+  SDL_UnlockMutex(sendMut);
+
+  return packID;
+}
+
+Uint32 NetworkConnection::getAckedPacketID()
+{
+  SDL_LockMutex(sendMut);
+  Uint32 packID = ackedPackID;
+  SDL_UnlockMutex(sendMut);
+
+  return packID;
+}
+
+// Releases all packets up to and including packID from the send window
+void NetworkConnection::ackPackets(Uint32 packID)
+{
+  SDL_LockMutex(sendMut);
+
+  if (packID > sentCount)
+    packID = sentCount;
+
+  bool released = false;
+  if (packID > ackedPackID)
+  {
+    Uint32 flight = bytesInFlight;
+    Uint32 bytes = 0;
+    Uint64 newest = 0;
+
+    for (Uint32 id = ackedPackID + 1; id <= packID; id++)
+    {
+      PacketData *pd = &sentPackets[id & (NET_SEND_WINDOW - 1)];
+
+      // Selectively acknowledged packets have already been taken out of flight
+      if (!pd->sacked)
+      {
+        bytes += pd->size;
+
+        if (pd->transmissions == 1 && pd->sentAt > newest)
+          newest = pd->sentAt;
+      }
+
+      if (pd->resend)
+      {
+        pd->resend = false;
+        resendPending--;
+      }
+    }
+
+    bytesInFlight -= bytes < bytesInFlight ? bytes : bytesInFlight;
+    congestionAck(bytes, flight);
+    ackSample(newest);
+
+    ackedPackID = packID;
+    released = sendWindowFull;
+    sendWindowFull = false;
+  }
+
+  SDL_UnlockMutex(sendMut);
+
+  if (released)
+    pushEvent(nc_event_sendWindowAvailable);
+}
+
+// Takes packets the partner has received ahead of a missing one out of flight so they do not hold back the window
+// Parameters:
+// first, last - the range of packet IDs reported received
+void NetworkConnection::sackPackets(Uint32 first, Uint32 last)
+{
+  SDL_LockMutex(sendMut);
+
+  if (first <= ackedPackID)
+    first = ackedPackID + 1;
+  if (last > sentCount)
+    last = sentCount;
+
+  Uint32 flight = bytesInFlight;
+  Uint32 bytes = 0;
+  Uint64 newest = 0;
+
+  for (Uint32 id = first; id <= last; id++)
+  {
+    PacketData *pd = &sentPackets[id & (NET_SEND_WINDOW - 1)];
+    if (pd->sacked)
+      continue;
+
+    pd->sacked = true;
+    bytes += pd->size;
+
+    if (pd->transmissions == 1 && pd->sentAt > newest)
+      newest = pd->sentAt;
+
+    if (pd->resend)
+    {
+      pd->resend = false;
+      resendPending--;
+    }
+  }
+
+  if (bytes)
+  {
+    bytesInFlight -= bytes < bytesInFlight ? bytes : bytesInFlight;
+    congestionAck(bytes, flight);
+    ackSample(newest);
+  }
+
+  SDL_UnlockMutex(sendMut);
+}
+
+// Takes a round trip time sample from the newest packet in a batch of acknowledgements
+// Only packets acknowledged on their first transmission are used, as it is not known which copy of a resent
+// packet arrived
+// Parameters:
+// sentAt - the time the newest acknowledged packet was sent, 0 if there was none
+// Call with sendMut held
+void NetworkConnection::ackSample(Uint64 sentAt)
+{
+  if (!sentAt)
+    return;
+
+  if (sentAt > latestAckedSentAt)
+    latestAckedSentAt = sentAt;
+
+  rttSample((Uint32)(netMicros() - sentAt));
+}
+
+// Handles the acknowledgements in a check packet, releasing received packets and resending lost ones
+// Parameters:
+// minRcvd - the ID up to which all packets have been received
+// highest - the highest ID received, every ID from minRcvd to highest not in a range has been received
+// ranges - the missing ranges as written by sendCheckPacket
+// rangeNum - the number of ranges
+void NetworkConnection::receiveAcks(Uint32 minRcvd, Uint32 highest, const char *ranges, int rangeNum)
+{
+  ackPackets(minRcvd);
+
+  // Packets between the ranges have been received
+  Uint32 from = minRcvd + 1;
+  for (int i = 0; i < rangeNum; i++)
+  {
+    Uint32 range = SDLNet_Read32(&ranges[i * 4]);
+    Uint32 start = minRcvd + (range >> 16);
+
+    if (start > from)
+      sackPackets(from, start - 1 < highest ? start - 1 : highest);
+    from = start + (range & 0xFFFF);
+  }
+
+  if (from <= highest)
+    sackPackets(from, highest);
+
+  // Fast retransmit missing packets once packets sent after them have arrived
+  for (int i = 0; i < rangeNum; i++)
+  {
+    Uint32 range = SDLNet_Read32(&ranges[i * 4]);
+    Uint32 start = minRcvd + (range >> 16);
+    Uint32 end = start + (range & 0xFFFF);
+
+    for (Uint32 id = start; id < end; id++)
+      resendPacket(id);
+  }
+
+  // The window may have opened so more packets can go
+  pumpSends();
+}
+
+// Brings the acknowledgement carried by outgoing data packets up to date with the receive bitmap
+// and sets when it must be sent by if no data goes out first
+// Called by the network thread after it takes a reliable packet or learns of packets it is missing
+// Parameters:
+// received - true if a packet has been received
+void NetworkConnection::updateAck(bool received)
+{
+  Uint32 bits = 0;
+  for (Uint32 i = 0; i < NET_ACK_BITS; i++)
+  {
+    if (packetReceived(minPackRcvd + 2 + i))
+      bits |= 1u << i;
+  }
+
+  SDL_LockMutex(sendMut);
+
+  ackWords[0] = minPackRcvd;
+  ackWords[1] = bits;
+
+  Uint32 now = netTicks();
+
+  if (!ackPending)
+    ackDue = now + NET_ACK_DELAY;
+
+  if (received)
+    ackPending++;
+  else if (!ackPending)
+    ackPending = 1;
+
+  // Gaps are reported straight away so the partner can resend quickly, and waiting packets are acknowledged
+  // every other one to keep the partner's congestion window moving
+  if (ackPending >= 2 || maxPackRcvd != minPackRcvd)
+    ackDue = now;
+
+  SDL_UnlockMutex(sendMut);
+}
+
+// Handles the acknowledgement carried by a data packet from the partner
+// Packets the bitfield shows missing below one that has arrived are treated as reported missing
+void NetworkConnection::receivePiggybackAck(const char *data)
+{
+  Uint32 minRcvd = SDLNet_Read32(&data[4]);
+  Uint32 bits = SDLNet_Read32(&data[8]);
+
+  ackPackets(minRcvd);
+
+  if (bits)
+  {
+    Uint32 highest = 0;
+    for (Uint32 i = 0; i < NET_ACK_BITS; i++)
+    {
+      if (bits & (1u << i))
+      {
+        highest = minRcvd + 2 + i;
+        sackPackets(highest, highest);
+      }
+    }
+
+    for (Uint32 id = minRcvd + 1; id < highest; id++)
+    {
+      if (id == minRcvd + 1 || !(bits & (1u << (id - minRcvd - 2))))
+        resendPacket(id);
+    }
+  }
+
+  pumpSends();
+}
+
+// Queues a packet the partner has reported missing to be resent by the pacer, counting it as a loss
+// A packet is only taken to be lost once a packet sent after it has been acknowledged, allowing a quarter of
+// a round trip for packets arriving out of order, otherwise it is left to its retransmission timer
+// Returns 1 if the packet was queued, 0 if it is no longer held or may still arrive
+int NetworkConnection::resendPacket(Uint32 packID)
+{
+  SDL_LockMutex(sendMut);
+
+  if (packID <= ackedPackID || packID > sentCount)
+  {
+    SDL_UnlockMutex(sendMut);
+    return 0;
+  }
+
+  PacketData *pd = &sentPackets[packID & (NET_SEND_WINDOW - 1)];
+  Uint32 reorderWindow = srtt / 4 > 1000 ? srtt / 4 : 1000;
+
+  if (pd->resend || pd->sacked || pd->sentAt + reorderWindow >= latestAckedSentAt)
+  {
+    SDL_UnlockMutex(sendMut);
+    return 0;
+  }
+
+  if (pd->transmissions == 1)
+  {
+    sendStats.beginWrite()->lost++;
+    sendStats.endWrite();
+  }
+
+  pd->resend = true;
+  resendPending++;
+  congestionLoss(netMicros());
+
+  SDL_UnlockMutex(sendMut);
+
+  return 1;
+}
+
+// Sends a data packet to the partner, directly if peer-to-peer or through the server
+// The latest acknowledgement is written into the packet first so every data packet carries one
+// Call with sendMut held
+// Returns 1 on success, 0 on failure
+int NetworkConnection::sendDatagram(char *data, int len)
+{
+  SDLNet_Write32(ackWords[0], &data[4]);
+  SDLNet_Write32(ackWords[1], &data[8]);
+  ackPending = 0;
+  lastAckSent = netTicks();
+
+  NetSendStats *st = sendStats.beginWrite();
+  st->packetsSent++;
+  st->bytesSent += len;
+  sendStats.endWrite();
+
+  return manager->send(data, len, p2p ? partnerAddress : serverAddress);
+}
+
+// Writes the time and number of a transmission into a traced packet, and on the first the first transmission's time
+// The server's time is cleared as this copy may not go through it
+// Call with sendMut held
+// Parameters:
+// data - the packet
+// now - the time in microseconds it is being transmitted
+// transmissions - the number of times it has been, counting this one
+void NetworkConnection::stampTrace(char *data, Uint64 now, Uint8 transmissions)
+{
+  if (!(SDLNet_Read32(data) & NET_FLAG_TRACED))
+    return;
+
+  char *block = &data[NET_DATA_HEADER];
+
+  if (transmissions == 1)
+    SDLNet_Write32((Uint32)now, &block[8]);
+
+  SDLNet_Write32((Uint32)now, &block[12]);
+  SDLNet_Write32((Uint32)transmissions << 24, &block[16]);
+}
+
+
+// Encodes a float as an int by multiplying it by 100000, thereby losing some precision
+// and also limiting the size of floats to be encoded
+// the size range should suit most purposes though
+// TODO: modify code to be lossless using a float standard
+int NetworkConnection::encodeFloat(float f)
+{
+  if (f > 21474.0 || f < -21474.0)
+  {
+    //printf("encodeFloat error: number too large");
+  }
+  return (int)(f*100000.0);
+}
+
+Uint32 NetworkConnection::readMessage()
+{
+  Uint32 msg;
+
+  // Wait in the longest steps possible until a message arrives
+  while (!readMessage(&msg, (Uint32)-1))
+  {
+  }
+
+  return msg;
+}
+
+bool NetworkConnection::readMessage(Uint32 *msg, Uint32 timeoutMs)
+{
+  if (pullMessage(msg))
+    return true;
+
+  Uint32 start = SDL_GetTicks();
+
+  SDL_LockMutex(msgMut);
+
+  // Announce the wait before checking the queue again so the network thread cannot push and skip the signal
+  // in between, the atomic add is a full barrier on both sides
+  SDL_AtomicAdd(&msgWaiting, 1);
+
+  bool found = pullMessage(msg);
+
+  while (!found)
+  {
+    Uint32 elapsed = SDL_GetTicks() - start;
+    if (elapsed >= timeoutMs)
+      break;
+
+    SDL_CondWaitTimeout(msgCond, msgMut, timeoutMs - elapsed);
+    found = pullMessage(msg);
+  }
+
+  SDL_AtomicAdd(&msgWaiting, -1);
+
+  SDL_UnlockMutex(msgMut);
+
+  return found;
+}
+
+bool NetworkConnection::pullMessage(Uint32 *msg)
+{
+  if (messageQueue.pop(msg, 1) != 1)
+    return false;
+
+  if (traceHeld || traceQueue.size())
+    finishTraces();
+
+  return true;
+}
+
+size_t NetworkConnection::pullMessages(Uint32 *out, size_t max)
+{
+  if (max > NET_MESSAGE_QUEUE_SIZE)
+    max = NET_MESSAGE_QUEUE_SIZE;
+
+  Uint32 count = messageQueue.pop(out, (Uint32)max);
+
+  if (count && (traceHeld || traceQueue.size()))
+    finishTraces();
+
+  return count;
+}
+
+// Adds the traced packets whose messages have all been read to the trace statistics
+// Only called from the thread reading messages, which is the only one to write the statistics
+void NetworkConnection::finishTraces()
+{
+  Uint32 read = messageQueue.popped();
+  NetTraceStats *st = NULL;
+  Uint32 now = 0;
+
+  while (traceHeld || traceQueue.pop(&traceNext, 1))
+  {
+    // Wait for the rest of the packet's messages to be read
+    traceHeld = true;
+    if ((Sint32)(read - traceNext.end) < 0)
+      break;
+
+    traceHeld = false;
+
+    if (!st)
+    {
+      now = (Uint32)netMicros();
+      st = traceStats.beginWrite();
+    }
+
+    netTraceFinish(st, &traceNext, now);
+  }
+
+  if (st)
+    traceStats.endWrite();
+}
+
+void NetworkConnection::setTracing(Uint32 interval)
+{
+  SDL_LockMutex(sendMut);
+  traceInterval = interval;
+  SDL_UnlockMutex(sendMut);
+}
+
+void NetworkConnection::getTraceStats(NetTraceStats *stats)
+{
+  traceStats.read(stats);
+  stats->dropped = (Uint32)SDL_AtomicGet(&tracesDropped);
+}
 
-            //printf("Msg: %i", SDLNet_Read32(u));
+void NetworkConnection::clearTraceStats()
+{
+  traceStats.reset();
+  SDL_AtomicSet(&tracesDropped, 0);
+}
+
+// Decodes a float encoded by encodeFloat
+float NetworkConnection::decodeFloat(int u)
+{
+  return ((float)u) / 100000.0;
+}
+
+
+void NetworkConnection::updateHash(Uint32 hash)
+{
+  HashHistory *history = hashHistory.beginWrite();
+  memmove(&history->recent[1], &history->recent[0], sizeof(Uint32) * (HASH_NUM - 1));
+  history->recent[0] = hash;
+  history->latestTick = NET_HASH_NO_TICK;
+  hashHistory.endWrite();
+
+  SDL_AtomicAdd(&hashUpdates, 1);
+}
+
+void NetworkConnection::updateHash(Uint32 tick, Uint32 hash)
+{
+  HashHistory *history = hashHistory.beginWrite();
+  memmove(&history->recent[1], &history->recent[0], sizeof(Uint32) * (HASH_NUM - 1));
+  history->recent[0] = hash;
+  history->latestTick = tick;
+  history->ticks[tick & (NET_HASH_HISTORY - 1)] = tick;
+  history->hashes[tick & (NET_HASH_HISTORY - 1)] = hash;
+  hashHistory.endWrite();
+
+  SDL_AtomicAdd(&hashUpdates, 1);
+}
+
+Uint32 NetworkConnection::getDesyncTick()
+{
+  return (Uint32)SDL_AtomicGet(&desyncTick);
+}
+
+void NetworkConnection::clearDesync()
+{
+  // The network thread compares hashes with sessionMut held
+  SDL_LockMutex(manager->sessionMut);
+
+  SDL_AtomicSet(&desyncTick, (int)NET_HASH_NO_TICK);
+  hashFail = 0;
+  inSync = true;
+
+  SDL_UnlockMutex(manager->sessionMut);
+}
+
+int NetworkConnection::setCompression(bool enable, const void *dictionary, Uint32 len)
+{
+  SDL_LockMutex(manager->sessionMut);
+
+  // Packets in the send window were compressed against the dictionary in use as they were closed and are resent
+  // as they are, so changing it while connected would leave the partner unable to read them
+  if (state != nc_state_idle)
+  {
+    SDL_UnlockMutex(manager->sessionMut);
+    return 0;
+  }
+
+  SDL_LockMutex(sendMut);
+
+  compressor.setDictionary(dictionary, len);
+  compressID = enable ? compressor.getDictionaryID() : 0;
+  compressSend = false;
+
+  SDL_UnlockMutex(sendMut);
+  SDL_UnlockMutex(manager->sessionMut);
+
+  return 1;
+}
+
+bool NetworkConnection::playersInSync()
+{
+  SDL_LockMutex(manager->sessionMut);
+  bool sync = inSync;
+  SDL_UnlockMutex(manager->sessionMut);
+
+  return sync;
+}
+
+void NetworkConnection::pause()
+{
+  //set pause time to max Uint32 value
+  pauseTime = (Uint32)-1;
+}
+
+void NetworkConnection::pause(Uint32 time)
+{
+  pauseTime = SDL_GetTicks() + time;
+}
+
+void NetworkConnection::unpause()
+{
+  pauseTime = 0;
+}
+
+bool NetworkConnection::paused()
+{
+  if (pauseTime)
+  {
+    if (SDL_GetTicks() < pauseTime)
+    {
+      return true;
+    }
+    else
+    {
+      pauseTime = 0;
+    }
+  }
+
+  return false;
+}
+
+float NetworkConnection::getPingTime()
+{
+  return pingTime;
+}
+
+void NetworkConnection::getStats(NetStats *stats)
+{
+  NetSendStats send;
+  NetLinkStats link;
+  sendStats.read(&send);
+  linkStats.read(&link);
+
+  memset(stats, 0, sizeof(NetStats));
+
+  stats->rttSamples = send.rttSamples;
+  stats->rttMin = send.rttMin;
+  stats->rttMax = send.rttMax;
+  stats->rttAvg = send.rttSamples ? (Uint32)(send.rttTotal / send.rttSamples) : 0;
+  stats->rttSmoothed = send.rttSmoothed;
+  stats->rttP50 = netRttPercentile(send.rttHistogram, 0.5f);
+  stats->rttP99 = netRttPercentile(send.rttHistogram, 0.99f);
+  stats->jitter = send.jitter;
+  memcpy(stats->rttHistogram, send.rttHistogram, sizeof(stats->rttHistogram));
+
+  stats->packetsSent = send.packetsSent + link.packetsSent;
+  stats->packetsReceived = link.packetsReceived;
+  stats->bytesSent = send.bytesSent + link.bytesSent;
+  stats->bytesReceived = link.bytesReceived;
+
+  stats->dataPacketsSent = send.dataPacketsSent;
+  stats->packetsCompressed = send.packetsCompressed;
+  stats->bytesSaved = send.bytesSaved;
+  stats->decompressFailures = link.decompressFailures;
+  stats->lost = send.lost;
+  stats->retransmits = send.retransmits;
+  stats->duplicates = link.duplicates;
+  if (send.dataPacketsSent)
+  {
+    stats->lossRate = (float)send.lost / send.dataPacketsSent;
+    stats->retransmitRate = (float)send.retransmits / send.dataPacketsSent;
+  }
+
+  stats->sendWindowUsed = send.sendWindowUsed;
+  stats->bytesInFlight = send.bytesInFlight;
+  stats->congestionWindow = send.congestionWindow;
+  stats->receiveQueued = messageQueue.size();
+  stats->eventsDropped = (Uint32)SDL_AtomicGet(&eventsDropped);
+
+  stats->relayedTime = link.relayedTime;
+  stats->p2pTime = link.p2pTime;
+}
+
+void NetworkConnection::newGame()
+{
+  newGame(getSharedTime());
+}
+
+void NetworkConnection::newGame(Uint64 startTime)
+{
+  this->startTime = SDL_GetTicks();
+  gameStart = startTime;
+}
+
+Uint64 NetworkConnection::remoteTimeNow()
+{
+  return clock.remoteTime(netMicros());
+}
+
+Uint64 NetworkConnection::getSharedTime()
+{
+  Uint64 now = isHost ? netMicros() : remoteTimeNow();
+
+  // Corrections to the estimate can step it back slightly, hold the time until it catches up
+  if (now < lastSharedTime)
+    return lastSharedTime;
+
+  lastSharedTime = now;
+
+  return now;
+}
+
+Uint32 NetworkConnection::getSharedTick()
+{
+  Uint64 now = getSharedTime();
+  if (!gameStart || now < gameStart)
+    return 0;
+
+  return (Uint32)((now - gameStart) / tickLength);
+}
+
+void NetworkConnection::setTickLength(Uint32 micros)
+{
+  if (micros)
+    tickLength = micros;
+}
+
+bool NetworkConnection::clockSynced()
+{
+  return clock.isSynced();
+}
+
+Uint32 NetworkConnection::getClockError()
+{
+  return clock.getError();
+}
+
+float NetworkConnection::getClockDrift()
+{
+  return clock.getDrift();
+}
+
+// Returns true if the packet with the given ID has been received
+bool NetworkConnection::packetReceived(Uint32 packID)
+{
+  if (packID <= minPackRcvd)
+    return true;
+
+  if (packID > minPackRcvd + NET_SEND_WINDOW)
+    return false;
+
+  Uint32 bit = packID & (NET_SEND_WINDOW - 1);
+  return (recvBits[bit >> 5] & (1u << (bit & 31))) != 0;
+}
+
+// Records a packet as received in the receive bitmap and advances minPackRcvd past any completed run
+// Returns false if the packet is a duplicate or outside the receive window
+bool NetworkConnection::markReceived(Uint32 packID)
+{
+  if (packID <= minPackRcvd || packID > minPackRcvd + NET_SEND_WINDOW)
+    return false;
+
+  Uint32 bit = packID & (NET_SEND_WINDOW - 1);
+  if (recvBits[bit >> 5] & (1u << (bit & 31)))
+    return false;
+
+  recvBits[bit >> 5] |= 1u << (bit & 31);
+
+  if (packID > lastPackID)
+    lastPackID = packID;
+
+  if (packID > maxPackRcvd)
+    maxPackRcvd = packID;
+
+  // Clear bits as they pass below minPackRcvd so they can be reused for later IDs
+  bit = (minPackRcvd + 1) & (NET_SEND_WINDOW - 1);
+  while (recvBits[bit >> 5] & (1u << (bit & 31)))
+  {
+    recvBits[bit >> 5] &= ~(1u << (bit & 31));
+    minPackRcvd++;
+    bit = (minPackRcvd + 1) & (NET_SEND_WINDOW - 1);
+  }
+
+  return true;
+}
+
+// Counts a data packet that had already been received, such as a resend of one whose acknowledgement was lost
+// Called by the network thread
+void NetworkConnection::countDuplicate()
+{
+  linkStats.beginWrite()->duplicates++;
+  linkStats.endWrite();
+}
+
+// Handles a data packet on any channel, queueing its messages if they can be read now
+// Packets that cannot be taken are left unacknowledged to be resent later
+// Returns 1 if a reliable packet was taken and should be acknowledged straight away, 0 if not
+int NetworkConnection::receiveData(const char *data, int len)
+{
+  if (len < NET_DATA_HEADER)
+    return 0;
+
+  receivePiggybackAck(data);
+
+  Uint32 header = SDLNet_Read32(data);
+
+  // Traced packets are read from a copy without the trace block, so the rest is read as any other packet
+  NetTraceRecord trace;
+  trace.id = 0;
+  char untraced[NET_MAX_PACKET_SIZE];
+  if (header & NET_FLAG_TRACED)
+  {
+    if (len < NET_DATA_HEADER + NET_TRACE_SIZE)
+      return 0;
+
+    readTrace(data, &trace);
+
+    header &= ~NET_FLAG_TRACED;
+    SDLNet_Write32(header, untraced);
+    memcpy(&untraced[4], &data[4], NET_DATA_HEADER - 4);
+    memcpy(&untraced[NET_DATA_HEADER], &data[NET_DATA_HEADER + NET_TRACE_SIZE], len - NET_DATA_HEADER - NET_TRACE_SIZE);
+    data = untraced;
+    len -= NET_TRACE_SIZE;
+  }
+
+  // Compressed packets are read from their decompressed copy, which no longer carries the flag
+  char plain[NET_MAX_PACKET_SIZE];
+  if (header & NET_FLAG_COMPRESSED)
+  {
+    int size = compressor.decompress((const Uint8*)&data[NET_DATA_HEADER], len - NET_DATA_HEADER,
+      (Uint8*)&plain[NET_DATA_HEADER], NET_MAX_PACKET_SIZE - NET_DATA_HEADER);
+    if (size < 0)
+    {
+      linkStats.beginWrite()->decompressFailures++;
+      linkStats.endWrite();
+      return 0;
+    }
+
+    header &= ~NET_FLAG_COMPRESSED;
+    memcpy(plain, data, NET_DATA_HEADER);
+    SDLNet_Write32(header, plain);
+    data = plain;
+    len = NET_DATA_HEADER + size;
+  }
+  int channel = (header >> NET_CHANNEL_SHIFT) & 3;
+  Uint32 seq = header & NET_SEQ_MASK;
+
+  if (channel == net_channel_unreliableSequenced)
+  {
+    // Recover the full sequence number from the lower 24 bits, it will be near the last one received
+    Uint32 diff = (seq - lastUnreliableSeq) & NET_SEQ_MASK;
+    if (diff == 0)
+      countDuplicate();
+    if (diff == 0 || diff >= NET_SEQ_MASK / 2)
+      return 0;
+
+    Uint32 count = (len - NET_DATA_HEADER) / 4;
+    if (messageQueue.space() < count)
+      return 0;
+
+    lastUnreliableSeq += diff;
+
+    if (trace.id)
+      queueTrace(&trace, count);
+    queuePayload(&data[NET_DATA_HEADER], count);
+    return 0;
+  }
+
+  if (channel != net_channel_reliableUnordered && channel != net_channel_reliableOrdered)
+    return 0;
+
+  // Reliable packet IDs are always within the receive window above minPackRcvd
+  // Anything decoding to beyond it is a late duplicate of a packet already passed
+  Uint32 packID = minPackRcvd + ((seq - minPackRcvd) & NET_SEQ_MASK);
+  if (packID > minPackRcvd + NET_SEND_WINDOW || packetReceived(packID))
+  {
+    countDuplicate();
+    return 0;
+  }
+
+  if (channel == net_channel_reliableOrdered)
+  {
+    if (len < NET_DATA_HEADER + 4)
+      return 0;
+
+    Uint32 order = SDLNet_Read32(&data[NET_DATA_HEADER]);
+    Uint32 count = (len - NET_DATA_HEADER) / 4 - 1;
+    bool fragment = (header & NET_FLAG_FRAGMENT) != 0;
+
+    if (fragment)
+    {
+      if (len < NET_DATA_HEADER + 8)
+        return 0;
+
+      Uint32 frag = SDLNet_Read32(&data[NET_DATA_HEADER + 4]);
+      Uint32 fragments = frag & 0xFFFF;
+      if (fragments < 2 || fragments > NET_MAX_FRAGMENTS || (frag >> 16) >= fragments)
+        return 0;
+    }
+
+    // Fragments are always held so that the message is only queued once it is whole
+    if (order == nextOrder && !fragment && messageQueue.space() >= count)
+    {
+      if (!markReceived(packID))
+        return 0;
+
+      if (trace.id)
+        queueTrace(&trace, count);
+      queuePayload(&data[NET_DATA_HEADER + 4], count);
+      nextOrder++;
+
+      deliverOrdered();
+    }
+    else if ((order > nextOrder || (fragment && order == nextOrder)) && order - nextOrder < NET_REORDER_SIZE)
+    {
+      // Hold packets that are ahead of the order until the gap is filled
+      Uint32 slot = order & (NET_REORDER_SIZE - 1);
+      if (reorderNum[slot] == order || !markReceived(packID))
+        return 0;
+
+      if (!reorderBuf)
+      {
+        reorderBuf = new PacketData[NET_REORDER_SIZE];
+        reorderTrace = new NetTraceRecord[NET_REORDER_SIZE];
+      }
+
+      memcpy(reorderBuf[slot].data, data, len);
+      reorderBuf[slot].size = len;
+      reorderNum[slot] = order;
+      reorderTrace[slot] = trace;
+
+      if (order == nextOrder)
+        deliverOrdered();
+    }
+    else
+    {
+      // Too far ahead to hold or no room to read it, leave it to be resent
+      return 0;
+    }
+
+    return 1;
+  }
+
+  if (header & NET_FLAG_FRAGMENT)
+    return receiveFragment(packID, data, len, &trace);
+
+  Uint32 count = (len - NET_DATA_HEADER) / 4;
+
+  // Leave the packet unacknowledged if the game has fallen behind reading messages, it will be resent
+  if (messageQueue.space() < count)
+    return 0;
+
+  // Ignore duplicates and packets outside the receive window
+  if (!markReceived(packID))
+    return 0;
+
+  if (trace.id)
+    queueTrace(&trace, count);
+  queuePayload(&data[NET_DATA_HEADER], count);
+
+  return 1;
+}
+
+// Stores a fragment of a large message on the reliable unordered channel in the reassembly buffer
+// Once every fragment has arrived the whole message is queued at once
+// Fragments of a second message are left unacknowledged to be resent once the first is complete
+// The first fragment may be traced, its trace is held until the message is queued
+// Returns 1 if the fragment was taken, 0 if not
+int NetworkConnection::receiveFragment(Uint32 packID, const char *data, int len, const NetTraceRecord *trace)
+{
+  if (len < NET_DATA_HEADER + 4 || packetReceived(packID))
+    return 0;
+
+  Uint32 frag = SDLNet_Read32(&data[NET_DATA_HEADER]);
+  Uint32 index = frag >> 16;
+  Uint32 count = frag & 0xFFFF;
+
+  if (count < 2 || count > NET_MAX_FRAGMENTS || index >= count)
+    return 0;
+
+  if (!fragBuf)
+    fragBuf = new char[NET_MAX_FRAGMENTS][NET_MAX_PACKET_SIZE];
 
-            if (SDLNet_Read32(u) == message_type_newGame)
-            {
-              net->pushEvent(nc_event_newGame);
-            }
+  if (!fragFirstID)
+  {
+    fragFirstID = packID - index;
+    fragCount = count;
+    fragReceived = 0;
+    memset(fragSize, 0, sizeof(fragSize));
+    fragTrace.id = 0;
+  }
+  else if (fragFirstID != packID - index || fragCount != count)
+    return 0;
+
+  Uint32 words = (len - NET_DATA_HEADER) / 4 - 1;
+
+  // The last fragment to arrive is only taken if the whole message fits in the message queue
+  if (fragReceived + 1 == fragCount)
+  {
+    Uint32 total = words;
+    for (Uint32 i = 0; i < fragCount; i++)
+      total += fragSize[i];
+
+    if (messageQueue.space() < total)
+      return 0;
+  }
+
+  if (!markReceived(packID))
+    return 0;
+
+  memcpy(fragBuf[index], &data[NET_DATA_HEADER + 4], words * 4);
+  fragSize[index] = words;
+  fragReceived++;
+
+  if (trace->id)
+    fragTrace = *trace;
+
+  if (fragReceived == fragCount)
+  {
+    if (fragTrace.id)
+    {
+      Uint32 total = 0;
+      for (Uint32 i = 0; i < fragCount; i++)
+        total += fragSize[i];
+
+      queueTrace(&fragTrace, total);
+    }
+
+    for (Uint32 i = 0; i < fragCount; i++)
+      queuePayload(fragBuf[i], fragSize[i]);
+
+    fragFirstID = 0;
+  }
+
+  return 1;
+}
+
+// Moves held packets on the reliable ordered channel to the message queue once they are next in order
+// A fragmented message is held until all of its fragments have arrived, then queued at once
+// Called again later if the queue runs out of room, as held packets have already been acknowledged
+void NetworkConnection::deliverOrdered()
+{
+  while (true)
+  {
+    Uint32 slot = nextOrder & (NET_REORDER_SIZE - 1);
+    if (reorderNum[slot] != nextOrder)
+      return;
+
+    // Fragments have a fragment word after the order word, their count is in its low 16 bits
+    const char *data = reorderBuf[slot].data;
+    Uint32 packets = 1;
+    int start = NET_DATA_HEADER + 4;
+    if (SDLNet_Read32(data) & NET_FLAG_FRAGMENT)
+    {
+      packets = SDLNet_Read32(&data[start]) & 0xFFFF;
+      start += 4;
+    }
+
+    Uint32 count = 0;
+    for (Uint32 i = 0; i < packets; i++)
+    {
+      Uint32 s = (nextOrder + i) & (NET_REORDER_SIZE - 1);
+      if (reorderNum[s] != nextOrder + i)
+        return;
 
-            SDL_LockMutex(net->msgMut);
+      count += (reorderBuf[s].size - start) / 4;
+    }
 
-            net->messageQueue.push(data);
+    if (messageQueue.space() < count)
+      return;
 
-            SDL_UnlockMutex(net->msgMut);
-          }
+    // Only the first fragment can be traced
+    if (reorderTrace[slot].id)
+      queueTrace(&reorderTrace[slot], count);
 
-        }
-      }
+    for (Uint32 i = 0; i < packets; i++)
+    {
+      Uint32 s = (nextOrder + i) & (NET_REORDER_SIZE - 1);
+      queuePayload(&reorderBuf[s].data[start], (reorderBuf[s].size - start) / 4);
+      reorderNum[s] = 0;
     }
 
+    nextOrder += packets;
   }
-
-  SDLNet_FreePacket(packetOut);
-  SDLNet_FreePacket(pack);
-
-  return 1;
 }
 
-int NetworkConnection::pushEvent(nc_event message)
+// Sends a packet with information on number of packs recieved and missing packs
+// Also contains hash state information for sync checking, the newest hash and the tick it is from
+// Missing packets are written as ranges, one word per range holding the offset of the first missing ID
+// from minPackRcvd in the high 16 bits and the number of missing IDs in the low 16 bits
+// They follow the highest ID received, up to which every ID not in a range has been received, the hash's tick
+// and the ID of the compression dictionary this side can decompress with, 0 if none
+int NetworkConnection::sendCheckPacket()
 {
+  HashHistory history;
+  hashHistory.read(&history);
+  hashUpdatesSent = (Uint32)SDL_AtomicGet(&hashUpdates);
 
-  SDL_Event event;
-  SDL_zero(event);
-  event.type = SDL_USEREVENT;
-  event.user.code = message;
-  while (SDL_PushEvent(&event) == -1)
-    SDL_Delay(10);
-  return 1;
-}
-
+  char buf[NET_MAX_PACKET_SIZE];
+  SDLNet_Write32(65535, buf);
+  SDLNet_Write32((Uint32)netMicros(), &buf[4]);
+  SDLNet_Write32(history.recent[0], &buf[8]);
+  SDLNet_Write32(minPackRcvd, &buf[12]);
 
-// Sends a packet containing a single Uint32 as a message to the reciever
-// Uint32 message - the reference number of the message being sent
-// IPaddress receiver - the address of the intended recipient
-// Returns 1 if the message was sent and 0 on failure
-int NetworkConnection::sendUdpMessage(Uint32 message, IPaddress receiver)
-{
-  if (SDL_LockMutex(netMut) == -1)
-    return 0;
+  // Only packets that have been transmitted can be reported missing
+  SDL_LockMutex(sendMut);
+  SDLNet_Write32(sentCount, &buf[16]);
+  SDL_UnlockMutex(sendMut);
 
-  SDLNet_Write32(message, packet->data);
+  SDLNet_Write32(history.latestTick, &buf[24]);
+  SDLNet_Write32(compressID, &buf[28]);
 
-  packet->len = 4;
+  int n = 8;
 
-  packet->address = receiver;
+  Uint32 last = lastPackID;
+  if (last > minPackRcvd + NET_SEND_WINDOW)
+    last = minPackRcvd + NET_SEND_WINDOW;
 
-  if (!SDLNet_UDP_Send(udpSD, -1, packet))
+  // Walk the receive bitmap and write each run of missing IDs as a range, as many as fit in the packet
+  Uint32 id = minPackRcvd + 1;
+  while (id <= last && n < NET_MAX_PACKET_SIZE / 4)
   {
-    SDL_UnlockMutex(netMut);
-    return 0;
+    while (id <= last && packetReceived(id))
+      id++;
+
+    if (id > last)
+      break;
+
+    Uint32 start = id;
+    while (id <= last && !packetReceived(id))
+      id++;
+
+    SDLNet_Write32(((start - minPackRcvd) << 16) | (id - start), &buf[n * 4]);
+    n++;
   }
-  SDL_UnlockMutex(netMut);
-  return 1;
+
+  // If the ranges did not all fit only report what they cover
+  Uint32 highest = maxPackRcvd;
+  if (highest < minPackRcvd)
+    highest = minPackRcvd;
+  if (id <= last && highest >= id)
+    highest = id - 1;
+
+  SDLNet_Write32(highest, &buf[20]);
+
+  // The check packet carries the acknowledgement so no data packet needs to
+  SDL_LockMutex(sendMut);
+  ackPending = 0;
+  SDL_UnlockMutex(sendMut);
+
+  return sendControl(buf, n * 4, p2p ? partnerAddress : serverAddress);
 }
 
-int netStartHost(void* data)
+// Runs the connection's timers, called by the manager's network thread about once a millisecond
+// Resends the current stage's message until it is answered and gives up once it times out
+void NetworkConnection::update(Uint32 now)
 {
-  NetworkConnection *net = (NetworkConnection*)data;
+  if (state == nc_state_idle)
+    return;
 
-  if (net->connectToInternetServer() == -1)
+  if (state == nc_state_connected)
   {
-    //printf("\nFailed to connect to internet server");
-    net->pushEvent(nc_event_connectionFailed);
-    return -1;
+    updateConnected(now);
+    return;
   }
 
-  net->pushEvent(nc_event_connectedToServer);
+  if (stateEnd && now > stateEnd)
+  {
+    if (state == nc_state_holePunching && !direct)
+    {
+      //printf("\nPeer-to-peer connection failed\n\n");
+      // Carry on through the server
+      finishHolePunch();
+      return;
+    }
 
-  net->packet->address = net->serverAddress;
+    if (state == nc_state_connecting)
+    {
+      // connectToInternetServer reports the failure itself
+      if (afterConnect != nc_state_idle)
+        pushEvent(nc_event_connectionFailed);
+    }
+    else if (state == nc_state_holePunching)
+    {
+      // A direct connection has no server to carry on through
+      pushEvent(nc_event_connectionFailed);
+      leaveSession();
+      return;
+    }
+    else
+      pushEvent(nc_event_timeOut);
 
-  char buf[4];
-  SDLNet_Write32(message_type_startHost, buf);
-  memcpy(net->packet->data, buf, 4);
+    setState(nc_state_idle);
+    return;
+  }
 
-  if (!SDLNet_UDP_Send(net->udpSD, -1, net->packet))
+  // Hole punching messages are sent faster as they are given up on after a second
+  Uint32 interval = state == nc_state_holePunching ? 100 : 500;
+  if (now > stateSent + interval)
   {
-    //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
-    return -1;
+    stateSent = now;
+    sendStateMessage();
   }
 
-  Uint32 startTime = SDL_GetTicks();
-  Uint32 lastTime = startTime;
-  Uint32 currentTime;
+  // Data already goes through the server while hole punching
+  if (state == nc_state_holePunching)
+    updateConnected(now);
+}
 
-  //printf("\nWaiting for host conformation");
+// Sends check packets and keeps the connection alive while exchanging data with the partner
+void NetworkConnection::updateConnected(Uint32 currentTime)
+{
+  int timeLen;
 
-  while (true)
+  NetLinkStats *st = linkStats.beginWrite();
+  if (p2p)
+    st->p2pTime += currentTime - lastStatsTime;
+  else
+    st->relayedTime += currentTime - lastStatsTime;
+  linkStats.endWrite();
+  lastStatsTime = currentTime;
+
+  if (partnerAlive && currentTime > lastReceived + 2000)
   {
-    if (SDLNet_UDP_Recv(net->udpSD, net->packet))
-    {
-      char* msg[4];
-      memcpy(msg, net->packet->data, 4);
-      if (SDLNet_Read32(msg) == message_type_startHost)
-      {
-        break;
-      }
-    }
+    // No message has been received in the last 2 seconds
+    pushEvent(nc_event_connectionLost, NULL, currentTime - lastReceived);
+    partnerAlive = false;
+  }
 
-    currentTime = SDL_GetTicks();
-    if (currentTime > lastTime + 500)
-    {
-      SDLNet_Write32(message_type_startHost, buf);
-      memcpy(net->packet->data, buf, 4);
-      net->packet->len = 4;
+  // sendCount is advanced by the game thread, so both ends of the window are read under sendMut
+  SDL_LockMutex(sendMut);
+  bool allAcked = ackedPackID == sendCount;
+  SDL_UnlockMutex(sendMut);
 
-      if (!SDLNet_UDP_Send(net->udpSD, -1, net->packet))
-      {
-        //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
-        net->pushEvent(nc_event_connectionFailed);
-        return -1;
-      }
+  if (allAcked)
+    timeLen = 500;
+  else
+  {
+    // Send checks out faster while waiting for missing packets, keeping up with the retransmission timeout
+    timeLen = getRetransmitTimeout() / 2;
+    if (timeLen < NET_RTO_MIN / 2)
+      timeLen = NET_RTO_MIN / 2;
+    if (timeLen > 200)
+      timeLen = 200;
+  }
 
-      lastTime = currentTime;
-    }
+  // The game thread can send after currentTime was read, so times are compared without subtracting
+  SDL_LockMutex(sendMut);
+  bool ackWaiting = ackPending && currentTime >= ackDue;
+  bool ackCarried = currentTime < lastAckSent + 500;
+  SDL_UnlockMutex(sendMut);
 
-    if (currentTime > startTime + 10000)
+  // Check packets carry new state hashes every hashInterval
+  bool hashDue = hashInterval > 0 && currentTime > lastHashSent + hashInterval
+    && (Uint32)SDL_AtomicGet(&hashUpdates) != hashUpdatesSent;
+
+  // Send regular check packets, or sooner if a received packet has not been acknowledged by outgoing data
+  // While data packets are carrying acknowledgements they are only sent every NET_CHECK_INTERVAL
+  if (ackWaiting || hashDue
+    || (currentTime > lastCheckSent + timeLen && (!ackCarried || currentTime > lastCheckSent + NET_CHECK_INTERVAL)))
+  {
+    lastCheckSent = currentTime;
+    lastHashSent = currentTime;
+
+    sendCheckPacket();
+  }
+
+  // Compare the partner's last hash once this side reaches its tick
+  compareHash();
+
+  // Send packets to server during peer-to-peer connection to maintain connection
+  if (p2p && serverBound)
+  {
+    if (currentTime > lastServerPing + 30000)
     {
-      net->pushEvent(nc_event_timeOut);
-      return -1;
+      lastServerPing = currentTime;
+      sendUdpMessage(message_type_ping, serverAddress);
     }
   }
 
-  //printf("\nHost Confirmed");
-    
-  net->pushEvent(nc_event_hostWaiting);
+  // Retry held packets on the ordered channel in case the game has made room for them
+  deliverOrdered();
+
+  flushDue();
 
-  lastTime = SDL_GetTicks();
+  // Send packets held back by the congestion window or pacer
+  pumpSends();
+}
 
-  net->netFlag = 0;
+// Handles a packet routed to this connection by the manager according to the stage it has reached
+void NetworkConnection::handlePacket(UDPpacket *pack)
+{
+  NetLinkStats *st = linkStats.beginWrite();
+  st->packetsReceived++;
+  st->bytesReceived += pack->len;
+  linkStats.endWrite();
 
-  while (true)
+  if (pack->len < 4)
+    return;
+
+  Uint32 msg = SDLNet_Read32(pack->data);
+  bool fromServer = serverBound && pack->address.host == serverAddress.host
+    && pack->address.port == serverAddress.port;
+
+  switch (state)
   {
-    if (SDLNet_UDP_Recv(net->udpSD, net->packet))
+  case nc_state_idle:
+    return;
+
+  case nc_state_connecting:
+    // Any reply from the server confirms the connection
+    if (fromServer)
     {
-      char msg[4];
-      memcpy(msg, net->packet->data, 4);
-      //printf("\nMsg Rvd: %i Len:%i", SDLNet_Read32(msg), net->packet->len);
-      if (SDLNet_Read32(msg) == message_type_requestHost && net->packet->len == 10)
-      {
-        break;
-      }
+      //printf("Packet recieved: address - %i", pack->address.host);
+      connectedToInternetServer = true;
+
+      if (afterConnect != nc_state_idle)
+        pushEvent(nc_event_connectedToServer);
+
+      setState(afterConnect);
     }
-    else
+    return;
+
+  case nc_state_requestingHost:
+    if (fromServer && msg == message_type_startHost)
     {
-      currentTime = SDL_GetTicks();
-      if (currentTime > lastTime + 500)
-      {
-        SDLNet_Write32(message_type_checkHost, buf);
-        memcpy(net->packet->data, buf, 4);
-        SDLNet_UDP_Send(net->udpSD, -1, net->packet);
-        lastTime = currentTime;
-      }
-      SDL_Delay(1);
+      //printf("\nHost Confirmed");
+      pushEvent(nc_event_hostWaiting);
+      setState(nc_state_hostWaiting);
     }
+    return;
+
+  case nc_state_hostWaiting:
+    if (fromServer && msg == message_type_requestHost && pack->len == 10)
+      startHolePunch(pack);
+    return;
 
-    if (net->netFlag < 0)
+  case nc_state_findingHost:
+    if (fromServer && msg == message_type_noHost)
     {
-      //printf("Cancelling host waiting");
-      return 0;
+      //printf("\nNo Host Found");
+      pushEvent(nc_event_noHost);
+      setState(nc_state_idle);
+    }
+    else if (fromServer && msg == message_type_foundHost && pack->len == 10)
+    {
+      //printf("\nHost Connected");
+      startHolePunch(pack);
+      pushEvent(nc_event_foundHost, &partnerAddress);
     }
+    return;
+
+  default:
+    break;
   }
 
-  net->attemptPeerToPeer();
+  if (!fromServer && msg == message_type_connect)
+  {
+    //printf("\nHole Punch Message Recieved!\n\n");
+    // The partner's messages are getting through, reply so it knows its own are too
+    // Answered even once connected in case the partner missed the first reply
+    if (state == nc_state_holePunching)
+      stateEnd += 1000;
 
-  net->pushEvent(nc_event_foundClient);
+    sendUdpMessage(message_type_ping, partnerAddress);
+    return;
+  }
 
-  net->isHost = true;
+  if (state == nc_state_holePunching && !fromServer && msg == message_type_ping)
+  {
+    //printf("\nPeer-to-peer connection established\n\n");
+    p2p = true;
+    if (!direct)
+      sendUdpMessage(message_type_holePunched, serverAddress);
+    finishHolePunch();
+
+    // A reply to a check packet also carries a round trip time
+    if (pack->len == 4)
+      return;
+  }
 
-  return sendRecUDP(data);
+  receivePacket(pack);
 }
 
-int netConnectToHost(void* data)
+// Offers a packet from an unknown address to a connection that is hole punching
+// The partner's router may send from a different port than the server saw, in which case its connect messages
+// come from an address the manager has not bound, they are taken if they come from the partner's host
+// Returns true if the packet was taken
+bool NetworkConnection::acceptPacket(UDPpacket *pack)
 {
-  NetworkConnection *net = (NetworkConnection*)data;
+  if (state != nc_state_holePunching || pack->len < 4 || pack->address.host != partnerAddress.host)
+    return false;
 
-  if (!net->connectedToInternetServer)
-  {
-    if (net->connectToInternetServer() == -1)
-    {
-      //printf("\nFailed to connect to internet server");
-      net->pushEvent(nc_event_connectionFailed);
-      return -1;
-    }
-  }
+  Uint32 msg = SDLNet_Read32(pack->data);
+  if (msg != message_type_connect && msg != message_type_ping)
+    return false;
 
-  //printf("\nRequesting Host Connection...");
-  net->pushEvent(nc_event_connectedToServer);
+  if (!bindPartner(pack->address))
+    return false;
 
-  net->packet->address = net->serverAddress;
+  handlePacket(pack);
 
-  char buf[4];
-  SDLNet_Write32(message_type_requestHost, buf);
-  memcpy(net->packet->data, buf, 4);
+  return true;
+}
+
+// Handles data, check packets and their replies from the partner
+void NetworkConnection::receivePacket(UDPpacket *pack)
+{
+  char buf[NET_MAX_PACKET_SIZE];
+  Uint32 minPackRvd = 0;
+  Uint32 partnerStateHash = 0;
 
-  //printf("\nSending request packet");
-  if (!SDLNet_UDP_Send(net->udpSD, -1, net->packet))
+  Uint32 now = netTicks();
+
+  if (!partnerAlive)
   {
-    //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
-    return -1;
+    partnerAlive = true;
+    pushEvent(nc_event_reconnected, NULL, now - lastReceived);
   }
 
-  Uint32 startTime = SDL_GetTicks();
-  Uint32 lastTime = startTime;
-  Uint32 currentTime;
+  lastReceived = now;
 
-  //printf("\nWaiting for reply...");
-  while (true)
+  if (pack->len < 4)
+    return;
+
+  memcpy(buf, pack->data, pack->len);
+
+  bool check = false;
+
+  for (int i = 0; i < pack->len / 4; i++)
   {
-    if (SDLNet_UDP_Recv(net->udpSD, net->packet))
-    {
-      char* msg[4];
-      memcpy(msg, net->packet->data, 4);
+    char u[4];
+    memcpy(u, &buf[i * 4], 4);
 
-      //printf("\nMessage recieved ID: %i", SDLNet_Read32(msg));
+    if (i == 0)
+    {
+      Uint32 packID = SDLNet_Read32(u);
+      //if (packID != message_type_check)
+      //  printf("Packet received id:%i length:%i port:%i\n", packID, pack->len, pack->address.port);
 
-      if (SDLNet_Read32(msg) == message_type_noHost)
+      if (packID == message_type_check)
+      {
+        check = true;
+      }
+      else if (packID == message_type_quit)
+      {
+        pushEvent(nc_event_playerQuit);
+      }
+      else if (packID == message_type_ping)
       {
-        //printf("\nNo Host Found");
-        net->pushEvent(nc_event_noHost);
-        return 1;
+        if (pack->len >= 8)
+        {
+          // The reply holds the microsecond time the check packet was sent and the partner's clock as it replied
+          Uint64 received = netMicros();
+          memcpy(u, &buf[4], 4);
+          Uint32 rtt = (Uint32)received - SDLNet_Read32(u);
+          float t = rtt / 1000.0f;
+
+          if (pack->len >= 16)
+          {
+            Uint64 remote = ((Uint64)SDLNet_Read32(&buf[8]) << 32) | SDLNet_Read32(&buf[12]);
+            clock.addSample(received - rtt, remote, received);
+          }
+
+          //printf("T: %f", t);
+
+          i++;
+          if (pingTime == 0)
+          {
+            pingTime = t;
+          }
+          else
+          {
+            pingTime = (pingTime * 15 + t) / 16.0;
+            //printf("Pingtime: %f", pingTime);
+          }
+
+          rttSample(rtt);
+        }
       }
-      else if (SDLNet_Read32(msg) == message_type_foundHost)
+      else if (packID & NET_PACKET_DATA)
       {
-        //printf("\nHost Connected");
-        net->pushEvent(nc_event_foundHost);
+        if (receiveData(buf, pack->len))
+          updateAck(true);
         break;
       }
+      else
+        break;
     }
-
-    currentTime = SDL_GetTicks();
-    if (currentTime > lastTime + 500)
+    else if (check) // If it is a check packet
     {
-      SDLNet_Write32(message_type_requestHost, buf);
-      memcpy(net->packet->data, buf, 4);
-      net->packet->len = 4;
-
-      if (!SDLNet_UDP_Send(net->udpSD, -1, net->packet))
+      if (i == 1) // Time packet was sent
+      {
+        // Echo the time back along with this side's clock for the partner to measure it by
+        char reply[16];
+        Uint64 now = netMicros();
+        SDLNet_Write32(message_type_ping, reply);
+        memcpy(&reply[4], u, 4);
+        SDLNet_Write32((Uint32)(now >> 32), &reply[8]);
+        SDLNet_Write32((Uint32)now, &reply[12]);
+
+        sendControl(reply, 16, p2p ? partnerAddress : serverAddress);
+      }
+      else if (i == 2) // State hash, compared once its tick has been read
+      {
+        partnerStateHash = SDLNet_Read32(u);
+      }
+      else if (i == 3) // All packets up to this number have been received, so are safe to clear
+      {
+        minPackRvd = SDLNet_Read32(u);
+      }
+      else if (i == 4) // The total number of message packets sent
+      {
+        Uint32 numPacksSent = SDLNet_Read32(u);
+        if (numPacksSent > lastPackID)
+        {
+          // Packets up to numPacksSent not yet received are now known to be missing, report them with
+          // the next acknowledgement
+          lastPackID = numPacksSent;
+          updateAck(false);
+        }
+      }
+      else if (i == 5) // The highest packet received, followed by ranges of missing packets
       {
-        //printf("SDLNet_UDP_Send: %s\n", SDLNet_GetError());
-        net->pushEvent(nc_event_connectionFailed);
-        return -1;
+        Uint32 highestRvd = SDLNet_Read32(u);
+
+        if (pack->len >= 28)
+          receiveHash(partnerStateHash, SDLNet_Read32(&buf[24]));
+
+        // Compress packets to the partner once it is known to have the same dictionary
+        if (pack->len >= 32)
+        {
+          bool compress = compressID && SDLNet_Read32(&buf[28]) == compressID;
+          if (compress != compressSend)
+          {
+            SDL_LockMutex(sendMut);
+            compressSend = compress;
+            SDL_UnlockMutex(sendMut);
+          }
+        }
+
+        receiveAcks(minPackRvd, highestRvd, &buf[32], pack->len / 4 - 8);
+        break;
       }
+    }
+  }
+}
+
+// Compares the partner's state hash from a check packet with this side's
+// Hashes without a tick are checked against the last few given, and the players taken to be out of sync after
+// several misses in a row. Tick stamped hashes wait for this side to reach the tick and are then compared exactly
+// Parameters:
+// hash - the partner's newest hash
+// tick - the tick it is from, NET_HASH_NO_TICK if it was given without one
+void NetworkConnection::receiveHash(Uint32 hash, Uint32 tick)
+{
+  if (pauseTime != 0)
+  {
+    hashFail = 0;
+    return;
+  }
+
+  if (tick != NET_HASH_NO_TICK)
+  {
+    partnerHashTick = tick;
+    partnerHash = hash;
+    compareHash();
+    return;
+  }
+
+  HashHistory history;
+  hashHistory.read(&history);
 
-      lastTime = currentTime;
+  //printf("My Hash = %i    Their Hash = %i", history.recent[0], hash);
+
+  // Check against previous hashes for this client
+  bool fail = true;
+  for (int n = 0; n < HASH_NUM; n++)
+  {
+    if (history.recent[n] == hash)
+    {
+      fail = false;
+      break;
     }
+  }
 
-    if (currentTime > startTime + 10000)
+  if (fail)
+  {
+    hashFail++;
+    if (hashFail > 3)
     {
-      net->pushEvent(nc_event_timeOut);
-      return -1;
+      inSync = false;
     }
   }
+  else
+  {
+    hashFail = 0;
+    inSync = true;
+  }
+}
+
+// Compares the partner's waiting tick stamped hash with this side's hash for the same tick
+// Called by the network thread as hashes arrive and regularly after, until this side has reached the tick
+// Returns true once the hash has been compared or is too old to be
+bool NetworkConnection::compareHash()
+{
+  if (partnerHashTick == NET_HASH_NO_TICK)
+    return true;
+
+  HashHistory history;
+  hashHistory.read(&history);
+
+  Uint32 slot = partnerHashTick & (NET_HASH_HISTORY - 1);
+  Uint32 mine = history.ticks[slot];
+
+  if (mine != partnerHashTick)
+  {
+    // Wait for this side to reach the tick, unless it has already been passed and dropped from the history
+    if (mine == NET_HASH_NO_TICK || mine < partnerHashTick)
+      return false;
+
+    partnerHashTick = NET_HASH_NO_TICK;
+    return true;
+  }
 
-  net->netFlag = 0;
+  if (history.hashes[slot] != partnerHash)
+  {
+    Uint32 first = (Uint32)SDL_AtomicGet(&desyncTick);
+    if (first == NET_HASH_NO_TICK || partnerHashTick < first)
+      SDL_AtomicSet(&desyncTick, (int)partnerHashTick);
 
-  net->attemptPeerToPeer();
+    if (inSync)
+    {
+      inSync = false;
+      pushEvent(nc_event_desync);
+    }
+  }
 
-  net->isHost = false;
+  partnerHashTick = NET_HASH_NO_TICK;
 
-  return sendRecUDP(data);
+  return true;
 }
 
-// Attempts to form a peer-to-peer connection with another client connected through the server
-// To do this we use udp hole punching
-int NetworkConnection::attemptPeerToPeer()
+// Reads the messages of a packet's payload and hands them to the game thread all at once
+void NetworkConnection::queuePayload(const char *payload, Uint32 count)
 {
-  char* buf[4];
+  Uint32 msgs[NET_MAX_PACKET_SIZE / 4];
 
-  if (packet->len < 10)
+  for (Uint32 n = 0; n < count; n++)
   {
-    //printf("attemptPeerToPeer failed: packet too short");
-    //printf("Msg: %i", SDLNet_Read32(packet->data));
-    return 0;
+    msgs[n] = SDLNet_Read32(&payload[n * 4]);
+
+    if (msgs[n] == message_type_newGame)
+    {
+      pushEvent(nc_event_newGame);
+    }
   }
 
-  //printf("\nAttempting PeerToPeer\n\n");
+  queueMessages(msgs, count);
+}
 
-  SDL_LockMutex(netMut);
+// Hands a traced packet to the game thread to finish once it has read the packet's messages
+// Call just before queueing the messages, so the trace is waiting by the time they can be read
+// Parameters:
+// trace - the packet's trace
+// count - the number of messages about to be queued
+void NetworkConnection::queueTrace(NetTraceRecord *trace, Uint32 count)
+{
+  trace->queued = (Uint32)netMicros();
+  trace->end = messageQueue.pushed() + count;
 
-  // get the address of target client from packet data
-  packet->address.host = SDLNet_Read32(&packet->data[4]);
-  packet->address.port = SDLNet_Read16(&packet->data[8]);
+  if (!traceQueue.push(trace, 1))
+    SDL_AtomicAdd(&tracesDropped, 1);
+}
 
-  partnerAddress = packet->address;
+// Reads the trace block of a traced data packet as it arrives
+// The sender's times are moved onto this side's clock by the estimate of the partner's clock
+// Parameters:
+// data - the packet
+// trace - receives the trace
+void NetworkConnection::readTrace(const char *data, NetTraceRecord *trace)
+{
+  const char *block = &data[NET_DATA_HEADER];
+  Uint64 now = netMicros();
+  Uint32 offset = (Uint32)(clock.remoteTime(now) - now);
+  Uint32 word = SDLNet_Read32(&block[16]);
+
+  trace->id = SDLNet_Read32(block);
+  trace->end = 0;
+  trace->written = SDLNet_Read32(&block[4]) - offset;
+  trace->firstSent = SDLNet_Read32(&block[8]) - offset;
+  trace->sent = SDLNet_Read32(&block[12]) - offset;
+  trace->arrived = (Uint32)now;
+  trace->queued = (Uint32)now;
+  trace->server = word & NET_TRACE_SERVER_MASK;
+  trace->transmissions = (Uint8)(word >> 24);
+  trace->synced = clock.isSynced();
+}
 
-  // send a "connect" message to the new address
-  SDLNet_Write32(message_type_connect, buf);
-  memcpy(packet->data, buf, 4);
+// Pushes messages onto the message queue and wakes any reader waiting in readMessage
+void NetworkConnection::queueMessages(const Uint32 *msgs, Uint32 count)
+{
+  messageQueue.push(msgs, count);
 
-  SDLNet_UDP_Send(udpSD, -1, packet);
-  SDLNet_UDP_Send(udpSD, -1, packet);
+  // Read msgWaiting with an atomic add to get a full barrier after publishing the messages
+  if (SDL_AtomicAdd(&msgWaiting, 0) > 0)
+  {
+    SDL_LockMutex(msgMut);
+    SDL_CondSignal(msgCond);
+    SDL_UnlockMutex(msgMut);
+  }
+}
 
-  SDL_UnlockMutex(netMut);
+// Raises an event, queueing it for the game thread or forwarding it to SDL
+// Never waits, an event that does not fit is dropped rather than stalling the network thread
+// Parameters:
+// type - the event
+// address - the partner's address for events that carry it, or NULL
+// duration - the time in ms for events that carry one
+// Returns 1 on success, 0 if the event was dropped
+int NetworkConnection::pushEvent(nc_event type, const IPaddress *address, Uint32 duration)
+{
+  // Polled connections never touch the SDL event queue
+  if (sdlEventType && !manager->isPolled())
+  {
+    SDL_Event event;
+    SDL_zero(event);
+    event.type = sdlEventType;
+    event.user.code = type;
+    event.user.data1 = this;
+
+    if (SDL_PushEvent(&event) == 1)
+      return 1;
+  }
+  else
+  {
+    NetEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.sessionID = sessionID;
+    event.time = netTicks();
+    event.duration = duration;
+    if (address)
+      event.address = *address;
+
+    if (eventQueue.push(event))
+      return 1;
+  }
 
-  Uint32 startTime = SDL_GetTicks();
-  Uint32 lastTime = startTime;
+  SDL_AtomicAdd(&eventsDropped, 1);
+  return 0;
+}
 
-  while (true)
-  {
-    SDL_LockMutex(netMut);
+int NetworkConnection::pollEvents(NetEvent *events, int max)
+{
+  if (max <= 0)
+    return 0;
 
-    if (SDLNet_UDP_Recv(udpSD, packet))
-    {
-      Uint32 msg = SDLNet_Read32(packet->data);
-      //printf("\nMsg: %i\n\n", msg);
+  return (int)eventQueue.pop(events, (Uint32)max);
+}
 
-      if (msg == message_type_connect)
-      {
-        //printf("\nHole Punch Message Recieved!\n\n");
-        SDLNet_Write32(message_type_ping, buf);
-        memcpy(packet->data, buf, 4);
+int NetworkConnection::dispatchEvents()
+{
+  // Without a callback the events are left for pollEvents rather than thrown away
+  if (!eventCallback)
+    return 0;
 
-        partnerAddress = packet->address;
+  NetEvent events[NET_EVENT_QUEUE_SIZE];
+  int num = pollEvents(events, NET_EVENT_QUEUE_SIZE);
 
-        SDLNet_UDP_Send(udpSD, -1, packet);
-        startTime += 1000;
-      }
-      else if (msg == message_type_ping)
-      {
-        //printf("\nPeer-to-peer connection established\n\n");
-        p2p = true;
+  for (int i = 0; i < num; i++)
+    eventCallback(&events[i], eventUserData);
 
-        packet->address = serverAddress;
+  return num;
+}
 
-        SDLNet_Write32(message_type_holePunched, buf);
-        SDLNet_Write32(message_type_holePunched, buf);
-        SDLNet_Write32(message_type_holePunched, buf);
+void NetworkConnection::setEventCallback(NetEventCallback callback, void *userData)
+{
+  SDL_LockMutex(manager->sessionMut);
 
-        memcpy(packet->data, buf, 4);
-        SDLNet_UDP_Send(udpSD, -1, packet);
+  eventCallback = callback;
+  eventUserData = userData;
 
-        packet->address = partnerAddress;
+  if (callback)
+    sdlEventType = 0;
 
-        SDL_UnlockMutex(netMut);
-        return 1;
-      }
-    }
+  SDL_UnlockMutex(manager->sessionMut);
+}
 
-    Uint32 currentTime = SDL_GetTicks();
-    if (currentTime > lastTime + 100)
-    {
-      lastTime = currentTime;
+void NetworkConnection::setSDLEventType(Uint32 type)
+{
+  SDL_LockMutex(manager->sessionMut);
+  sdlEventType = type;
+  SDL_UnlockMutex(manager->sessionMut);
+}
 
-      SDLNet_Write32(message_type_connect, buf);
-      memcpy(packet->data, buf, 4);
-      packet->len = 4;
-      packet->address = partnerAddress;
 
-      if (!SDLNet_UDP_Send(udpSD, -1, packet))
-      {
-        //printf("\nNo message sent, peer-to-peer connection failed\n\n");
-        p2p = false;
-        packet->address = serverAddress;
-        SDL_UnlockMutex(netMut);
-        return 0;
-      }
-    }
+// Sends a packet containing a single Uint32 as a message to the reciever
+// Uint32 message - the reference number of the message being sent
+// IPaddress receiver - the address of the intended recipient
+// Returns 1 if the message was sent and 0 on failure
+int NetworkConnection::sendUdpMessage(Uint32 message, IPaddress receiver)
+{
+  char buf[4];
+  SDLNet_Write32(message, buf);
 
-    if (currentTime > startTime + 1000)
-    {
-      //printf("\nTime out\n\n");
-      //printf("\nPeer-to-peer connection failed\n\n");
-      p2p = false;
-      packet->address = serverAddress;
-      SDL_UnlockMutex(netMut);
-      return 0;
-    }
+  return sendControl(buf, 4, receiver);
+}
 
-    SDL_UnlockMutex(netMut);
+// Sends a packet made by the connection itself rather than the game, counting it in the statistics
+// Call with the manager's sessionMut held
+// Returns 1 on success, 0 on failure
+int NetworkConnection::sendControl(const void *data, int len, IPaddress receiver)
+{
+  NetLinkStats *st = linkStats.beginWrite();
+  st->packetsSent++;
+  st->bytesSent += len;
+  linkStats.endWrite();
 
-    SDL_Delay(1);
-  }
+  return manager->send(data, len, receiver);
 }
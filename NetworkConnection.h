@@ -22,30 +22,105 @@
 /*
   Pairs with a server running "gameServer.cpp" to establish fast network connections between clients for use with online games.
 
-  The connection is maintained using UDP and packet order is not guarenteed to be maintained.
-  Packets will all eventually arrive.
+  The connection is maintained using UDP and each packet is sent on one of three channels:
+    reliable unordered   - packets will all eventually arrive but their order is not guarenteed to be maintained
+    reliable ordered     - packets will all eventually arrive and are read in the order they were sent
+    unreliable sequenced - packets are never resent and any arriving after a newer one are dropped
 
   The game server matches hosts and clients as they come and there is currently no mechanism to match with a specified host or client.
 
+  Connections are run by a NetworkManager, which owns the socket and network thread. Each connection makes its own
+  unless one is passed to the constructor, in which case any number of connections can share it.
+
   Requires the SDL 2 and SDL_net 2.0 libraries, they can be found at https://www.libsdl.org/ and https://www.libsdl.org/projects/SDL_net/
 
   Made to be run with a client utilising SDL event handling, SDL_Init() must be run from the client code for it to work.
+  Events can also be read without the SDL event queue, see pollEvents and dispatchEvents.
 
   This code is currently under developement, use at your own risk.
   */
 
 #pragma once
 
-#include "List.h"
 #include "SDL.h"
 #include "SDL_net.h"
 #include "string.h"
-#include <queue>
-#include <list>
+#include "NetRing.h"
+#include "NetStats.h"
+#include "NetClock.h"
+#include "NetCompress.h"
+#include "NetTrace.h"
+#include "NetworkManager.h"
 
 #define NET_MAX_PACKET_SIZE 512
 #define HASH_NUM 5
 
+// Number of tick stamped state hashes kept to compare with the partner's, must be a power of 2
+#define NET_HASH_HISTORY 64
+
+// Tick of a hash given without one, and the desync tick when there has been no desync
+#define NET_HASH_NO_TICK 0xFFFFFFFF
+
+// Time in ms a direct connection waits for the partner to reply
+#define NET_DIRECT_TIMEOUT 10000
+
+// Number of unacknowledged packets that can be held for resending, must be a power of 2
+// Also the span of packet IDs tracked by the receive bitmap
+#define NET_SEND_WINDOW 1024
+
+// Number of 32 bit messages that can wait to be read, must be a power of 2
+#define NET_MESSAGE_QUEUE_SIZE 16384
+
+// Number of events that can wait to be read, must be a power of 2
+#define NET_EVENT_QUEUE_SIZE 64
+
+// Number of packets on the reliable ordered channel that can be held waiting for an earlier one, must be a power of 2
+// Enough for the packets that arrive while a lost one is resent, as any that do not fit are dropped and resent too
+#define NET_REORDER_SIZE 256
+
+// Maximum number of packets a message can be split into when it is too large for one packet
+#define NET_MAX_FRAGMENTS 64
+
+// Data packets start with a word holding this flag, the channel, further flags and the packet's sequence number
+// Two words of acknowledgement follow, the ID up to which all packets have been received and a bitfield of which
+// of the NET_ACK_BITS IDs after the next one have been received, filled in each time the packet is transmitted
+// On the reliable ordered channel a further word holds the packet's place in the order
+// Fragments, flagged with NET_FLAG_FRAGMENT, have a further word after any order word holding their index and the fragment count
+// Traced packets, flagged with NET_FLAG_TRACED, have a trace block after the acknowledgement words, see NetTrace
+// Everything after the acknowledgement words and trace block is compressed when NET_FLAG_COMPRESSED is set
+#define NET_PACKET_DATA 0x80000000
+#define NET_CHANNEL_SHIFT 29
+#define NET_FLAG_FRAGMENT 0x10000000
+#define NET_FLAG_COMPRESSED 0x08000000
+#define NET_SEQ_MASK 0x00FFFFFF
+#define NET_ACK_BITS 32
+#define NET_DATA_HEADER 12
+
+// Time in ms an acknowledgement waits for outgoing data to carry it before it is sent in a check packet
+// Acknowledgements are sent straight away when packets arrive out of order or a second packet is waiting on one
+#define NET_ACK_DELAY 20
+
+// Longest time in ms between check packets, which also carry ping times and state hashes, while data is carrying acks
+#define NET_CHECK_INTERVAL 1000
+
+// Congestion control
+// Queuing delay in ms the congestion controller tries not to exceed, on top of the lowest round trip time seen
+#define NET_CC_TARGET_DELAY 25
+// Congestion window in packets at the start of a connection and the least it can shrink to
+#define NET_CC_INITIAL_WINDOW 10
+#define NET_CC_MIN_WINDOW 2
+// Round trip time in ms assumed until the first one is measured
+#define NET_CC_INITIAL_RTT 200
+// Number of recent round trip times the current delay is the lowest of
+#define NET_CC_DELAY_SAMPLES 4
+// Number of packets the pacer can send at once after being idle
+#define NET_CC_PACER_BURST 4
+
+// Retransmission timeout limits in ms, and the timeout used until the round trip time has been measured
+#define NET_RTO_MIN 20
+#define NET_RTO_MAX 2000
+#define NET_RTO_INITIAL 500
+
 enum message_type {
   message_type_ping = 60000,
   message_type_connect,
@@ -74,18 +149,73 @@ enum nc_event {
   nc_event_newGame, // A message indicating a new game is starting has been recieved from the host
   nc_event_playerQuit, // The paired player has quit
   nc_event_connectionLost, // The connection has been lost
-  nc_event_reconnected // The connection has been reestablished
+  nc_event_reconnected, // The connection has been reestablished
+  nc_event_sendWindowFull, // The send window is full, no more packets can be sent until the partner acknowledges some
+  nc_event_sendWindowAvailable, // Space has become available in the send window after it was full
+  nc_event_desync // The partner's state hash for a tick differs from this side's, see getDesyncTick
+};
+
+// An event raised by a connection
+// address is the partner's address on foundHost and foundClient, and duration the time in ms since the partner
+// was last heard from on connectionLost and reconnected, the time is from netTicks
+struct NetEvent {
+  nc_event type;
+  Uint32 sessionID;
+  Uint32 time;
+  IPaddress address;
+  Uint32 duration;
+};
+
+// A function called by dispatchEvents for each event
+typedef void (*NetEventCallback)(const NetEvent *event, void *userData);
+
+// Stages of a connection, advanced by the network thread
+// Messages to the server are resent every 500ms until it replies, giving up after 10s
+enum nc_state {
+  nc_state_idle, // Not connected to a partner
+  nc_state_connecting, // Waiting for the internet server to reply to a connect message
+  nc_state_requestingHost, // Waiting for the server to confirm this connection as a waiting host
+  nc_state_hostWaiting, // Waiting on the server for a client to be paired with this host
+  nc_state_findingHost, // Waiting for the server to reply to a request for a host
+  nc_state_holePunching, // Trying to reach the partner directly for up to a second, data goes through the server meanwhile
+  nc_state_connected // Exchanging data with the partner, directly if hole punching worked or through the server
 };
 
+// Delivery modes for sent packets
+// Reliable packets share the packet IDs of the send window, the ordered channel numbers its packets separately
+// to put them in order and the unreliable channel has its own sequence numbers
+enum net_channel {
+  net_channel_reliableUnordered, // Resent until received, read as soon as it arrives, the default
+  net_channel_reliableOrdered, // Resent until received, read in the order sent
+  net_channel_unreliableSequenced // Sent once, dropped if a newer packet has already arrived
+};
+
+// When sent packets are handed to the socket
+enum net_send_mode {
+  net_send_immediate, // Each call to sendUdpPacket sends a packet straight away
+  net_send_coalesce // Messages from several calls are sent together in one packet, held for at most a set delay
+};
+
+// A slot in the send window holding a sent packet until it has been acknowledged
+// sentAt is the time in microseconds it was last transmitted and transmissions the number of times it has been sent,
+// resend is set while it is waiting to be sent again and sacked once the partner has reported receiving it ahead
+// of a missing packet
 struct PacketData {
-  char* data;
+  char data[NET_MAX_PACKET_SIZE];
   int size;
+  Uint64 sentAt;
+  Uint8 transmissions;
+  bool resend;
+  bool sacked;
 };
 
 class NetworkConnection
 {
 public:
-  NetworkConnection();
+  // Parameters:
+  // manager - the manager to run the connection on, when NULL the connection makes its own on a port chosen
+  // by the system
+  NetworkConnection(NetworkManager *manager = NULL);
   ~NetworkConnection();
 
 
@@ -102,29 +232,101 @@ public:
   int setServerURL(char* url);
 
   // Attempts to form a connection with the internet server with the url provided by setServerURL
+  // Waits up to 10s for the server to reply
   // Returns 1 on success, 0 on errors.
   int connectToInternetServer();
 
-  // Starts a new thread to open a host connection and waits for a client to connect with.
+  // Starts opening a host connection on the network thread and waits for a client to connect with.
   // Pushes SDL events to communicate:
   //	  connectedToServer - connection to server established, will now ask for a host position
   //	  connectionFailed  - attempt to connect failed
   //    timeOut           - connection timed out
   //    hostWaiting       - host confirmed on server, waiting on client
   //    foundClient       - will now start a connection with client
-  //    returns 1 if thread creation is successful, 0 if it fails
+  //    returns 1 if the attempt has started, 0 if it fails
   int startInternetHost();
 
-  // Starts a new thread to check for waiting hosts and connect with one as a client.
+  // Starts checking for waiting hosts on the network thread and connects with one as a client.
   // Pushes SDL events to communicate:
   //	  connectedToServer - connection to server established, will now request a host
   //	  connectionFailed  - attempt to connect failed
   //    timeOut           - connection timed out
   //    noHost            - no host waiting on server
   //    foundHost         - a host has been found and a connection will be started
-  //    returns 1 if thread creation is successful, 0 if it fails
+  //    returns 1 if the attempt has started, 0 if it fails
   int connectToHost();
 
+  // Connects straight to a partner at a known address, without the internet server
+  // Both sides call it with each other's address, one as the host, and hole punch as they would through the
+  // server. With no server to fall back on the connection fails if the partner has not replied within
+  // NET_DIRECT_TIMEOUT, such as between players on a LAN or managers on a NetSimNetwork
+  // Pushes SDL events to communicate:
+  //    foundClient       - on the host, connected to the client
+  //    foundHost         - on the client, connected to the host
+  //    connectionFailed  - the partner did not reply
+  // Parameters:
+  // address - the partner's address
+  // host - true on the host, false on the client
+  // Returns 1 if the attempt has started, 0 if it fails
+  int connectDirect(IPaddress address, bool host);
+
+  // Returns the stage the connection has reached
+  nc_state getState();
+
+  // Returns the manager the connection runs on
+  NetworkManager* getManager();
+
+  // Returns the ID the connection is known by on its manager, see NetworkManager::getSession
+  Uint32 getSessionID();
+
+
+  // Polling
+  // For engines with their own main loop, set the manager to polled mode with getManager()->setPolled(true) before
+  // starting a connection, then call poll every frame. All network work is then done inside poll and events are
+  // returned from it rather than forwarded to the SDL event queue, so no thread or SDL event handling is needed
+  // Messages are read with pullMessage or pullMessages, the waiting readMessage calls rely on the network thread
+
+  // Does the connection's network work on the calling thread and returns the events raised since the last poll
+  // Polls the whole manager, so any other connections sharing it are run too
+  // Timers are read from netMicros, engines that keep their own clock supply it with netSetClock
+  // Parameters:
+  // events - array that will be filled with the events
+  // max - the size of the events array
+  // Returns the number of events copied, any that did not fit are returned by the next poll
+  int poll(NetEvent *events, int max);
+
+
+  // Events
+  // Events are queued without locking for the game thread to read with pollEvents or pass to a callback with
+  // dispatchEvents. By default connections running on a network thread instead forward them to the SDL event
+  // queue as SDL_USEREVENTs, with the nc_event in user.code and the connection in user.data1
+  // If a queue is full the event is dropped rather than holding up the network thread
+
+  // Copies waiting events into events, removing them from the queue
+  // Parameters:
+  // events - array that will be filled with the events
+  // max - the size of the events array
+  // Returns the number of events copied
+  int pollEvents(NetEvent *events, int max);
+
+  // Calls the registered callback on the calling thread for each waiting event, removing them from the queue
+  // Returns the number of events handled, 0 with the events left queued if no callback is registered
+  int dispatchEvents();
+
+  // Registers a function to be called by dispatchEvents and stops events being forwarded to SDL
+  // Safe to call while the network thread is running, call it from the thread that calls dispatchEvents
+  // Parameters:
+  // callback - the function to call, NULL to remove it and leave events queued for pollEvents
+  // userData - passed to the callback with each event
+  void setEventCallback(NetEventCallback callback, void *userData = NULL);
+
+  // Sets the SDL event type events are forwarded as
+  // Safe to call while the network thread is running, events it raises from then on use the new type
+  // Parameters:
+  // type - a type from SDL_RegisterEvents to keep clear of the application's own user events, or 0 to queue events
+  // for pollEvents instead of forwarding them
+  void setSDLEventType(Uint32 type);
+
 
   // Closing the Connection
 
@@ -136,16 +338,110 @@ public:
   // Sending Messages
 
   // Adds data to the send buffer to form a packet to be sent as a message
-  // To send floats format the data using encodeFloat
+  // Messages too large for one packet are split into fragments on the reliable channels, up to NET_MAX_FRAGMENTS
+  // To send floats format the data using encodeFloat, or use BitWriter to pack values into fewer bits
   // Parameters:
   // data - a 32 bit data chunk	
   void addToSendBuf(Uint32 data);
 
   // Sends the data buffer as a packet to the connected host or client and empties the send buffer
-  void sendUdpPacket();
+  // The packet is held in the send window until the partner acknowledges it
+  // Reliable packets are sent as soon as the congestion window and pacer allow, the rest wait in the send window
+  // When coalescing, the data is held as a message to be sent along with later ones
+  // Returns 1 on success, 0 if the send window is full, in which case the send buffer is left intact
+  int sendUdpPacket();
+
+  // Sets how sent messages are scheduled
+  // Any messages held for coalescing are sent first
+  // Parameters:
+  // mode - net_send_immediate to send each packet as it is finished, net_send_coalesce to merge messages
+  // maxDelay - when coalescing, the longest time in ms a message is held before it is sent
+  // Returns 1 on success, 0 if held messages could not be sent because the send window is full
+  int setSendMode(net_send_mode mode, Uint32 maxDelay = 0);
+
+  // Sets whether packets sent to the partner are compressed
+  // Packets are only compressed once the partner's check packets show it has the same dictionary, and only when
+  // they come out smaller, so compressed and uncompressed packets can be mixed freely
+  // Can only be set before connecting, with the same dictionary on both sides, as packets already compressed and
+  // waiting to be resent could not be read after a change
+  // Parameters:
+  // enable - true to compress packets both ways when the partner has also enabled it, false for neither way
+  // dictionary - a dictionary of data like that the game sends, from NetCompressor::trainDictionary, or NULL
+  // len - the size of the dictionary in bytes
+  // Returns 1 on success, 0 if the connection is not idle
+  int setCompression(bool enable, const void *dictionary = NULL, Uint32 len = 0);
+
+  // Sends everything written to the send buffer straight away, including messages held for coalescing
+  // Returns 1 on success, 0 if the send window is full
+  int flush();
+
+  // Sets the channel used for packets written from now on
+  // Any data already written on the previous channel is sent first
+  // Parameters:
+  // channel - the delivery mode for following packets
+  // Returns 1 on success, 0 if the pending data could not be sent because the send window is full
+  int setSendChannel(net_channel channel);
+
+  // Returns true if there is space in the send window for another packet
+  // When this is false the partner has stopped acknowledging packets and sending should be held back
+  bool canSend();
+
+  // Returns true if a message of the given size can be written now without being refused part way through
+  // A message too large for the packet being written needs room in the send window for all of its fragments
+  // Parameters:
+  // size - the number of bytes in the message
+  bool canWrite(Uint32 size);
+
+  // Returns the ID of the packet currently being written to the send buffer
+  Uint32 getSendPacketID();
+
+  // Returns the ID up to which all sent packets have been acknowledged by the partner
+  Uint32 getAckedPacketID();
+
+  // Congestion Control
+  // The congestion window grows while round trip times stay near the lowest seen and shrinks as delay builds
+  // up in queues along the path or packets are lost. The pacer spreads sends evenly over each round trip
+
+  // Returns the congestion window, the number of bytes that can be sent before the partner acknowledges them
+  Uint32 getCongestionWindow();
+
+  // Returns the rate in bytes per second the pacer is sending at, 0 until the round trip time has been measured
+  Uint32 getSendRate();
+
+  // Returns the time in ms a packet is given to be acknowledged before it is resent
+  // Worked out from the smoothed round trip time and its variance, doubling each time the same packet is resent
+  Uint32 getRetransmitTimeout();
+
+  // Message Writer
+  // Writes go straight into the send window slot the packet will be sent from, so building a packet makes no copies
+  // Data is written in network byte order and the packet is padded to a whole number of 32 bit messages on commit
+
+  // Reserves space at the end of the send buffer to be filled in directly
+  // Parameters:
+  // size - the number of bytes to reserve
+  // Returns a pointer to the reserved space, or NULL if the message is full
+  char* reserve(Uint32 size);
+
+  // Write a value of the given size to the send buffer
+  // Returns 1 on success, 0 if the message is full
+  int writeU8(Uint8 data);
+  int writeU16(Uint16 data);
+  int writeU32(Uint32 data);
+
+  // Writes raw bytes to the send buffer
+  // Parameters:
+  // data - the bytes to be written
+  // size - the number of bytes
+  // Returns 1 on success, 0 if the message is full
+  int writeBytes(const void* data, Uint32 size);
+
+  // Ends a message and sends it, the same as sendUdpPacket
+  // Returns 1 on success, 0 if the send window is full, in which case the send buffer is left intact
+  int commit();
 
   // Encodes a float to be sent and decoded by the receiver
   // In the current implementation there is a small loss of precision and a max range of +-21474.0
+  // BitWriter::writeFloat sends floats losslessly and writeQuantized in fewer bits
   // Parameters:
   // f - the float to be encoded
   // Returns 1 on success, 0 on errors.
@@ -158,12 +454,28 @@ public:
   // Returns: 32 bit data chunk as a Uint32
   Uint32 readMessage();
 
+  // Reads the next 32 bits from the message queue, waiting up to the given time for it to arrive
+  // The wait is woken as soon as the network thread receives data
+  // Parameters:
+  // msg - Uint32 that will be assigned the message data if it arrives in time
+  // timeoutMs - the maximum time in ms to wait
+  // Returns true if a message was read, false if the wait timed out
+  bool readMessage(Uint32 *msg, Uint32 timeoutMs);
+
   // Checks to see if a message is avaiable and copy it to msg if it is, popping the message from the queue
   // Parameters:
   // msg - Uint32 that will be assigned the message data if it is available
   // Returns true if message found, false if not
   bool pullMessage(Uint32 *msg);
 
+  // Copies as many available messages as will fit into out, popping them from the queue
+  // Does not lock or allocate, use to drain a frame's worth of messages in one call
+  // Parameters:
+  // out - array that will be filled with the message data
+  // max - the size of the out array
+  // Returns the number of messages copied
+  size_t pullMessages(Uint32 *out, size_t max);
+
   // Decodes a float encoded by encodeFloat
   // Parameters:
   // data - the data to be decoded
@@ -175,13 +487,27 @@ public:
 
   // Updates the game state hash in order to check if the players are in sync with each other
   // Parameters:
-  // hash - hash of the state to be compared
+  // hash - hash of the state to be compared, such as from netHashWords
   void updateHash(Uint32 hash);
 
+  // Updates the game state hash for a tick
+  // Hashes stamped with a tick are compared with the partner's hash for the same tick, so a single difference is
+  // a desync rather than a few in a row, and the first tick found to differ is known
+  // Parameters:
+  // tick - the tick the state is from, such as from getSharedTick or InputSync::getTick
+  // hash - hash of the state, such as from netHashWords or StateSync::getRootHash
+  void updateHash(Uint32 tick, Uint32 hash);
+
   // Returns true if the players are in sync with each other, false if not
   // Requires state hashes to be sent with updateHash to function
   bool playersInSync();
 
+  // Returns the first tick whose hashes were found to differ, or NET_HASH_NO_TICK if none has
+  Uint32 getDesyncTick();
+
+  // Marks the players as back in sync, once the game has repaired the state such as with StateSync
+  void clearDesync();
+
   // Sets the state to paused
   // Set when you pause the game, use unpause to stop
   void pause();
@@ -201,46 +527,281 @@ public:
   // Returns the average return time for roundtrip messages in milliseconds
   float getPingTime();
 
+  // Copies the connection's statistics, see NetStats
+  // Never waits on the network thread, so can be called every frame to show or log how the connection is doing
+  // Parameters:
+  // stats - receives the statistics
+  void getStats(NetStats *stats);
+
+  // Latency Tracing
+  // Traced packets carry the times they were written and transmitted, and the time the server held them, so the
+  // receiver can split the time from the game writing a message to the partner's game reading it into stages
+  // Only the sending side sets tracing, packets are timed as they are received whether or not the receiver has
+
+  // Sets how often sent packets are traced, starting from the next packet
+  // Only the first fragment of a large message is traced, its times cover the whole message
+  // Parameters:
+  // interval - trace one packet in every interval, 1 to trace them all, 0 to stop tracing
+  void setTracing(Uint32 interval);
+
+  // Copies the latencies of the traced packets received from the partner whose messages have been read
+  // Never waits on the network thread, pass the result to netTraceFormat to log it
+  // Parameters:
+  // stats - receives the statistics
+  void getTraceStats(NetTraceStats *stats);
+
+  // Clears the latencies of traced packets
+  // Only call from the thread reading messages
+  void clearTraceStats();
+
   // call when a new game is started sync timers
+  // Starts the game's ticks from the current shared time
   void newGame();
 
+  // Starts a new game at a set time on the shared clock
+  // The host can pick a start slightly in the future with getSharedTime and send it to the client, so both
+  // count the same ticks from the same moment
+  // Parameters:
+  // startTime - the shared time in microseconds the first tick begins
+  void newGame(Uint64 startTime);
+
+  // Shared Clock
+  // The clocks of the two players are kept in step by measuring the partner's clock with each check packet.
+  // The shared clock is the host's, read directly on the host and through the estimate on the client, so lockstep
+  // and interpolation can schedule against the same timeline on both sides
+
+  // Returns the partner's clock now in microseconds, see netMicros
+  // Until the partner has replied to a check packet this is the local clock
+  Uint64 remoteTimeNow();
+
+  // Returns the host's clock now in microseconds, never going backwards as the estimate is corrected
+  Uint64 getSharedTime();
+
+  // Returns the number of whole ticks since the game started on the shared clock, 0 before newGame or the start
+  Uint32 getSharedTick();
+
+  // Sets the length of a tick counted by getSharedTick
+  // Parameters:
+  // micros - the tick length in microseconds, 16667 by default for 60 ticks a second
+  void setTickLength(Uint32 micros);
+
+  // Returns true once the partner's clock has been measured
+  bool clockSynced();
+
+  // Returns the most the partner's clock may be out by in microseconds, half the shortest recent round trip
+  Uint32 getClockError();
+
+  // Returns how fast the partner's clock runs compared to this one in parts per million
+  float getClockDrift();
+
   // True when currently running as host
   bool isHost;
 
-  // Time in ms between hash checks
+  // Time in ms between hash checks, a check packet is sent this often while new hashes are being given
   int hashInterval;
 
 private:
 
   //Network connection stuff
-  UDPsocket udpSD;
-  UDPpacket *packet;
+  NetworkManager *manager;
+  bool ownsManager;
+  Uint32 sessionID;
   IPaddress serverAddress;
   IPaddress partnerAddress;
-
-  //threading
-  int netFlag;
-  SDL_mutex *netMut;
+  bool serverBound;
+  bool partnerBound;
+
+  // Connection state, changed by the game thread only while holding the manager's sessionMut
+  // stateEnd is when the current stage times out, 0 if it does not, and afterConnect is the stage
+  // to move on to once the server replies
+  nc_state state;
+  nc_state afterConnect;
+  Uint32 stateSent;
+  Uint32 stateEnd;
+
+  // Keeping the connection alive, run by the network thread
+  bool partnerAlive;
+  Uint32 lastCheckSent;
+  Uint32 lastReceived;
+  Uint32 lastServerPing;
+
+  // Misses in a row of hashes given without a tick, hashFail and inSync are only changed with manager->sessionMut held
+  int hashFail;
+
+  // Messages received by the network thread waiting to be read by the game thread
+  NetRing<Uint32, NET_MESSAGE_QUEUE_SIZE> messageQueue;
+
+  // Events waiting to be read, pushed from both the network and game threads
+  // sdlEventType is the type they are forwarded to SDL as instead, 0 when they are queued
+  // sdlEventType, eventCallback and eventUserData are set by the game thread with manager->sessionMut held,
+  // which the network thread holds whenever it pushes an event
+  NetMultiRing<NetEvent, NET_EVENT_QUEUE_SIZE> eventQueue;
+  Uint32 sdlEventType;
+  NetEventCallback eventCallback;
+  void *eventUserData;
+  SDL_atomic_t eventsDropped;
+
+  // Used to wake a reader blocked in readMessage, the network thread only signals while msgWaiting is set
   SDL_mutex *msgMut;
-  SDL_Thread *threadNet;
-
-  // Message and packet lists
-  std::queue<Uint32> messageQueue;
-  std::list<Uint32> missingPackList;
-  std::list<PacketData> sentPackets;
-
+  SDL_cond *msgCond;
+  SDL_atomic_t msgWaiting;
+
+  // Send window, a ring buffer of sent packets indexed by packet ID
+  // Holds packets ackedPackID + 1 to sendCount, protected by sendMut
+  PacketData *sentPackets;
+  SDL_mutex *sendMut;
+  Uint32 ackedPackID;
+  bool sendWindowFull;
+
+  // Receive bitmap, one bit per packet ID from minPackRcvd + 1 to minPackRcvd + NET_SEND_WINDOW
+  // minPackRcvd is the ID up to which all packets have been received, lastPackID is the highest ID known to be sent
+  // and maxPackRcvd the highest ID received
+  Uint32 recvBits[NET_SEND_WINDOW / 32];
   Uint32 lastPackID;
   Uint32 minPackRcvd;
+  Uint32 maxPackRcvd;
 
+  // The packet being written, sendData points at the next slot in the send window, at sendBuff when
+  // the window was full as the packet was started or at unreliableBuff on the unreliable channel
   char sendBuff[NET_MAX_PACKET_SIZE];
+  char unreliableBuff[NET_MAX_PACKET_SIZE];
+  char *sendData;
   Uint32 sendSize;
+  Uint32 sendHeaderSize;
+
+  // Messages up to sendCommitted are complete and waiting to be sent when coalescing
+  // sendOpen is set while the game thread is part way through a message so the network thread will not send it
+  net_send_mode sendMode;
+  Uint32 maxSendDelay;
+  Uint32 sendCommitted;
+  Uint32 pendingSince;
+  bool msgOpen;
+  bool sendOpen;
+
+  // sendReset is set by resetSession so the game thread starts its packet again on its next write, msgDropped is
+  // set while the rest of a message started before the reset is written, to be dropped when it is committed
+  SDL_atomic_t sendReset;
+  bool msgDropped;
+
+  // Number of fragments of the message being written before the current packet
+  Uint32 fragNum;
+
+  // Reassembly of a fragmented message on the reliable unordered channel, fragFirstID is 0 when there is none
+  // fragBuf is allocated when the first fragmented message arrives
+  char (*fragBuf)[NET_MAX_PACKET_SIZE];
+  Uint32 fragSize[NET_MAX_FRAGMENTS];
+  Uint32 fragFirstID;
+  Uint32 fragCount;
+  Uint32 fragReceived;
   Uint32 sendCount;
+  net_channel sendChannel;
+  Uint32 orderedSendCount;
+  Uint32 unreliableSendCount;
+
+  // Packets on the reliable ordered channel received ahead of nextOrder, indexed by their place in the order
+  // reorderBuf and reorderTrace are allocated when the first packet arrives out of order
+  PacketData *reorderBuf;
+  Uint32 reorderNum[NET_REORDER_SIZE];
+  Uint32 nextOrder;
+
+  // Newest sequence number received on the unreliable channel
+  Uint32 lastUnreliableSeq;
+
+  // Congestion control state, protected by sendMut
+  // Reliable packets up to sentCount have been transmitted, later ones in the send window wait for the window to open
+  // Round trip times are in microseconds, baseDelay holds the lowest for this and the previous minute
+  // The window and bytes in flight are in bytes and pacerTokens is the number of bytes the pacer can send now
+  Uint32 sentCount;
+  Uint32 resendPending;
+  float congestionWindow;
+  Uint32 bytesInFlight;
+  Uint32 srtt;
+  Uint32 rttVar;
+  Uint32 rto;
+  Uint32 delaySamples[NET_CC_DELAY_SAMPLES];
+  Uint32 delaySampleNum;
+  Uint32 baseDelay[2];
+  Uint64 baseDelayTime;
+  Uint64 lastLossTime;
+  float pacerTokens;
+  Uint64 pacerTime;
+
+  // Acknowledgement words written into each data packet as it is sent, kept up to date by the network thread
+  // ackPending counts packets received since an acknowledgement last went out, which must go by ackDue
+  // All protected by sendMut
+  Uint32 ackWords[2];
+  Uint32 ackPending;
+  Uint32 ackDue;
+  Uint32 lastAckSent;
+
+  // Statistics, sendStats is written with sendMut held and linkStats with the manager's sessionMut held
+  // lastStatsTime is when the time spent relayed or peer-to-peer was last added to
+  NetSeqLock<NetSendStats> sendStats;
+  NetSeqLock<NetLinkStats> linkStats;
+  Uint32 lastStatsTime;
+
+  // Loss detection, latestAckedSentAt is the send time of the most recently sent packet acknowledged on its first
+  // transmission, any packet sent well before it that is still missing is taken to be lost
+  Uint64 latestAckedSentAt;
+  Uint64 lastTimerCheck;
 
   bool connectedToInternetServer;
   bool p2p;
 
-  Uint32 hash[HASH_NUM];
+  // Set while connected with connectDirect, with no server to go through
+  bool direct;
+
   Uint32 startTime;
+
+  // State hashes, written by the game thread and read by the network thread
+  // recent holds the newest hashes, the first of them from latestTick, and ticks and hashes the tick stamped ones
+  // hashUpdates counts the hashes given so far
+  struct HashHistory {
+    Uint32 recent[HASH_NUM];
+    Uint32 latestTick;
+    Uint32 ticks[NET_HASH_HISTORY];
+    Uint32 hashes[NET_HASH_HISTORY];
+  };
+  NetSeqLock<HashHistory> hashHistory;
+  SDL_atomic_t hashUpdates;
+
+  // The partner's newest tick stamped hash waiting for this side to reach its tick, and the first tick that
+  // differed, both kept by the network thread
+  Uint32 partnerHashTick;
+  Uint32 partnerHash;
+  SDL_atomic_t desyncTick;
+  Uint32 lastHashSent;
+  Uint32 hashUpdatesSent;
+
+  // Compression, compressID is the dictionary ID sent in check packets or 0 when compression is off
+  // compressSend is set once the partner has sent the same ID and is changed with sendMut held
+  NetCompressor compressor;
+  Uint32 compressID;
+  bool compressSend;
+
+  // Tracing, traceInterval is set with sendMut held, traceNum counts the packets sent, a fragmented message counting
+  // once, and sendTraced is set while the packet being written is traced
+  Uint32 traceInterval;
+  Uint32 traceNum;
+  bool sendTraced;
+
+  // Traced packets received, held with packets waiting in the reorder buffer or a fragmented message until their
+  // messages are queued, then queued for the game thread to finish as it reads the messages
+  // A record with an ID of 0 is not traced, traceNext is the next to finish while traceHeld is set
+  NetTraceRecord *reorderTrace;
+  NetTraceRecord fragTrace;
+  NetRing<NetTraceRecord, NET_TRACE_QUEUE_SIZE> traceQueue;
+  NetTraceRecord traceNext;
+  bool traceHeld;
+  NetSeqLock<NetTraceStats> traceStats;
+  SDL_atomic_t tracesDropped;
+
+  // The partner's clock, measured by the network thread, and the game's ticks on the shared clock
+  // lastSharedTime keeps getSharedTime from going backwards
+  NetClock clock;
+  Uint64 gameStart;
+  Uint32 tickLength;
+  Uint64 lastSharedTime;
   float pingTime;
   Uint32 resetTime;
   bool inSync;
@@ -248,15 +809,72 @@ private:
 
   char* serverURL;
 
-  int pushEvent(nc_event message);
+  int pushEvent(nc_event type, const IPaddress *address = NULL, Uint32 duration = 0);
 
   int sendUdpMessage(Uint32 message, IPaddress receiver);
-
-  friend int netStartHost(void*);
-  friend int netConnectToHost(void*);
-
-  int sendCheckPacket(UDPpacket *packet);
-  friend int sendRecUDP(void*);
-
-  int attemptPeerToPeer();
+  int sendControl(const void *data, int len, IPaddress receiver);
+
+  friend class NetworkManager;
+
+  // Lets the microbenchmarks time check packets and their parsing on their own
+  friend class NetBenchmark;
+
+  int beginConnect(nc_state next);
+  void setState(nc_state newState);
+  void sendStateMessage();
+  void startHolePunch(UDPpacket *pack);
+  int startHolePunch(IPaddress address, bool direct);
+  void finishHolePunch();
+  void leaveSession();
+  void resetSession();
+  void restartSendBuf();
+  void dropMessage();
+  int bindPartner(IPaddress address);
+  bool hasPartner();
+
+  void update(Uint32 now);
+  void updateConnected(Uint32 now);
+  void handlePacket(UDPpacket *pack);
+  bool acceptPacket(UDPpacket *pack);
+  void receivePacket(UDPpacket *pack);
+
+  int sendCheckPacket();
+  void receiveHash(Uint32 hash, Uint32 tick);
+  int compressPacket(char *data, int len);
+  bool compareHash();
+
+  void queueMessages(const Uint32 *msgs, Uint32 count);
+  void queuePayload(const char *payload, Uint32 count);
+  void queueTrace(NetTraceRecord *trace, Uint32 count);
+  void readTrace(const char *data, NetTraceRecord *trace);
+  void stampTrace(char *data, Uint64 now, Uint8 transmissions);
+  void finishTraces();
+
+  bool packetReceived(Uint32 packID);
+  bool markReceived(Uint32 packID);
+  int receiveData(const char *data, int len);
+  int receiveFragment(Uint32 packID, const char *data, int len, const NetTraceRecord *trace);
+  void deliverOrdered();
+
+  void receiveAcks(Uint32 minRcvd, Uint32 highest, const char *ranges, int rangeNum);
+  void ackPackets(Uint32 packID);
+  void sackPackets(Uint32 first, Uint32 last);
+  void ackSample(Uint64 sentAt);
+  void checkTimers(Uint64 now);
+  int resendPacket(Uint32 packID);
+  int sendDatagram(char *data, int len);
+  void updateAck(bool received);
+  void receivePiggybackAck(const char *data);
+  void pumpSends();
+  void refillPacer(Uint64 now);
+  void rttSample(Uint32 rtt);
+  void countDuplicate();
+  Uint32 queuingDelay();
+  void congestionAck(Uint32 bytes, Uint32 flight);
+  void congestionLoss(Uint64 now);
+  void startSendBuf();
+  int startFragment();
+  void padSendBuf();
+  int closePacket();
+  void flushDue();
 };
@@ -0,0 +1,410 @@
+/*
+  NetworkManager: Runs any number of NetworkConnections over one UDP socket and one network thread
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "NetworkManager.h"
+#include "NetworkConnection.h"
+
+#define NET_ADDRESS_SLOTS (NET_MAX_SESSIONS * NET_SESSION_ADDRESSES * 2)
+
+// Most packets handled in one pass of the network thread before the connections' timers are run
+#define NET_RECEIVE_BATCH 64
+
+// Clock set by netSetClock, NULL for the high resolution counter
+static NetClockFunction netClock = NULL;
+static void *netClockData = NULL;
+
+// Returns the time in microseconds from the high resolution counter or the clock set in its place
+Uint64 netMicros()
+{
+  if (netClock)
+    return netClock(netClockData);
+
+  Uint64 count = SDL_GetPerformanceCounter();
+  Uint64 freq = SDL_GetPerformanceFrequency();
+
+  // Split to keep the multiplication from overflowing
+  return count / freq * 1000000 + count % freq * 1000000 / freq;
+}
+
+Uint32 netTicks()
+{
+  return (Uint32)(netMicros() / 1000);
+}
+
+void netSetClock(NetClockFunction clock, void *userData)
+{
+  netClock = clock;
+  netClockData = userData;
+}
+
+NetworkManager::NetworkManager(Uint16 port, NetTransport *transport)
+{
+  this->port = port;
+  this->transport = transport;
+  ownTransport = transport == NULL;
+  if (ownTransport)
+    this->transport = new NetUdpTransport();
+  thread = NULL;
+  SDL_AtomicSet(&running, 0);
+  polled = false;
+  open = false;
+  packet = NULL;
+  sessionMut = SDL_CreateMutex();
+  sockMut = SDL_CreateMutex();
+  memset(sessions, 0, sizeof(sessions));
+  sessionNum = 0;
+  memset(addressTable, 0, sizeof(addressTable));
+}
+
+NetworkManager::~NetworkManager()
+{
+  stop();
+  SDL_DestroyMutex(sockMut);
+  SDL_DestroyMutex(sessionMut);
+
+  if (ownTransport)
+    delete transport;
+}
+
+int NetworkManager::start()
+{
+  SDL_LockMutex(sessionMut);
+
+  if (open)
+  {
+    SDL_UnlockMutex(sessionMut);
+    return 1;
+  }
+
+  if (!transport->open(port))
+  {
+    SDL_UnlockMutex(sessionMut);
+    return 0;
+  }
+
+  if (polled)
+  {
+    // Packets are received into the manager's own packet by poll
+    packet = SDLNet_AllocPacket(NET_MAX_PACKET_SIZE);
+    open = true;
+    SDL_UnlockMutex(sessionMut);
+    return 1;
+  }
+
+  SDL_AtomicSet(&running, 1);
+  thread = SDL_CreateThread(netManagerThread, NULL, this);
+
+  if (!thread)
+  {
+    SDL_AtomicSet(&running, 0);
+    transport->close();
+    SDL_UnlockMutex(sessionMut);
+    return 0;
+  }
+
+  open = true;
+  SDL_UnlockMutex(sessionMut);
+
+  return 1;
+}
+
+void NetworkManager::stop()
+{
+  if (!open)
+    return;
+
+  if (thread)
+  {
+    SDL_AtomicSet(&running, 0);
+    SDL_WaitThread(thread, NULL);
+    thread = NULL;
+  }
+
+  SDLNet_FreePacket(packet);
+  packet = NULL;
+  open = false;
+
+  transport->close();
+}
+
+void NetworkManager::setPolled(bool polled)
+{
+  this->polled = polled;
+}
+
+bool NetworkManager::isPolled()
+{
+  return polled;
+}
+
+void NetworkManager::poll()
+{
+  if (!open || !polled)
+    return;
+
+  pump(packet, netTicks());
+}
+
+Uint16 NetworkManager::getPort()
+{
+  return transport->getPort();
+}
+
+int NetworkManager::getSessionCount()
+{
+  SDL_LockMutex(sessionMut);
+  int num = sessionNum;
+  SDL_UnlockMutex(sessionMut);
+
+  return num;
+}
+
+NetworkConnection* NetworkManager::getSession(Uint32 id)
+{
+  if (id >= NET_MAX_SESSIONS)
+    return NULL;
+
+  SDL_LockMutex(sessionMut);
+  NetworkConnection *net = sessions[id];
+  SDL_UnlockMutex(sessionMut);
+
+  return net;
+}
+
+// Attaches a connection to the manager so the network thread runs it
+// Returns the connection's session ID, or -1 if the manager is full
+int NetworkManager::addSession(NetworkConnection *net)
+{
+  SDL_LockMutex(sessionMut);
+
+  int id = -1;
+  for (int i = 0; i < NET_MAX_SESSIONS; i++)
+  {
+    if (!sessions[i])
+    {
+      sessions[i] = net;
+      sessionNum++;
+      id = i;
+      break;
+    }
+  }
+
+  SDL_UnlockMutex(sessionMut);
+
+  return id;
+}
+
+// Detaches a connection, its addresses must already have been unbound
+// Once this returns the network thread will not touch the connection again
+void NetworkManager::removeSession(NetworkConnection *net)
+{
+  SDL_LockMutex(sessionMut);
+
+  for (int i = 0; i < NET_MAX_SESSIONS; i++)
+  {
+    if (sessions[i] == net)
+    {
+      sessions[i] = NULL;
+      sessionNum--;
+    }
+  }
+
+  SDL_UnlockMutex(sessionMut);
+}
+
+// Returns the starting slot in the address table for an address
+Uint32 NetworkManager::hashAddress(IPaddress address)
+{
+  Uint32 h = address.host * 2654435761u;
+  h ^= (Uint32)address.port * 40503u;
+  h ^= h >> 15;
+
+  return h & (NET_ADDRESS_SLOTS - 1);
+}
+
+// Routes packets from an address to a connection
+// Call with sessionMut held
+// Returns 1 on success, 0 if the address already belongs to another connection or the table is full
+int NetworkManager::bindAddress(IPaddress address, NetworkConnection *net)
+{
+  Uint32 slot = hashAddress(address);
+
+  for (Uint32 n = 0; n < NET_ADDRESS_SLOTS; n++)
+  {
+    AddressSlot *as = &addressTable[slot];
+
+    if (!as->used)
+    {
+      as->address = address;
+      as->session = net;
+      as->used = true;
+      return 1;
+    }
+
+    if (as->address.host == address.host && as->address.port == address.port)
+      return as->session == net ? 1 : 0;
+
+    slot = (slot + 1) & (NET_ADDRESS_SLOTS - 1);
+  }
+
+  return 0;
+}
+
+// Stops routing packets from an address to a connection
+// Entries after the removed one are shifted back into the gap so lookups never need to step over removed slots
+// Call with sessionMut held
+void NetworkManager::unbindAddress(IPaddress address, NetworkConnection *net)
+{
+  Uint32 slot = hashAddress(address);
+  Uint32 n = 0;
+
+  while (addressTable[slot].used)
+  {
+    AddressSlot *as = &addressTable[slot];
+    if (as->address.host == address.host && as->address.port == address.port)
+      break;
+
+    slot = (slot + 1) & (NET_ADDRESS_SLOTS - 1);
+    if (++n == NET_ADDRESS_SLOTS)
+      return;
+  }
+
+  if (!addressTable[slot].used || addressTable[slot].session != net)
+    return;
+
+  Uint32 gap = slot;
+  Uint32 next = slot;
+
+  while (true)
+  {
+    next = (next + 1) & (NET_ADDRESS_SLOTS - 1);
+    if (!addressTable[next].used)
+      break;
+
+    // An entry can fill the gap if the gap lies between its home slot and where it is now
+    Uint32 home = hashAddress(addressTable[next].address);
+    if (((next - home) & (NET_ADDRESS_SLOTS - 1)) >= ((next - gap) & (NET_ADDRESS_SLOTS - 1)))
+    {
+      addressTable[gap] = addressTable[next];
+      gap = next;
+    }
+  }
+
+  addressTable[gap].used = false;
+  addressTable[gap].session = NULL;
+}
+
+// Returns the connection packets from an address are routed to, or NULL if there is none
+// Call with sessionMut held
+NetworkConnection* NetworkManager::findAddress(IPaddress address)
+{
+  Uint32 slot = hashAddress(address);
+
+  for (Uint32 n = 0; n < NET_ADDRESS_SLOTS && addressTable[slot].used; n++)
+  {
+    AddressSlot *as = &addressTable[slot];
+    if (as->address.host == address.host && as->address.port == address.port)
+      return as->session;
+
+    slot = (slot + 1) & (NET_ADDRESS_SLOTS - 1);
+  }
+
+  return NULL;
+}
+
+// Sends a datagram through the manager's transport
+// Returns 1 on success, 0 on failure
+int NetworkManager::send(const void *data, int len, IPaddress address)
+{
+  SDL_LockMutex(sockMut);
+  int sent = transport->send(data, len, address);
+  SDL_UnlockMutex(sockMut);
+
+  return sent;
+}
+
+// Hands a received packet to the connection it was sent to
+// Packets from unknown addresses are offered to connections that are hole punching, as the partner's router
+// may have given it a different port from the one the server reported
+void NetworkManager::dispatch(UDPpacket *pack)
+{
+  SDL_LockMutex(sessionMut);
+
+  NetworkConnection *net = findAddress(pack->address);
+
+  if (net)
+    net->handlePacket(pack);
+  else
+  {
+    for (int i = 0; i < NET_MAX_SESSIONS; i++)
+    {
+      if (sessions[i] && sessions[i]->acceptPacket(pack))
+        break;
+    }
+  }
+
+  SDL_UnlockMutex(sessionMut);
+}
+
+// Runs the timers of every connection
+void NetworkManager::updateSessions(Uint32 now)
+{
+  SDL_LockMutex(sessionMut);
+
+  for (int i = 0; i < NET_MAX_SESSIONS; i++)
+  {
+    if (sessions[i])
+      sessions[i]->update(now);
+  }
+
+  SDL_UnlockMutex(sessionMut);
+}
+
+// Handles the packets waiting on the socket and then runs the connections' timers
+// Parameters:
+// pack - the packet to receive into
+// now - the current time from netTicks
+void NetworkManager::pump(UDPpacket *pack, Uint32 now)
+{
+  for (int n = 0; n < NET_RECEIVE_BATCH && transport->receive(pack); n++)
+    dispatch(pack);
+
+  updateSessions(now);
+}
+
+// The network thread, receives packets for every connection and runs their timers
+int netManagerThread(void* data)
+{
+  NetworkManager *mgr = (NetworkManager*)data;
+  UDPpacket *pack = SDLNet_AllocPacket(NET_MAX_PACKET_SIZE);
+
+  while (SDL_AtomicGet(&mgr->running))
+  {
+    // Sleep until a packet arrives, waking at least once a millisecond for the timers
+    mgr->transport->wait(1);
+
+    mgr->pump(pack, netTicks());
+  }
+
+  SDLNet_FreePacket(pack);
+
+  return 1;
+}
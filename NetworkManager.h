@@ -0,0 +1,171 @@
+/*
+  NetworkManager: Runs any number of NetworkConnections over one UDP socket and one network thread
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+/*
+  Owns the socket and the network thread shared by the connections attached to it. Each incoming packet is handed
+  to the connection it belongs to by looking its sender's address up in a hash table, so the cost of receiving
+  does not grow with the number of connections. Between packets the thread runs each connection's timers.
+
+  A NetworkConnection created without a manager makes its own, so a single connection works as it always has.
+  Bots, test harnesses and servers hosting many matches can attach every connection to one manager instead.
+
+  Connections reached through the internet server are known to it by the address of the socket they use, so only
+  one connection on a manager can go through a given server at a time. Peer-to-peer partners are told apart by
+  their own addresses and any number can share the manager, as long as no two of them are on the same socket.
+
+  Engines with their own main loop can run the manager without a thread by setting it to polled mode and calling
+  poll each frame, which does all of the socket work, handshakes and resends on the calling thread.
+
+  The socket is a NetTransport, a UDP socket unless another is given, such as a NetSimTransport to run
+  connections over a simulated network in the same process.
+
+  Connections must be deleted before the manager they are attached to.
+  */
+
+#pragma once
+
+#include "SDL.h"
+#include "SDL_net.h"
+#include "NetTransport.h"
+
+// Number of connections a manager can hold, must be a power of 2
+#define NET_MAX_SESSIONS 256
+
+// Number of addresses each connection can be reached from, its partner and the server relaying for it
+#define NET_SESSION_ADDRESSES 2
+
+class NetworkConnection;
+
+int netManagerThread(void*);
+
+// A clock to run network timing on in place of the high resolution counter, see netSetClock
+// Returns the time in microseconds
+typedef Uint64 (*NetClockFunction)(void *userData);
+
+// Returns the time in microseconds from the high resolution counter, or from the clock given to netSetClock
+// The clock all network timing runs on, including the delays of a NetSimNetwork
+Uint64 netMicros();
+
+// Returns the same clock in milliseconds, wrapping like SDL_GetTicks
+Uint32 netTicks();
+
+// Runs all network timing on another clock, such as simulated time advanced by a test between polls, so a run over
+// a NetSimNetwork repeats exactly from its seed
+// Set it before starting any manager and keep it until they have all stopped, the time must never go backwards
+// Parameters:
+// clock - the clock to use, NULL to go back to the high resolution counter
+// userData - passed to the clock
+void netSetClock(NetClockFunction clock, void *userData = NULL);
+
+class NetworkManager
+{
+public:
+  // Parameters:
+  // port - the UDP port to listen on, 0 to let the system choose a free one
+  // transport - the transport to send and receive through, kept by the caller until the manager is deleted, or
+  // NULL for a UDP socket
+  NetworkManager(Uint16 port = 0, NetTransport *transport = NULL);
+  ~NetworkManager();
+
+  // Opens the socket and starts the network thread, or only opens the socket in polled mode
+  // Called by connections as they start, does nothing if the manager is already running
+  // Returns 1 on success, 0 on errors.
+  int start();
+
+  // Stops the network thread and closes the socket
+  void stop();
+
+  // Sets whether the manager runs without a network thread, leaving the owner to call poll
+  // Only takes effect the next time the manager is started
+  // Parameters:
+  // polled - true to run connections from poll, false to run them on the manager's own thread
+  void setPolled(bool polled);
+
+  // Returns true if the manager is set to polled mode
+  bool isPolled();
+
+  // Does one pass of the network thread's work on the calling thread, handling every packet waiting on the socket
+  // and running the connections' handshakes, timers and resends
+  // Never blocks, call it regularly, at least once per frame, while in polled mode
+  // Timers are read from netMicros, engines that keep their own clock supply it with netSetClock
+  void poll();
+
+  // Returns the port the socket is bound to, 0 if it is not open
+  Uint16 getPort();
+
+  // Returns the number of connections attached to the manager
+  int getSessionCount();
+
+  // Returns the connection with the given session ID, or NULL if there is none
+  // Parameters:
+  // id - the ID returned by NetworkConnection::getSessionID
+  NetworkConnection* getSession(Uint32 id);
+
+private:
+  Uint16 port;
+
+  // ownTransport is set when the manager made the transport itself and deletes it
+  NetTransport *transport;
+  bool ownTransport;
+
+  // Packet received into by poll
+  UDPpacket *packet;
+
+  // The network thread runs while running is set, in polled mode there is no thread and open is set instead
+  SDL_Thread *thread;
+  SDL_atomic_t running;
+  bool polled;
+  bool open;
+
+  // Protects the sessions and the address table, held by the network thread while it runs a connection
+  SDL_mutex *sessionMut;
+
+  // Protects sends on the transport from the game threads and the network thread
+  SDL_mutex *sockMut;
+
+  // Attached connections, indexed by session ID
+  NetworkConnection *sessions[NET_MAX_SESSIONS];
+  int sessionNum;
+
+  // Open addressing hash table from sender address to connection, kept at most half full so probes stay short
+  struct AddressSlot {
+    IPaddress address;
+    NetworkConnection *session;
+    bool used;
+  };
+  AddressSlot addressTable[NET_MAX_SESSIONS * NET_SESSION_ADDRESSES * 2];
+
+  int addSession(NetworkConnection *net);
+  void removeSession(NetworkConnection *net);
+
+  Uint32 hashAddress(IPaddress address);
+  int bindAddress(IPaddress address, NetworkConnection *net);
+  void unbindAddress(IPaddress address, NetworkConnection *net);
+  NetworkConnection* findAddress(IPaddress address);
+
+  int send(const void *data, int len, IPaddress address);
+  void dispatch(UDPpacket *pack);
+  void updateSessions(Uint32 now);
+  void pump(UDPpacket *pack, Uint32 now);
+
+  friend class NetworkConnection;
+  friend int netManagerThread(void*);
+};
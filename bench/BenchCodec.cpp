@@ -0,0 +1,346 @@
+/*
+  NetBenchmark: Microbenchmarks of the connection hot paths
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetBenchmark.h"
+#include "NetworkConnection.h"
+#include "NetBitStream.h"
+#include "NetHash.h"
+#include "NetCompress.h"
+#include "NetStateSync.h"
+
+// Number of 32 bit words of game state hashed, 4 MB
+#define BENCH_STATE_WORDS (1 << 20)
+
+// Words in each chunk of the state hash tree
+#define BENCH_CHUNK_WORDS 256
+
+// Number of floats encoded, must be a power of 2
+#define BENCH_FLOATS 1024
+
+// Number of packets of game traffic made, the first half trains the dictionary and the second half is compressed
+#define BENCH_TRAFFIC_PACKETS 512
+
+// Number of entities in each packet of game traffic
+#define BENCH_ENTITIES 12
+
+static Uint32 benchRandom(Uint32 *seed)
+{
+  *seed = *seed * 1664525 + 1013904223;
+  return *seed >> 8;
+}
+
+static float floatValues[BENCH_FLOATS];
+static int encodedValues[BENCH_FLOATS];
+
+static void makeFloats(NetworkConnection *net)
+{
+  Uint32 seed = 1;
+  for (int i = 0; i < BENCH_FLOATS; i++)
+  {
+    floatValues[i] = (benchRandom(&seed) % 4000000) / 100.0f - 20000.0f;
+    encodedValues[i] = net->encodeFloat(floatValues[i]);
+  }
+}
+
+// Cost of encodeFloat on values across its range
+void benchFloatEncode(BenchState *state)
+{
+  NetworkConnection net;
+  makeFloats(&net);
+
+  Uint32 i = 0;
+  while (state->keepRunning())
+    benchUse((Uint32)net.encodeFloat(floatValues[i++ & (BENCH_FLOATS - 1)]));
+
+  state->setItemsProcessed(state->getIterations());
+}
+
+// Cost of decodeFloat on values across encodeFloat's range
+void benchFloatDecode(BenchState *state)
+{
+  NetworkConnection net;
+  makeFloats(&net);
+
+  Uint32 i = 0;
+  while (state->keepRunning())
+    benchUse((Uint32)net.decodeFloat(encodedValues[i++ & (BENCH_FLOATS - 1)]));
+
+  state->setItemsProcessed(state->getIterations());
+}
+
+// Cost of writing 64 floats losslessly with a BitWriter and reading them back, reported per float
+void benchFloatBits(BenchState *state)
+{
+  NetworkConnection net;
+  makeFloats(&net);
+
+  Uint32 words[64];
+  Uint32 i = 0;
+
+  while (state->keepRunning())
+  {
+    BitWriter writer(words, 64);
+    for (int f = 0; f < 64; f++)
+      writer.writeFloat(floatValues[(i + f) & (BENCH_FLOATS - 1)]);
+    writer.flush();
+
+    BitReader reader(words, writer.wordsWritten());
+    for (int f = 0; f < 64; f++)
+      benchUse((Uint32)reader.readFloat());
+
+    i += 64;
+  }
+
+  state->setItemsProcessed(state->getIterations() * 64);
+}
+
+// Cost of writing 64 floats quantized to 16 bits with a BitWriter and reading them back, reported per float
+void benchFloatQuantized(BenchState *state)
+{
+  NetworkConnection net;
+  makeFloats(&net);
+
+  Uint32 words[32];
+  Uint32 i = 0;
+
+  while (state->keepRunning())
+  {
+    BitWriter writer(words, 32);
+    for (int f = 0; f < 64; f++)
+      writer.writeQuantized(floatValues[(i + f) & (BENCH_FLOATS - 1)], -20000.0f, 20000.0f, 16);
+    writer.flush();
+
+    BitReader reader(words, writer.wordsWritten());
+    for (int f = 0; f < 64; f++)
+      benchUse((Uint32)reader.readQuantized(-20000.0f, 20000.0f, 16));
+
+    i += 64;
+  }
+
+  state->setItemsProcessed(state->getIterations() * 64);
+}
+
+// Returns 4 MB of game state, made the first time it is asked for
+static Uint32* gameState()
+{
+  static Uint32 *words = NULL;
+
+  if (!words)
+  {
+    words = new Uint32[BENCH_STATE_WORDS];
+
+    Uint32 seed = 1;
+    for (Uint32 i = 0; i < BENCH_STATE_WORDS; i++)
+      words[i] = benchRandom(&seed);
+  }
+
+  return words;
+}
+
+// Throughput of hashing the whole state with netHashWords
+void benchHashWords(BenchState *state)
+{
+  Uint32 *words = gameState();
+
+  while (state->keepRunning())
+    benchUse(netHashWords(words, BENCH_STATE_WORDS));
+
+  state->setBytesProcessed(state->getIterations() * BENCH_STATE_WORDS * 4);
+  state->setCounter("accelerated", netHashAccelerated() ? 1 : 0);
+}
+
+// Per tick cost of keeping the state hash up to date when a game changes 64 scattered 64 byte regions of its
+// 4 MB state, rehashing only the chunks they touch
+void benchHashTick(BenchState *state)
+{
+  Uint32 *words = gameState();
+  StateSync sync(words, BENCH_STATE_WORDS, BENCH_CHUNK_WORDS);
+
+  // Time one full rehash to compare against
+  Uint64 start = SDL_GetPerformanceCounter();
+  sync.rehash();
+  benchUse(sync.getRootHash());
+  double fullMicros = (SDL_GetPerformanceCounter() - start) * 1e6 / SDL_GetPerformanceFrequency();
+
+  Uint32 seed = 1;
+
+  while (state->keepRunning())
+  {
+    for (int i = 0; i < 64; i++)
+    {
+      Uint32 first = benchRandom(&seed) % (BENCH_STATE_WORDS - 16);
+      words[first]++;
+      sync.markChanged(first, 16);
+    }
+
+    benchUse(sync.getRootHash());
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  state->setCounter("chunks", sync.getChunkCount());
+  state->setCounter("full_rehash_us", fullMicros);
+}
+
+// Game traffic for the compression benchmarks
+static Uint8 traffic[BENCH_TRAFFIC_PACKETS][NET_COMPRESS_MAX_INPUT];
+static int trafficLen[BENCH_TRAFFIC_PACKETS];
+static Uint8 trafficDictionary[NET_COMPRESS_MAX_DICT];
+static Uint32 trafficDictionaryLen;
+
+// Makes synthetic packets like a game's snapshot traffic and trains a dictionary on the first half of them
+// Each packet is a message type and tick, then for each entity in view its ID, fixed point position and
+// velocity, health and state flags, with positions moving a little and the rest changing rarely from tick to tick
+static void makeTraffic()
+{
+  if (trafficLen[0])
+    return;
+
+  Uint32 seed = 1;
+  Sint32 pos[BENCH_ENTITIES][2];
+  Sint32 vel[BENCH_ENTITIES][2];
+  for (int e = 0; e < BENCH_ENTITIES; e++)
+  {
+    pos[e][0] = (Sint32)(benchRandom(&seed) % 1000000);
+    pos[e][1] = (Sint32)(benchRandom(&seed) % 1000000);
+    vel[e][0] = (Sint32)(benchRandom(&seed) % 200) - 100;
+    vel[e][1] = (Sint32)(benchRandom(&seed) % 200) - 100;
+  }
+
+  for (Uint32 tick = 0; tick < BENCH_TRAFFIC_PACKETS; tick++)
+  {
+    Uint8 *p = traffic[tick];
+    int w = 0;
+
+    SDLNet_Write32(7, &p[w++ * 4]);
+    SDLNet_Write32(tick + 1000, &p[w++ * 4]);
+
+    for (int e = 0; e < BENCH_ENTITIES; e++)
+    {
+      // Entities turn now and then
+      if (benchRandom(&seed) % 16 == 0)
+        vel[e][0] = (Sint32)(benchRandom(&seed) % 200) - 100;
+
+      pos[e][0] += vel[e][0];
+      pos[e][1] += vel[e][1];
+
+      SDLNet_Write32(100 + e * 3, &p[w++ * 4]);
+      SDLNet_Write32((Uint32)pos[e][0], &p[w++ * 4]);
+      SDLNet_Write32((Uint32)pos[e][1], &p[w++ * 4]);
+      SDLNet_Write32((Uint32)vel[e][0], &p[w++ * 4]);
+      SDLNet_Write32((Uint32)vel[e][1], &p[w++ * 4]);
+      SDLNet_Write32(100 - (tick / 40 + e) % 30, &p[w++ * 4]);
+      SDLNet_Write32(e % 3 ? 0 : 0x10, &p[w++ * 4]);
+    }
+
+    trafficLen[tick] = w * 4;
+  }
+
+  // The dictionary is trained on the first half and measured on the second, so it is not tested on its own samples
+  static Uint8 samples[BENCH_TRAFFIC_PACKETS / 2 * NET_COMPRESS_MAX_INPUT];
+  Uint32 len = 0;
+  for (int i = 0; i < BENCH_TRAFFIC_PACKETS / 2; i++)
+  {
+    memcpy(&samples[len], traffic[i], trafficLen[i]);
+    len += trafficLen[i];
+  }
+
+  trafficDictionaryLen = NetCompressor::trainDictionary(samples, len, trafficDictionary, NET_COMPRESS_MAX_DICT);
+}
+
+// Compresses the second half of the traffic packet by packet, reporting the ratio of the sizes before and after,
+// with packets that do not shrink counted at their own size as they are sent uncompressed
+static void benchCompressTraffic(BenchState *state, bool dictionary)
+{
+  makeTraffic();
+
+  NetCompressor compressor;
+  if (dictionary)
+    compressor.setDictionary(trafficDictionary, trafficDictionaryLen);
+
+  Uint8 out[NET_COMPRESS_MAX_INPUT];
+  Uint64 bytesIn = 0;
+  Uint64 bytesOut = 0;
+  Uint32 i = 0;
+
+  while (state->keepRunning())
+  {
+    int p = BENCH_TRAFFIC_PACKETS / 2 + (i++ % (BENCH_TRAFFIC_PACKETS / 2));
+    int len = compressor.compress(traffic[p], trafficLen[p], out, NET_COMPRESS_MAX_INPUT);
+
+    bytesIn += trafficLen[p];
+    bytesOut += len ? len : trafficLen[p];
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  state->setBytesProcessed(bytesIn);
+  state->setCounter("ratio", bytesOut ? (double)bytesIn / bytesOut : 0);
+}
+
+void benchCompress(BenchState *state)
+{
+  benchCompressTraffic(state, false);
+}
+
+void benchCompressDictionary(BenchState *state)
+{
+  benchCompressTraffic(state, true);
+}
+
+// Decompresses the second half of the traffic compressed with the dictionary, packet by packet
+void benchDecompressDictionary(BenchState *state)
+{
+  makeTraffic();
+
+  NetCompressor compressor;
+  compressor.setDictionary(trafficDictionary, trafficDictionaryLen);
+
+  static Uint8 compressed[BENCH_TRAFFIC_PACKETS / 2][NET_COMPRESS_MAX_INPUT];
+  int compressedLen[BENCH_TRAFFIC_PACKETS / 2];
+  for (int i = 0; i < BENCH_TRAFFIC_PACKETS / 2; i++)
+  {
+    int p = BENCH_TRAFFIC_PACKETS / 2 + i;
+    compressedLen[i] = compressor.compress(traffic[p], trafficLen[p], compressed[i], NET_COMPRESS_MAX_INPUT);
+  }
+
+  Uint8 out[NET_COMPRESS_MAX_INPUT];
+  Uint64 bytesOut = 0;
+  Uint32 i = 0;
+
+  while (state->keepRunning())
+  {
+    int p = i++ % (BENCH_TRAFFIC_PACKETS / 2);
+    if (!compressedLen[p])
+      continue;
+
+    int len = compressor.decompress(compressed[p], compressedLen[p], out, NET_COMPRESS_MAX_INPUT);
+    if (len < 0)
+    {
+      state->skipWithError("decompression failed");
+      break;
+    }
+
+    bytesOut += len;
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  state->setBytesProcessed(bytesOut);
+}
@@ -0,0 +1,1503 @@
+/*
+  NetBenchmark: Microbenchmarks of the connection hot paths
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetBenchmark.h"
+#include "NetworkConnection.h"
+#include "NetSimTransport.h"
+#include "NetSnapshot.h"
+#include "NetInputSync.h"
+#include "NetStateSync.h"
+
+// Most messages pulled from a connection at once
+#define BENCH_DRAIN_SIZE 4096
+
+// Time in ms allowed for a pair to connect, for the send window to open or for the last of a transfer to arrive
+// Polled pairs run on simulated time, so this is simulated time for them
+#define BENCH_TIMEOUT 5000
+
+// Simulated time in microseconds polled pairs start at and move on by with each poll of the pair
+#define BENCH_CLOCK_START 1000000000
+#define BENCH_POLL_STEP 100
+
+// Times a full send window is waited on before a benchmark gives up
+#define BENCH_SEND_TRIES 1000
+
+// Length in microseconds of a game tick in the sync benchmarks
+#define BENCH_TICK_MICROS 10000
+
+// Fields in each snapshot and how many of them change each tick
+#define BENCH_SNAPSHOT_FIELDS 1024
+#define BENCH_SNAPSHOT_CHANGES 16
+
+// Snapshots kept by the snapshot benchmark to check the ones read against, more than can be in flight at once
+#define BENCH_SNAPSHOT_RING 64
+
+// Words in the state of the resync benchmark, 4 MB, and in each of its chunks
+#define BENCH_STATE_SYNC_WORDS (1 << 20)
+#define BENCH_STATE_SYNC_CHUNK 256
+
+// Polls that take every packet a simulated transport can hold, a manager takes up to 64 per poll
+#define BENCH_POLL_ALL (NET_SIM_QUEUE_SIZE / 64)
+
+// Reaches the connection's private hot paths so they can be timed on their own
+class NetBenchmark
+{
+public:
+  static int sendCheckPacket(NetworkConnection *net)
+  {
+    return net->sendCheckPacket();
+  }
+
+  static void handlePacket(NetworkConnection *net, UDPpacket *pack)
+  {
+    net->handlePacket(pack);
+  }
+
+  static Uint32 queueSpace(NetworkConnection *net)
+  {
+    return net->messageQueue.space();
+  }
+
+  static void queueMessages(NetworkConnection *net, const Uint32 *msgs, Uint32 count)
+  {
+    net->queueMessages(msgs, count);
+  }
+
+  // Opens the congestion window as wide as the send window, so a burst is transmitted all at once
+  static void openWindow(NetworkConnection *net)
+  {
+    SDL_LockMutex(net->sendMut);
+    net->congestionWindow = (float)NET_SEND_WINDOW * NET_MAX_PACKET_SIZE;
+    SDL_UnlockMutex(net->sendMut);
+  }
+};
+
+// Simulated time polled pairs run on, read by every connection and the network through netSetClock
+static Uint64 benchNow;
+
+static Uint64 benchClock(void *userData)
+{
+  return benchNow;
+}
+
+// A host and client connected over a simulated network
+// Polled pairs do all of their network work on the calling thread from poll, so timings are not disturbed by
+// a network thread, threaded pairs run their managers' threads as a game would
+// Polled pairs also run on simulated time that only moves on as they are polled, so each run of a benchmark sends
+// and loses the same packets, threaded pairs run on the real clock
+class BenchPair
+{
+public:
+  NetSimNetwork network;
+  NetSimTransport hostTransport;
+  NetSimTransport clientTransport;
+  NetworkManager hostManager;
+  NetworkManager clientManager;
+  NetworkConnection *host;
+  NetworkConnection *client;
+
+  BenchPair(bool threaded = false) : network(1), hostTransport(&network), clientTransport(&network),
+    hostManager(0, &hostTransport), clientManager(0, &clientTransport)
+  {
+    if (!threaded)
+    {
+      benchNow = BENCH_CLOCK_START;
+      netSetClock(benchClock);
+    }
+
+    hostManager.setPolled(!threaded);
+    clientManager.setPolled(!threaded);
+
+    host = new NetworkConnection(&hostManager);
+    client = new NetworkConnection(&clientManager);
+
+    // Events are left to drop once their queue fills rather than going to the SDL event queue
+    host->setSDLEventType(0);
+    client->setSDLEventType(0);
+  }
+
+  ~BenchPair()
+  {
+    host->closeConnection();
+    client->closeConnection();
+
+    delete host;
+    delete client;
+
+    netSetClock(NULL);
+  }
+
+  // Starts both sides and waits for them to connect
+  // Returns 1 on success, 0 if they did not connect in time
+  int connect()
+  {
+    if (!hostManager.start() || !clientManager.start())
+      return 0;
+
+    host->connectDirect(NetSimNetwork::getAddress(clientManager.getPort()), true);
+    client->connectDirect(NetSimNetwork::getAddress(hostManager.getPort()), false);
+
+    Uint32 start = netTicks();
+    while (host->getState() != nc_state_connected || client->getState() != nc_state_connected)
+    {
+      if (netTicks() - start > BENCH_TIMEOUT)
+        return 0;
+
+      poll();
+      if (!hostManager.isPolled())
+        SDL_Delay(1);
+    }
+
+    return 1;
+  }
+
+  // Moves simulated time on and runs both sides of a polled pair, does nothing for a threaded pair
+  void poll()
+  {
+    if (!hostManager.isPolled())
+      return;
+
+    benchNow += BENCH_POLL_STEP;
+    hostManager.poll();
+    clientManager.poll();
+  }
+
+  // Delivers what the host has sent and has the client acknowledge it straight away rather than after the
+  // acknowledgement delay, so a polled host's send window empties
+  void exchange()
+  {
+    benchNow += BENCH_POLL_STEP;
+    pollAll(&clientManager);
+    NetBenchmark::sendCheckPacket(client);
+    pollAll(&hostManager);
+  }
+
+  // Polls a manager until it has taken every packet waiting on its transport
+  static void pollAll(NetworkManager *manager)
+  {
+    for (int i = 0; i < BENCH_POLL_ALL; i++)
+      manager->poll();
+  }
+
+  // Sets how packets sent by each side are treated
+  void setConditions(const NetSimConditions *hostSends, const NetSimConditions *clientSends)
+  {
+    network.setConditions(hostManager.getPort(), hostSends);
+    network.setConditions(clientManager.getPort(), clientSends);
+  }
+};
+
+static Uint32 drainBuf[BENCH_DRAIN_SIZE];
+
+// Reads and throws away the messages waiting on a connection
+// Returns the number of messages read
+static Uint32 drain(NetworkConnection *net)
+{
+  Uint32 total = 0;
+
+  size_t num;
+  while ((num = net->pullMessages(drainBuf, BENCH_DRAIN_SIZE)) > 0)
+    total += (Uint32)num;
+
+  return total;
+}
+
+// Sends the message in the host's send buffer, with the time spent waiting on a full send window left out
+// Returns 1 on success, 0 if the window did not open
+static int sendUntimed(BenchState *state, BenchPair *pair)
+{
+  for (int tries = 0; !pair->host->sendUdpPacket(); tries++)
+  {
+    if (tries == BENCH_SEND_TRIES)
+    {
+      state->skipWithError("send window stayed full");
+      return 0;
+    }
+
+    state->pauseTiming();
+    pair->exchange();
+    drain(pair->client);
+    state->resumeTiming();
+  }
+
+  return 1;
+}
+
+// Sends the message in a connection's send buffer, running the pair while the send window is full
+// Returns 1 on success, 0 if the window did not open in time
+static int sendWaiting(BenchPair *pair, NetworkConnection *net)
+{
+  Uint32 start = netTicks();
+
+  while (!net->sendUdpPacket())
+  {
+    if (netTicks() - start > BENCH_TIMEOUT)
+      return 0;
+
+    pair->poll();
+    if (!pair->hostManager.isPolled())
+      SDL_Delay(1);
+  }
+
+  return 1;
+}
+
+// Runs the pair until a connection's send window has room for a message of the given number of packets
+// Writes that cannot start a new fragment are dropped, so a large message has to fit the window before it is written
+// Returns 1 on success, 0 if the window did not open in time
+static int waitForRoom(BenchPair *pair, NetworkConnection *net, Uint32 packets)
+{
+  Uint32 start = netTicks();
+
+  while (net->getSendPacketID() + packets - net->getAckedPacketID() > NET_SEND_WINDOW)
+  {
+    if (netTicks() - start > BENCH_TIMEOUT)
+      return 0;
+
+    pair->poll();
+    if (!pair->hostManager.isPolled())
+      SDL_Delay(1);
+  }
+
+  return 1;
+}
+
+// Fills a connection's message queue as the network thread would, without sending anything
+// Sending the messages costs far more than reading them, so refilling the queue through the network would make
+// the untimed part of the read benchmarks run for minutes
+static void fillQueue(NetworkConnection *net)
+{
+  static Uint32 msgs[NET_MESSAGE_QUEUE_SIZE];
+  Uint32 count = NetBenchmark::queueSpace(net);
+
+  for (Uint32 i = 0; i < count; i++)
+    msgs[i] = i;
+
+  NetBenchmark::queueMessages(net, msgs, count);
+}
+
+// Cost to the game of sending an 8 word message with addToSendBuf and sendUdpPacket
+void benchSendMessage(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 n = 0;
+
+  while (state->keepRunning())
+  {
+    for (Uint32 i = 0; i < 8; i++)
+      pair.host->addToSendBuf(n + i);
+
+    if (!sendUntimed(state, &pair))
+      break;
+
+    if (++n % 256 == 0)
+    {
+      state->pauseTiming();
+      pair.exchange();
+      drain(pair.client);
+      state->resumeTiming();
+    }
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  state->setBytesProcessed(state->getIterations() * 32);
+}
+
+// Cost to the game of writing an 8 word message into space reserved in the send window and committing it
+void benchWriterMessage(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 n = 0;
+
+  while (state->keepRunning())
+  {
+    char *buf = pair.host->reserve(32);
+    for (Uint32 i = 0; i < 8; i++)
+      SDLNet_Write32(n + i, &buf[i * 4]);
+
+    if (!sendUntimed(state, &pair))
+      break;
+
+    if (++n % 256 == 0)
+    {
+      state->pauseTiming();
+      pair.exchange();
+      drain(pair.client);
+      state->resumeTiming();
+    }
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  state->setBytesProcessed(state->getIterations() * 32);
+}
+
+// Cost of reading one 32 bit message with pullMessage
+void benchReceiveMessage(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 msg;
+
+  while (state->keepRunning())
+  {
+    if (!pair.client->pullMessage(&msg))
+    {
+      state->pauseTiming();
+      fillQueue(pair.client);
+      state->resumeTiming();
+
+      pair.client->pullMessage(&msg);
+    }
+
+    benchUse(msg);
+  }
+
+  state->setItemsProcessed(state->getIterations());
+}
+
+// Cost of draining up to 256 messages at once with pullMessages, reported per message
+void benchReceiveBatch(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 buf[256];
+  Uint64 items = 0;
+
+  while (state->keepRunning())
+  {
+    size_t num = pair.client->pullMessages(buf, 256);
+    if (num == 0)
+    {
+      state->pauseTiming();
+      fillQueue(pair.client);
+      state->resumeTiming();
+
+      num = pair.client->pullMessages(buf, 256);
+    }
+
+    items += num;
+    benchUse(buf[num - 1]);
+  }
+
+  state->setItemsProcessed(items);
+  state->setCounter("messages_per_call", state->getIterations() ? (double)items / state->getIterations() : 0);
+}
+
+// Whole path of an 8 word message on both sides, from addToSendBuf through the receive parsing to pullMessages
+// The client acknowledges every 32 messages, which is timed too
+// Parameters:
+// traceInterval - trace one packet in every traceInterval, 0 for none
+static void sendReceive(BenchState *state, Uint32 traceInterval)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  pair.host->setTracing(traceInterval);
+
+  Uint32 n = 0;
+  Uint64 received = 0;
+
+  while (state->keepRunning())
+  {
+    for (Uint32 i = 0; i < 8; i++)
+      pair.host->addToSendBuf(n + i);
+
+    if (!sendWaiting(&pair, pair.host))
+    {
+      state->skipWithError("send window stayed full");
+      break;
+    }
+
+    pair.clientManager.poll();
+    received += drain(pair.client);
+
+    if (++n % 32 == 0)
+    {
+      NetBenchmark::sendCheckPacket(pair.client);
+      pair.hostManager.poll();
+    }
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  state->setCounter("words_received", (double)received);
+
+  if (traceInterval)
+  {
+    NetTraceStats trace;
+    pair.client->getTraceStats(&trace);
+    state->setCounter("traced", (double)trace.traced);
+  }
+}
+
+void benchSendReceive(BenchState *state)
+{
+  sendReceive(state, 0);
+}
+
+// The same with every packet traced, the difference is the cost of tracing
+void benchSendReceiveTraced(BenchState *state)
+{
+  sendReceive(state, 1);
+}
+
+// Cost of building a check packet with nothing missing and handing it to the transport
+void benchCheckBuildIdle(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 n = 0;
+
+  while (state->keepRunning())
+  {
+    NetBenchmark::sendCheckPacket(pair.client);
+
+    // Keep the host's queue of packets from filling
+    if (++n % 1024 == 0)
+    {
+      state->pauseTiming();
+      BenchPair::pollAll(&pair.hostManager);
+      BenchPair::pollAll(&pair.clientManager);
+      state->resumeTiming();
+    }
+  }
+
+  state->setItemsProcessed(state->getIterations());
+}
+
+// Takes the next check packet the client sends to the host straight off the host's transport
+// Returns the number of missing ranges it lists, or -1 if none arrived
+static int captureCheckPacket(BenchPair *pair, UDPpacket *pack)
+{
+  NetSimConditions open;
+  memset(&open, 0, sizeof(open));
+  pair->network.setConditions(pair->clientManager.getPort(), &open);
+
+  // Throw away anything else waiting first
+  while (pair->hostTransport.receive(pack))
+    ;
+
+  NetBenchmark::sendCheckPacket(pair->client);
+  if (!pair->hostTransport.receive(pack))
+    return -1;
+
+  return (pack->len - 32) / 4;
+}
+
+// Cost of parsing a check packet with nothing missing, including the reply that carries the round trip time
+void benchCheckParseIdle(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  UDPpacket *pack = SDLNet_AllocPacket(NET_MAX_PACKET_SIZE);
+  if (captureCheckPacket(&pair, pack) < 0)
+  {
+    state->skipWithError("no check packet");
+    SDLNet_FreePacket(pack);
+    return;
+  }
+
+  Uint32 n = 0;
+
+  while (state->keepRunning())
+  {
+    NetBenchmark::handlePacket(pair.host, pack);
+
+    if (++n % 1024 == 0)
+    {
+      state->pauseTiming();
+      BenchPair::pollAll(&pair.clientManager);
+      state->resumeTiming();
+    }
+  }
+
+  state->setItemsProcessed(state->getIterations());
+  SDLNet_FreePacket(pack);
+}
+
+// Sends a burst of 1000 packets from the host with a fifth lost in bursts and none of the client's replies
+// getting back, so the client is missing packets in many ranges and the host has every packet unacknowledged
+// Returns 1 on success, 0 if the burst could not be sent
+static int sendLossyBurst(BenchPair *pair)
+{
+  NetSimConditions lossy;
+  memset(&lossy, 0, sizeof(lossy));
+  lossy.loss = 0.15f;
+  lossy.burstStart = 0.02f;
+  lossy.burstEnd = 0.3f;
+  lossy.burstLoss = 0.5f;
+
+  NetSimConditions blocked;
+  memset(&blocked, 0, sizeof(blocked));
+  blocked.loss = 1.0f;
+
+  pair->setConditions(&lossy, &blocked);
+  NetBenchmark::openWindow(pair->host);
+
+  for (Uint32 i = 0; i < 1000; i++)
+  {
+    pair->host->addToSendBuf(i);
+    if (!pair->host->sendUdpPacket())
+      return 0;
+  }
+
+  BenchPair::pollAll(&pair->clientManager);
+
+  return 1;
+}
+
+// Cost of building a check packet listing the ranges of packets missing after a burst with a fifth lost
+void benchCheckBuildLoss(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect() || !sendLossyBurst(&pair))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  UDPpacket *pack = SDLNet_AllocPacket(NET_MAX_PACKET_SIZE);
+  int ranges = captureCheckPacket(&pair, pack);
+  SDLNet_FreePacket(pack);
+
+  // The client's packets are lost again so they do not pile up at the host
+  NetSimConditions blocked;
+  memset(&blocked, 0, sizeof(blocked));
+  blocked.loss = 1.0f;
+  pair.network.setConditions(pair.clientManager.getPort(), &blocked);
+
+  while (state->keepRunning())
+    NetBenchmark::sendCheckPacket(pair.client);
+
+  state->setItemsProcessed(state->getIterations());
+  state->setCounter("ranges", ranges);
+}
+
+// Cost to the sender of parsing a check packet listing the ranges of packets missing after a burst with a fifth
+// lost, finding the missing packets in the send window and marking them to be resent
+void benchCheckParseLoss(BenchState *state)
+{
+  BenchPair pair;
+  if (!pair.connect() || !sendLossyBurst(&pair))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  UDPpacket *pack = SDLNet_AllocPacket(NET_MAX_PACKET_SIZE);
+  int ranges = captureCheckPacket(&pair, pack);
+  if (ranges < 0)
+  {
+    state->skipWithError("no check packet");
+    SDLNet_FreePacket(pack);
+    return;
+  }
+
+  Uint32 n = 0;
+
+  while (state->keepRunning())
+  {
+    NetBenchmark::handlePacket(pair.host, pack);
+
+    // Keep the client's queue of replies and resends from filling
+    if (++n % 1024 == 0)
+    {
+      state->pauseTiming();
+      BenchPair::pollAll(&pair.clientManager);
+      state->resumeTiming();
+    }
+  }
+
+  NetStats stats;
+  pair.host->getStats(&stats);
+
+  state->setItemsProcessed(state->getIterations());
+  state->setCounter("ranges", ranges);
+  state->setCounter("retransmits", (double)stats.retransmits);
+  SDLNet_FreePacket(pack);
+}
+
+// Reads the messages waiting at the client, checking they are the count up from expected
+// Parameters:
+// whole - if not 0, the size in words of the messages, every read that does not end on a message counts as an error
+// Returns the number of messages out of order and reads that ended part way through a message
+static Uint32 receiveCount(NetworkConnection *net, Uint32 *expected, Uint32 whole = 0)
+{
+  Uint32 errors = 0;
+
+  size_t num;
+  while ((num = net->pullMessages(drainBuf, BENCH_DRAIN_SIZE)) > 0)
+  {
+    for (size_t i = 0; i < num; i++)
+    {
+      if (drainBuf[i] != *expected)
+        errors++;
+      (*expected)++;
+    }
+
+    if (whole && *expected % whole != 0)
+      errors++;
+  }
+
+  return errors;
+}
+
+// Sets up a link with the given latency, 1 ms of jitter and the given loss, with some of the losses in bursts
+static void lossyLink(NetSimConditions *link, Uint32 latency, float loss)
+{
+  memset(link, 0, sizeof(*link));
+  link->latency = latency;
+  link->jitter = 1000;
+  link->loss = loss;
+  link->burstStart = loss / 10;
+  link->burstEnd = 0.3f;
+  link->burstLoss = 0.5f;
+}
+
+// Sends one message of the given size per iteration on the ordered channel over a link with 5 ms latency and the
+// given loss, timing the whole transfer until the last message arrives
+// Messages larger than a packet are sent in fragments and must arrive whole
+static void benchTransfer(BenchState *state, float loss, Uint32 words = 8)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  lossyLink(&link, 5000, loss);
+  pair.network.setConditions(&link);
+
+  if (!pair.connect() || !pair.host->setSendChannel(net_channel_reliableOrdered))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 sent = 0;
+  Uint32 expected = 0;
+  Uint32 errors = 0;
+
+  Uint32 whole = words > 8 ? words : 0;
+  Uint32 packets = words * 4 / (NET_MAX_PACKET_SIZE - NET_DATA_HEADER - 8) + 1;
+  Uint64 simStart = benchNow;
+
+  while (state->keepRunning())
+  {
+    if (!waitForRoom(&pair, pair.host, packets))
+    {
+      state->skipWithError("send window stayed full");
+      return;
+    }
+
+    for (Uint32 i = 0; i < words; i++)
+      pair.host->addToSendBuf(sent++);
+
+    if (!sendWaiting(&pair, pair.host))
+    {
+      state->skipWithError("send window stayed full");
+      return;
+    }
+
+    pair.poll();
+    errors += receiveCount(pair.client, &expected, whole);
+  }
+
+  // The transfer is done when the last message arrives
+  state->resumeTiming();
+  Uint32 start = netTicks();
+  while (expected < sent && netTicks() - start < BENCH_TIMEOUT)
+  {
+    pair.poll();
+    errors += receiveCount(pair.client, &expected, whole);
+  }
+  state->pauseTiming();
+
+  if (expected < sent)
+    state->skipWithError("transfer did not finish");
+
+  NetStats stats;
+  pair.host->getStats(&stats);
+
+  state->setItemsProcessed(state->getIterations());
+  state->setBytesProcessed(state->getIterations() * words * 4);
+  state->setCounter("loss_rate", stats.lossRate);
+  state->setCounter("retransmit_rate", stats.retransmitRate);
+  state->setCounter("rtt_p99_us", stats.rttP99);
+  state->setCounter("errors", errors);
+  state->setCounter("simulated_ms", (double)(benchNow - simStart) / 1000);
+}
+
+void benchTransferLoss5(BenchState *state)
+{
+  benchTransfer(state, 0.05f);
+}
+
+void benchTransferLoss20(BenchState *state)
+{
+  benchTransfer(state, 0.2f);
+}
+
+// 1024 word messages, split into 9 fragments each
+void benchTransferFragmented(BenchState *state)
+{
+  benchTransfer(state, 0.05f, 1024);
+}
+
+// Round trip of a message between two games blocked in readMessage, each woken by its network thread
+// Each iteration is two wakeups, with no latency on the simulated link
+void benchWakeup(BenchState *state)
+{
+  BenchPair pair(true);
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 msg = 0;
+  Uint32 reply;
+
+  while (state->keepRunning())
+  {
+    pair.host->addToSendBuf(msg);
+    if (!sendWaiting(&pair, pair.host) || !pair.client->readMessage(&reply, BENCH_TIMEOUT))
+    {
+      state->skipWithError("message did not arrive");
+      return;
+    }
+
+    pair.client->addToSendBuf(reply);
+    if (!sendWaiting(&pair, pair.client) || !pair.host->readMessage(&reply, BENCH_TIMEOUT) || reply != msg)
+    {
+      state->skipWithError("reply did not arrive");
+      return;
+    }
+
+    msg++;
+  }
+
+  state->setItemsProcessed(state->getIterations() * 2);
+}
+
+// Latencies of messages whose first word is the time they were sent
+struct BenchLatency {
+  Uint32 words;
+  Uint64 total;
+  Uint32 max;
+};
+
+// Runs the pair and reads the time stamped 4 word messages waiting at the client
+static void receiveStamped(BenchPair *pair, BenchLatency *latency)
+{
+  pair->poll();
+
+  size_t num = pair->client->pullMessages(drainBuf, BENCH_DRAIN_SIZE);
+  for (size_t i = 0; i < num; i++, latency->words++)
+  {
+    if (latency->words % 4 == 0)
+    {
+      Uint32 micros = (Uint32)netMicros() - drainBuf[i];
+      latency->total += micros;
+      if (micros > latency->max)
+        latency->max = micros;
+    }
+  }
+}
+
+// Sends a 4 word message stamped with the time every 250 us over a link with 1 ms latency, reporting how many
+// packets each message costs and how long messages take to arrive
+static void benchSendMode(BenchState *state, net_send_mode mode, Uint32 maxDelay)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  memset(&link, 0, sizeof(link));
+  link.latency = 1000;
+  pair.network.setConditions(&link);
+
+  if (!pair.connect() || !pair.host->setSendMode(mode, maxDelay))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  NetStats before;
+  pair.host->getStats(&before);
+
+  BenchLatency latency;
+  memset(&latency, 0, sizeof(latency));
+
+  Uint64 next = netMicros();
+  Uint32 sent = 0;
+
+  while (state->keepRunning())
+  {
+    while (netMicros() < next)
+      receiveStamped(&pair, &latency);
+    next += 250;
+
+    pair.host->addToSendBuf((Uint32)netMicros());
+    for (Uint32 i = 1; i < 4; i++)
+      pair.host->addToSendBuf(i);
+
+    if (!sendWaiting(&pair, pair.host))
+    {
+      state->skipWithError("send window stayed full");
+      return;
+    }
+
+    sent++;
+  }
+
+  // The run ends when the last message arrives
+  state->resumeTiming();
+  Uint32 start = netTicks();
+  while (latency.words < sent * 4 && netTicks() - start < BENCH_TIMEOUT)
+    receiveStamped(&pair, &latency);
+  state->pauseTiming();
+
+  if (latency.words < sent * 4)
+    state->skipWithError("messages did not arrive");
+
+  NetStats after;
+  pair.host->getStats(&after);
+
+  Uint32 messages = sent ? sent : 1;
+
+  state->setItemsProcessed(sent);
+  state->setCounter("packets_per_message", (double)(after.dataPacketsSent - before.dataPacketsSent) / messages);
+  state->setCounter("latency_avg_us", (double)latency.total / messages);
+  state->setCounter("latency_max_us", latency.max);
+}
+
+void benchSendImmediate(BenchState *state)
+{
+  benchSendMode(state, net_send_immediate, 0);
+}
+
+void benchSendCoalesce(BenchState *state)
+{
+  benchSendMode(state, net_send_coalesce, 5);
+}
+
+// Sends 480 byte messages as fast as the congestion controller allows through a 1 MB/s link with 20 ms latency
+// and 32 ms of queue, reporting the throughput reached, the round trip times and the packets lost
+void benchBottleneck(BenchState *state)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  memset(&link, 0, sizeof(link));
+  link.latency = 20000;
+  link.bandwidth = 1000000;
+  link.queueLimit = 32000;
+  pair.network.setConditions(&link);
+
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 sent = 0;
+  Uint32 expected = 0;
+  Uint32 errors = 0;
+
+  while (state->keepRunning())
+  {
+    for (Uint32 i = 0; i < 120; i++)
+      pair.host->addToSendBuf(sent++);
+
+    Uint32 start = netTicks();
+    while (!pair.host->sendUdpPacket())
+    {
+      if (netTicks() - start > BENCH_TIMEOUT)
+      {
+        state->skipWithError("send window stayed full");
+        return;
+      }
+
+      pair.poll();
+      errors += receiveCount(pair.client, &expected);
+    }
+
+    pair.poll();
+    errors += receiveCount(pair.client, &expected);
+  }
+
+  state->resumeTiming();
+  Uint32 start = netTicks();
+  while (expected < sent && netTicks() - start < BENCH_TIMEOUT)
+  {
+    pair.poll();
+    errors += receiveCount(pair.client, &expected);
+  }
+  state->pauseTiming();
+
+  if (expected < sent)
+    state->skipWithError("transfer did not finish");
+
+  NetStats stats;
+  pair.host->getStats(&stats);
+  NetSimStats simStats;
+  pair.network.getStats(&simStats);
+
+  state->setBytesProcessed(state->getIterations() * 480);
+  state->setCounter("rtt_p50_us", stats.rttP50);
+  state->setCounter("rtt_p99_us", stats.rttP99);
+  state->setCounter("retransmit_rate", stats.retransmitRate);
+  state->setCounter("queue_drops", (double)simStats.queueDrops);
+  state->setCounter("cwnd_bytes", pair.host->getCongestionWindow());
+  state->setCounter("errors", errors);
+}
+
+// Both sides send a 4 word message every 1 ms over a link with 5 ms latency, as a symmetric game does each tick,
+// reporting the datagrams sent per data packet, 1 when every acknowledgement rides on data
+void benchSymmetric(BenchState *state)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  memset(&link, 0, sizeof(link));
+  link.latency = 5000;
+  pair.network.setConditions(&link);
+
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  NetStats hostBefore, clientBefore;
+  pair.host->getStats(&hostBefore);
+  pair.client->getStats(&clientBefore);
+
+  Uint64 next = netMicros();
+  Uint32 tick = 0;
+
+  while (state->keepRunning())
+  {
+    while (netMicros() < next)
+    {
+      pair.poll();
+      drain(pair.host);
+      drain(pair.client);
+    }
+    next += 1000;
+
+    for (Uint32 i = 0; i < 4; i++)
+    {
+      pair.host->addToSendBuf(tick);
+      pair.client->addToSendBuf(tick);
+    }
+
+    if (!sendWaiting(&pair, pair.host) || !sendWaiting(&pair, pair.client))
+    {
+      state->skipWithError("send window stayed full");
+      return;
+    }
+
+    tick++;
+  }
+
+  NetStats hostAfter, clientAfter;
+  pair.host->getStats(&hostAfter);
+  pair.client->getStats(&clientAfter);
+
+  double datagrams = (double)(hostAfter.packetsSent - hostBefore.packetsSent)
+    + (clientAfter.packetsSent - clientBefore.packetsSent);
+  double data = (double)(hostAfter.dataPacketsSent - hostBefore.dataPacketsSent)
+    + (clientAfter.dataPacketsSent - clientBefore.dataPacketsSent);
+
+  state->setItemsProcessed(state->getIterations() * 2);
+  state->setCounter("datagrams_per_data_packet", data > 0 ? datagrams / data : 0);
+  state->setCounter("datagrams_per_second", datagrams * 1000 / (state->getIterations() ? state->getIterations() : 1));
+}
+
+// The whole of a message queue, so a sync benchmark's read always ends on a message
+static Uint32 syncBuf[NET_MESSAGE_QUEUE_SIZE];
+
+// The last snapshots sent, by tick, with the tick in the first field
+static Uint32 snapshotsSent[BENCH_SNAPSHOT_RING][BENCH_SNAPSHOT_FIELDS];
+
+// Reads the snapshots waiting at the client, checking each is the next one sent and matches it
+// Returns the number of snapshots that could not be read or did not match
+static Uint32 receiveSnapshots(NetworkConnection *net, SnapshotChannel *channel, Uint32 *received)
+{
+  static Uint32 fields[BENCH_SNAPSHOT_FIELDS];
+  Uint32 errors = 0;
+
+  size_t num = net->pullMessages(syncBuf, NET_MESSAGE_QUEUE_SIZE);
+  BitReader reader(syncBuf, num);
+
+  while (reader.wordsRead() < num)
+  {
+    if (!channel->read(&reader, fields))
+      return errors + 1;
+
+    if (fields[0] != *received || memcmp(fields, snapshotsSent[*received % BENCH_SNAPSHOT_RING], sizeof(fields)))
+      errors++;
+    (*received)++;
+  }
+
+  return errors;
+}
+
+// Sends a snapshot of 1024 fields with 16 of them changing every 10 ms tick on the ordered channel over a link with
+// 5 ms latency and 5% loss, reporting the bytes sent per tick, headers and resends included, against the size of
+// a full snapshot
+void benchSnapshot(BenchState *state)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  lossyLink(&link, 5000, 0.05f);
+  pair.network.setConditions(&link);
+
+  if (!pair.connect() || !pair.host->setSendChannel(net_channel_reliableOrdered))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  SnapshotChannel sender(BENCH_SNAPSHOT_FIELDS);
+  SnapshotChannel receiver(BENCH_SNAPSHOT_FIELDS);
+
+  Uint32 fields[BENCH_SNAPSHOT_FIELDS];
+  for (Uint32 i = 0; i < BENCH_SNAPSHOT_FIELDS; i++)
+    fields[i] = i * 2654435761u;
+
+  NetStats before;
+  pair.host->getStats(&before);
+
+  Uint64 next = netMicros();
+  Uint32 tick = 0;
+  Uint32 received = 0;
+  Uint32 errors = 0;
+
+  while (state->keepRunning())
+  {
+    while (netMicros() < next)
+    {
+      pair.poll();
+      errors += receiveSnapshots(pair.client, &receiver, &received);
+    }
+    next += BENCH_TICK_MICROS;
+
+    fields[0] = tick;
+    for (Uint32 i = 0; i < BENCH_SNAPSHOT_CHANGES; i++)
+      fields[1 + (tick * BENCH_SNAPSHOT_CHANGES + i) * 37 % (BENCH_SNAPSHOT_FIELDS - 1)] += i + 1;
+    memcpy(snapshotsSent[tick % BENCH_SNAPSHOT_RING], fields, sizeof(fields));
+
+    if (!sender.write(pair.host, fields) || !sendWaiting(&pair, pair.host))
+    {
+      state->skipWithError("send window stayed full");
+      return;
+    }
+
+    tick++;
+  }
+
+  state->resumeTiming();
+  Uint32 start = netTicks();
+  while (received < tick && netTicks() - start < BENCH_TIMEOUT)
+  {
+    pair.poll();
+    errors += receiveSnapshots(pair.client, &receiver, &received);
+  }
+  state->pauseTiming();
+
+  if (received < tick)
+    state->skipWithError("snapshots did not arrive");
+
+  NetStats after;
+  pair.host->getStats(&after);
+
+  double perTick = (double)(after.bytesSent - before.bytesSent) / (tick ? tick : 1);
+
+  state->setItemsProcessed(tick);
+  state->setCounter("bytes_per_tick", perTick);
+  state->setCounter("full_bytes", BENCH_SNAPSHOT_FIELDS * 4);
+  state->setCounter("ratio", perTick / (BENCH_SNAPSHOT_FIELDS * 4));
+  state->setCounter("errors", errors);
+}
+
+// A player in the input benchmark, whose game is a hash of every input it has run
+struct BenchPlayer {
+  InputSync *sync;
+  NetworkConnection *net;
+  bool host;
+  Uint32 added;
+  Uint32 stalls;
+
+  // The game after each tick, kept for the first maxTicks ticks to check against the partner's
+  Uint32 game;
+  Uint32 *games;
+  Uint32 maxTicks;
+  Uint32 ticks;
+
+  // Time from the partner adding each input to this side running the tick with it
+  Uint64 latencyTotal;
+  Uint32 latencyMax;
+  Uint32 latencyCount;
+};
+
+static void benchAdvance(Uint32 tick, const Uint32 *hostInput, const Uint32 *clientInput, void *userData)
+{
+  BenchPlayer *player = (BenchPlayer*)userData;
+
+  player->game = player->game * 31 + hostInput[1] * 7 + clientInput[1];
+  if (tick < player->maxTicks)
+    player->games[tick] = player->game;
+  player->ticks = tick + 1;
+
+  // Inputs are stamped with the time they were added, the ticks before the first input are run on zeros
+  const Uint32 *partner = player->host ? clientInput : hostInput;
+  if (partner[0])
+  {
+    Uint32 micros = (Uint32)netMicros() - partner[0];
+    player->latencyTotal += micros;
+    player->latencyCount++;
+    if (micros > player->latencyMax)
+      player->latencyMax = micros;
+  }
+}
+
+// Starts a player's next tick by adding its input, if the game is not waiting on the partner, and sends every
+// input the partner has not acknowledged
+// Returns 1 on success, 0 if the message could not be sent
+static int tickPlayer(BenchPair *pair, BenchPlayer *player, bool addInput)
+{
+  if (addInput)
+  {
+    Uint32 input[2] = {(Uint32)netMicros(), player->added * 2654435761u + player->host};
+    if (player->sync->addLocalInput(input))
+      player->added++;
+    else
+      player->stalls++;
+  }
+
+  return player->sync->write(player->net) && sendWaiting(pair, player->net);
+}
+
+// Reads the inputs waiting for a player and runs the ticks they complete
+// Returns 1 if a message could not be read, otherwise 0
+static Uint32 updatePlayer(BenchPlayer *player)
+{
+  size_t num = player->net->pullMessages(syncBuf, NET_MESSAGE_QUEUE_SIZE);
+  BitReader reader(syncBuf, num);
+
+  while (reader.wordsRead() < num)
+  {
+    if (!player->sync->read(&reader))
+      return 1;
+  }
+
+  player->sync->update();
+  return 0;
+}
+
+// Both players run a lockstep game with a 2 word input every 10 ms tick, sent on the unreliable channel over a link
+// with 20 ms latency and 10% loss, with the input delay from delayFor
+// Reports how many ticks pass from a player adding an input to the partner running the tick with it, which is at
+// least the input delay, against the one-way delay in ticks, along with the ticks a player had to wait
+void benchInputLatency(BenchState *state)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  lossyLink(&link, 20000, 0.1f);
+  pair.network.setConditions(&link);
+
+  if (!pair.connect())
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  // A few ticks of acknowledged traffic first so delayFor has round trips to go on
+  Uint64 next = netMicros();
+  for (Uint32 i = 0; i < 50; i++)
+  {
+    while (netMicros() < next)
+    {
+      pair.poll();
+      drain(pair.host);
+      drain(pair.client);
+    }
+    next += BENCH_TICK_MICROS;
+
+    pair.host->addToSendBuf(i);
+    pair.client->addToSendBuf(i);
+    if (!sendWaiting(&pair, pair.host) || !sendWaiting(&pair, pair.client))
+    {
+      state->skipWithError("send window stayed full");
+      return;
+    }
+  }
+
+  if (!pair.host->setSendChannel(net_channel_unreliableSequenced)
+    || !pair.client->setSendChannel(net_channel_unreliableSequenced))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 delay = InputSync::delayFor(pair.host, BENCH_TICK_MICROS);
+  Uint32 maxTicks = (Uint32)state->getIterations();
+
+  InputSync hostSync(2);
+  InputSync clientSync(2);
+  BenchPlayer players[2];
+  memset(players, 0, sizeof(players));
+
+  for (int i = 0; i < 2; i++)
+  {
+    BenchPlayer *player = &players[i];
+    player->sync = i == 0 ? &hostSync : &clientSync;
+    player->net = i == 0 ? pair.host : pair.client;
+    player->host = i == 0;
+    player->games = new Uint32[maxTicks];
+    player->maxTicks = maxTicks;
+
+    InputSyncCallbacks callbacks = {benchAdvance, NULL, NULL, player};
+    player->sync->setCallbacks(&callbacks);
+    player->sync->setInputDelay(delay);
+    player->sync->reset(player->host);
+  }
+
+  Uint32 errors = 0;
+  bool failed = false;
+
+  while (state->keepRunning() && !failed)
+  {
+    while (netMicros() < next)
+    {
+      pair.poll();
+      errors += updatePlayer(&players[0]) + updatePlayer(&players[1]);
+    }
+    next += BENCH_TICK_MICROS;
+
+    failed = !tickPlayer(&pair, &players[0], true) || !tickPlayer(&pair, &players[1], true);
+  }
+
+  // The game runs until every tick both players have an input for has been run on both sides
+  Uint32 target = (players[0].added < players[1].added ? players[0].added : players[1].added) + delay;
+  if (target > maxTicks)
+    target = maxTicks;
+
+  Uint32 start = netTicks();
+  while (!failed && (players[0].ticks < target || players[1].ticks < target) && netTicks() - start < BENCH_TIMEOUT)
+  {
+    while (netMicros() < next)
+    {
+      pair.poll();
+      errors += updatePlayer(&players[0]) + updatePlayer(&players[1]);
+    }
+    next += BENCH_TICK_MICROS;
+
+    failed = !tickPlayer(&pair, &players[0], false) || !tickPlayer(&pair, &players[1], false);
+  }
+
+  if (failed)
+    state->skipWithError("send window stayed full");
+  else if (players[0].ticks < target || players[1].ticks < target)
+    state->skipWithError("inputs did not arrive");
+
+  for (Uint32 tick = 0; tick < target; tick++)
+  {
+    if (players[0].games[tick] != players[1].games[tick])
+      errors++;
+  }
+
+  Uint32 count = players[0].latencyCount + players[1].latencyCount;
+  Uint32 latencyMax = players[0].latencyMax > players[1].latencyMax ? players[0].latencyMax : players[1].latencyMax;
+  double latency = count ? (double)(players[0].latencyTotal + players[1].latencyTotal) / count : 0;
+
+  state->setItemsProcessed(target);
+  state->setCounter("latency_avg_ticks", latency / BENCH_TICK_MICROS);
+  state->setCounter("latency_max_ticks", (double)latencyMax / BENCH_TICK_MICROS);
+  state->setCounter("input_delay_ticks", delay);
+  state->setCounter("one_way_ticks", (double)link.latency / BENCH_TICK_MICROS);
+  state->setCounter("stalls", players[0].stalls + players[1].stalls);
+  state->setCounter("errors", errors);
+
+  delete[] players[0].games;
+  delete[] players[1].games;
+}
+
+// Writes a side's waiting resync messages, sending packets as they fill, and reads the messages from the partner
+// Returns 1 on success, 0 if a packet could not be sent or a message could not be read
+static int runStateSync(BenchPair *pair, NetworkConnection *net, StateSync *sync)
+{
+  if (sync->hasPending())
+  {
+    while (sync->hasPending())
+    {
+      if (!sync->write(net))
+      {
+        if (!sendWaiting(pair, net) || !sync->write(net))
+          return 0;
+      }
+    }
+
+    if (!sendWaiting(pair, net))
+      return 0;
+  }
+
+  size_t num = net->pullMessages(syncBuf, NET_MESSAGE_QUEUE_SIZE);
+  BitReader reader(syncBuf, num);
+
+  while (reader.wordsRead() < num)
+  {
+    if (!sync->read(&reader))
+      return 0;
+  }
+
+  return 1;
+}
+
+// Repairs a 4 MB state in 256 word chunks after 3 words of the client's copy go wrong, over a link with 20 ms
+// latency and 5% loss on the ordered channel, reporting how long each resync takes in simulated time and how much
+// it sends against the size of the state
+void benchStateResync(BenchState *state)
+{
+  BenchPair pair;
+
+  NetSimConditions link;
+  lossyLink(&link, 20000, 0.05f);
+  pair.network.setConditions(&link);
+
+  if (!pair.connect() || !pair.host->setSendChannel(net_channel_reliableOrdered)
+    || !pair.client->setSendChannel(net_channel_reliableOrdered))
+  {
+    state->skipWithError("connection failed");
+    return;
+  }
+
+  Uint32 *hostState = new Uint32[BENCH_STATE_SYNC_WORDS];
+  Uint32 *clientState = new Uint32[BENCH_STATE_SYNC_WORDS];
+  for (Uint32 i = 0; i < BENCH_STATE_SYNC_WORDS; i++)
+    hostState[i] = clientState[i] = i * 2654435761u;
+
+  StateSync hostSync(hostState, BENCH_STATE_SYNC_WORDS, BENCH_STATE_SYNC_CHUNK);
+  StateSync clientSync(clientState, BENCH_STATE_SYNC_WORDS, BENCH_STATE_SYNC_CHUNK);
+  hostSync.setAuthority(true);
+
+  NetStats hostBefore, clientBefore;
+  pair.host->getStats(&hostBefore);
+  pair.client->getStats(&clientBefore);
+
+  Uint64 simTotal = 0;
+  Uint32 resyncs = 0;
+  Uint32 errors = 0;
+
+  while (state->keepRunning())
+  {
+    state->pauseTiming();
+    for (Uint32 i = 0; i < 3; i++)
+    {
+      Uint32 word = (resyncs * 3 + i) * 2654435761u % BENCH_STATE_SYNC_WORDS;
+      clientState[word] ^= resyncs + 1;
+      clientSync.markChanged(word, 1);
+    }
+    state->resumeTiming();
+
+    Uint64 simStart = benchNow;
+    Uint32 start = netTicks();
+    clientSync.startResync();
+
+    while (clientSync.resyncing())
+    {
+      if (netTicks() - start > BENCH_TIMEOUT)
+      {
+        state->skipWithError("resync did not finish");
+        break;
+      }
+
+      pair.poll();
+      if (!runStateSync(&pair, pair.host, &hostSync) || !runStateSync(&pair, pair.client, &clientSync))
+      {
+        state->skipWithError("resync messages could not be sent or read");
+        break;
+      }
+    }
+
+    simTotal += benchNow - simStart;
+    resyncs++;
+
+    if (clientSync.resyncing())
+      break;
+    if (memcmp(hostState, clientState, BENCH_STATE_SYNC_WORDS * 4))
+      errors++;
+  }
+
+  NetStats hostAfter, clientAfter;
+  pair.host->getStats(&hostAfter);
+  pair.client->getStats(&clientAfter);
+
+  double bytes = (double)(hostAfter.bytesSent - hostBefore.bytesSent) + (clientAfter.bytesSent - clientBefore.bytesSent);
+  Uint32 runs = resyncs ? resyncs : 1;
+
+  state->setItemsProcessed(resyncs);
+  state->setCounter("resync_ms", (double)simTotal / 1000 / runs);
+  state->setCounter("chunks_per_resync", (double)hostSync.getChunksSent() / runs);
+  state->setCounter("bytes_per_resync", bytes / runs);
+  state->setCounter("state_bytes", BENCH_STATE_SYNC_WORDS * 4);
+  state->setCounter("errors", errors);
+
+  delete[] hostState;
+  delete[] clientState;
+}
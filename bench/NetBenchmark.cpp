@@ -0,0 +1,405 @@
+/*
+  NetBenchmark: Microbenchmarks of the connection hot paths
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+
+#include "NetBenchmark.h"
+#include "NetHash.h"
+#include "SDL_net.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Most benchmarks in a run
+#define BENCH_MAX_RESULTS 64
+
+// Most iterations a timed benchmark is grown to
+#define BENCH_MAX_ITERATIONS 1000000000
+
+struct BenchEntry {
+  const char *name;
+  BenchFunction function;
+  Uint64 fixedIterations; // 0 to grow the iterations until the minimum time is reached
+};
+
+// Benchmarks in the order they are run and reported
+static const BenchEntry benchmarks[] = {
+  {"send/message_8w", benchSendMessage, 0},
+  {"send/writer_8w", benchWriterMessage, 0},
+  {"receive/pullMessage", benchReceiveMessage, 0},
+  {"receive/pullMessages_256", benchReceiveBatch, 0},
+  {"send_receive/message_8w", benchSendReceive, 0},
+  {"send_receive/message_8w_traced", benchSendReceiveTraced, 0},
+  {"check_packet/build_idle", benchCheckBuildIdle, 0},
+  {"check_packet/parse_idle", benchCheckParseIdle, 0},
+  {"check_packet/build_loss_20", benchCheckBuildLoss, 0},
+  {"check_packet/parse_loss_20", benchCheckParseLoss, 0},
+  {"transfer/loss_5", benchTransferLoss5, 5000},
+  {"transfer/loss_20", benchTransferLoss20, 5000},
+  {"transfer/ordered_fragmented_4KB_loss_5", benchTransferFragmented, 500},
+  {"wakeup/readMessage_round_trip", benchWakeup, 0},
+  {"send_mode/immediate", benchSendImmediate, 2000},
+  {"send_mode/coalesce_5ms", benchSendCoalesce, 2000},
+  {"congestion/bottleneck_1MBps", benchBottleneck, 2000},
+  {"piggyback/symmetric_1ms", benchSymmetric, 1000},
+  {"snapshot/delta_1024_fields_loss_5", benchSnapshot, 1000},
+  {"input_sync/lockstep_20ms_loss_10", benchInputLatency, 1000},
+  {"state_sync/resync_4MB_loss_5", benchStateResync, 20},
+  {"float/encodeFloat", benchFloatEncode, 0},
+  {"float/decodeFloat", benchFloatDecode, 0},
+  {"float/bits_lossless", benchFloatBits, 0},
+  {"float/bits_quantized_16", benchFloatQuantized, 0},
+  {"hash/words_4MB", benchHashWords, 0},
+  {"hash/state_tick_4MB", benchHashTick, 0},
+  {"compress/game_traffic", benchCompress, 0},
+  {"compress/game_traffic_dictionary", benchCompressDictionary, 0},
+  {"decompress/game_traffic_dictionary", benchDecompressDictionary, 0}
+};
+
+static volatile Uint32 benchSink;
+
+void benchUse(Uint32 value)
+{
+  benchSink += value;
+}
+
+static double cpuSeconds()
+{
+  return (double)clock() / CLOCKS_PER_SEC;
+}
+
+BenchState::BenchState(Uint64 iterations)
+{
+  this->iterations = iterations;
+  remaining = iterations;
+  started = false;
+  running = false;
+  start = 0;
+  elapsed = 0;
+  cpuStart = 0;
+  cpuElapsed = 0;
+  items = 0;
+  bytes = 0;
+  counterNum = 0;
+  error = NULL;
+}
+
+bool BenchState::keepRunning()
+{
+  if (!started)
+  {
+    started = true;
+    resumeTiming();
+  }
+
+  if (remaining > 0 && !error)
+  {
+    remaining--;
+    return true;
+  }
+
+  pauseTiming();
+  return false;
+}
+
+void BenchState::pauseTiming()
+{
+  if (!running)
+    return;
+
+  elapsed += SDL_GetPerformanceCounter() - start;
+  cpuElapsed += cpuSeconds() - cpuStart;
+  running = false;
+}
+
+void BenchState::resumeTiming()
+{
+  if (running)
+    return;
+
+  running = true;
+  cpuStart = cpuSeconds();
+  start = SDL_GetPerformanceCounter();
+}
+
+Uint64 BenchState::getIterations()
+{
+  return iterations;
+}
+
+void BenchState::setItemsProcessed(Uint64 items)
+{
+  this->items = items;
+}
+
+void BenchState::setBytesProcessed(Uint64 bytes)
+{
+  this->bytes = bytes;
+}
+
+void BenchState::setCounter(const char *name, double value)
+{
+  for (int i = 0; i < counterNum; i++)
+  {
+    if (strcmp(counterNames[i], name) == 0)
+    {
+      counterValues[i] = value;
+      return;
+    }
+  }
+
+  if (counterNum == BENCH_MAX_COUNTERS)
+    return;
+
+  counterNames[counterNum] = name;
+  counterValues[counterNum] = value;
+  counterNum++;
+}
+
+void BenchState::skipWithError(const char *message)
+{
+  error = message;
+}
+
+struct BenchResult {
+  const char *name;
+  Uint64 iterations;
+  double realTime; // ns per iteration
+  double cpuTime;
+  double itemsPerSecond;
+  double bytesPerSecond;
+  const char *counterNames[BENCH_MAX_COUNTERS];
+  double counterValues[BENCH_MAX_COUNTERS];
+  int counterNum;
+  const char *error;
+};
+
+class BenchRunner
+{
+public:
+  BenchRunner(double minTime)
+  {
+    this->minTime = minTime;
+    resultNum = 0;
+  }
+
+  // Runs a benchmark, growing its iterations until it runs for the minimum time unless they are fixed
+  BenchResult* run(const BenchEntry *entry)
+  {
+    Uint64 iterations = entry->fixedIterations ? entry->fixedIterations : 1;
+    double freq = (double)SDL_GetPerformanceFrequency();
+
+    for (;;)
+    {
+      BenchState state(iterations);
+      entry->function(&state);
+
+      double seconds = state.elapsed / freq;
+      if (entry->fixedIterations || state.error || seconds >= minTime || iterations >= BENCH_MAX_ITERATIONS)
+        return record(entry->name, &state, seconds);
+
+      // Aim a little past the minimum time so the next run is likely the last
+      double multiplier = seconds > 0 ? minTime * 1.4 / seconds : 10;
+      if (multiplier > 10 || seconds / minTime < 0.1)
+        multiplier = 10;
+
+      Uint64 next = (Uint64)(iterations * multiplier);
+      iterations = next > iterations ? next : iterations + 1;
+      if (iterations > BENCH_MAX_ITERATIONS)
+        iterations = BENCH_MAX_ITERATIONS;
+    }
+  }
+
+  void printConsole(const BenchResult *r)
+  {
+    if (r->error)
+    {
+      printf("%-40s ERROR: %s\n", r->name, r->error);
+      return;
+    }
+
+    printf("%-40s %14.1f ns %14.1f ns %12llu", r->name, r->realTime, r->cpuTime, (unsigned long long)r->iterations);
+    if (r->itemsPerSecond > 0)
+      printf(" items_per_second=%.4g", r->itemsPerSecond);
+    if (r->bytesPerSecond > 0)
+      printf(" bytes_per_second=%.4g", r->bytesPerSecond);
+    for (int i = 0; i < r->counterNum; i++)
+      printf(" %s=%.4g", r->counterNames[i], r->counterValues[i]);
+    printf("\n");
+    fflush(stdout);
+  }
+
+  void writeJson(FILE *file)
+  {
+    fprintf(file, "{\n");
+    fprintf(file, "  \"context\": {\n");
+    fprintf(file, "    \"num_cpus\": %d,\n", SDL_GetCPUCount());
+#ifdef NDEBUG
+    fprintf(file, "    \"library_build_type\": \"release\",\n");
+#else
+    fprintf(file, "    \"library_build_type\": \"debug\",\n");
+#endif
+    fprintf(file, "    \"hash_accelerated\": %s,\n", netHashAccelerated() ? "true" : "false");
+    fprintf(file, "    \"min_time\": %.3f\n", minTime);
+    fprintf(file, "  },\n");
+    fprintf(file, "  \"benchmarks\": [");
+
+    for (int i = 0; i < resultNum; i++)
+    {
+      const BenchResult *r = &results[i];
+
+      fprintf(file, "%s\n    {\n", i ? "," : "");
+      fprintf(file, "      \"name\": \"%s\",\n", r->name);
+      fprintf(file, "      \"run_name\": \"%s\",\n", r->name);
+      fprintf(file, "      \"run_type\": \"iteration\",\n");
+
+      if (r->error)
+      {
+        fprintf(file, "      \"error_occurred\": true,\n");
+        fprintf(file, "      \"error_message\": \"%s\"\n", r->error);
+        fprintf(file, "    }");
+        continue;
+      }
+
+      fprintf(file, "      \"iterations\": %llu,\n", (unsigned long long)r->iterations);
+      fprintf(file, "      \"real_time\": %.3f,\n", r->realTime);
+      fprintf(file, "      \"cpu_time\": %.3f,\n", r->cpuTime);
+      fprintf(file, "      \"time_unit\": \"ns\"");
+      if (r->itemsPerSecond > 0)
+        fprintf(file, ",\n      \"items_per_second\": %.6g", r->itemsPerSecond);
+      if (r->bytesPerSecond > 0)
+        fprintf(file, ",\n      \"bytes_per_second\": %.6g", r->bytesPerSecond);
+      for (int c = 0; c < r->counterNum; c++)
+        fprintf(file, ",\n      \"%s\": %.6g", r->counterNames[c], r->counterValues[c]);
+      fprintf(file, "\n    }");
+    }
+
+    fprintf(file, "\n  ]\n}\n");
+  }
+
+private:
+  double minTime;
+  BenchResult results[BENCH_MAX_RESULTS];
+  int resultNum;
+
+  BenchResult* record(const char *name, BenchState *state, double seconds)
+  {
+    BenchResult *r = &results[resultNum++];
+    Uint64 iterations = state->iterations ? state->iterations : 1;
+
+    r->name = name;
+    r->iterations = state->iterations;
+    r->realTime = seconds * 1e9 / iterations;
+    r->cpuTime = state->cpuElapsed * 1e9 / iterations;
+    r->itemsPerSecond = seconds > 0 ? state->items / seconds : 0;
+    r->bytesPerSecond = seconds > 0 ? state->bytes / seconds : 0;
+    r->counterNum = state->counterNum;
+    memcpy(r->counterNames, state->counterNames, sizeof(r->counterNames));
+    memcpy(r->counterValues, state->counterValues, sizeof(r->counterValues));
+    r->error = state->error;
+
+    return r;
+  }
+};
+
+int main(int argc, char *argv[])
+{
+  const char *filter = "";
+  const char *outFile = NULL;
+  bool json = false;
+  bool list = false;
+  double minTime = 0.5;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp(argv[i], "--benchmark_filter=", 19) == 0)
+      filter = argv[i] + 19;
+    else if (strcmp(argv[i], "--benchmark_format=json") == 0)
+      json = true;
+    else if (strcmp(argv[i], "--benchmark_format=console") == 0)
+      json = false;
+    else if (strncmp(argv[i], "--benchmark_out=", 16) == 0)
+      outFile = argv[i] + 16;
+    else if (strncmp(argv[i], "--benchmark_min_time=", 21) == 0)
+      minTime = atof(argv[i] + 21);
+    else if (strcmp(argv[i], "--benchmark_list_tests") == 0)
+      list = true;
+    else
+    {
+      fprintf(stderr, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  int num = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+  if (list)
+  {
+    for (int i = 0; i < num; i++)
+    {
+      if (strstr(benchmarks[i].name, filter))
+        printf("%s\n", benchmarks[i].name);
+    }
+    return 0;
+  }
+
+  if (SDL_Init(0) < 0 || SDLNet_Init() < 0)
+  {
+    fprintf(stderr, "Failed to initialise SDL: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  BenchRunner runner(minTime);
+
+  if (!json)
+    printf("%-40s %17s %17s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+
+  for (int i = 0; i < num; i++)
+  {
+    if (!strstr(benchmarks[i].name, filter))
+      continue;
+
+    BenchResult *r = runner.run(&benchmarks[i]);
+    if (!json)
+      runner.printConsole(r);
+  }
+
+  if (json)
+    runner.writeJson(stdout);
+
+  if (outFile)
+  {
+    FILE *file = fopen(outFile, "w");
+    if (!file)
+    {
+      fprintf(stderr, "Failed to open %s\n", outFile);
+      return 1;
+    }
+
+    runner.writeJson(file);
+    fclose(file);
+  }
+
+  SDLNet_Quit();
+  SDL_Quit();
+
+  return 0;
+}
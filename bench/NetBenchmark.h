@@ -0,0 +1,141 @@
+/*
+  NetBenchmark: Microbenchmarks of the connection hot paths
+  Copyright (C) 2015 Joshua Collins <joshwithguitar@gmail.com>
+
+  This software is provided 'as-is', without any express or implied
+  warranty.In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions :
+
+  1. The origin of this software must not be misrepresented; you must not
+  claim that you wrote the original software. If you use this software
+  in a product, an acknowledgment in the product documentation would be
+  appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+  misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+  */
+
+
+/*
+  A small benchmark runner in the style of Google Benchmark, so the suite builds with nothing beyond SDL.
+
+  Each benchmark is a function that sets up what it needs and then loops while keepRunning returns true, timing
+  only the loop. Most run with more iterations each time until they have run for the minimum time. Benchmarks of
+  whole transfers over a simulated network run a fixed number of iterations once, as each run takes a while and
+  what they report is mostly in their counters.
+
+  Results are printed as a table, or as JSON in the layout Google Benchmark uses so its compare tools can read
+  them. The JSON has the same fields in the same order every run and leaves out the date and host, so the
+  results of two commits can be diffed directly.
+
+  Command line options:
+  --benchmark_filter=<text> runs only the benchmarks whose names contain the text
+  --benchmark_format=<console|json> sets how results are printed
+  --benchmark_out=<file> also writes the results to a file as JSON
+  --benchmark_min_time=<seconds> sets the minimum time, 0.5 seconds by default
+  --benchmark_list_tests lists the benchmarks without running them
+  */
+
+#pragma once
+
+#include "SDL.h"
+
+// Most counters a benchmark can set
+#define BENCH_MAX_COUNTERS 8
+
+class BenchState
+{
+public:
+  // Parameters:
+  // iterations - the number of times the loop is run
+  BenchState(Uint64 iterations);
+
+  // Returns true while there are iterations left to run, the timer starts on the first call and stops on the last
+  bool keepRunning();
+
+  // Stops and restarts the timer around setup work inside the loop
+  void pauseTiming();
+  void resumeTiming();
+
+  // Returns the number of iterations in this run
+  Uint64 getIterations();
+
+  // Sets the number of items or bytes handled in the run, reported per second
+  void setItemsProcessed(Uint64 items);
+  void setBytesProcessed(Uint64 bytes);
+
+  // Sets a counter reported as it is, such as a ratio or a packet count
+  // Parameters:
+  // name - the counter's name, kept by the caller
+  // value - the counter's value
+  void setCounter(const char *name, double value);
+
+  // Marks the run as failed, so it is reported with the message instead of times
+  // Parameters:
+  // message - why it failed, kept by the caller
+  void skipWithError(const char *message);
+
+private:
+  Uint64 iterations;
+  Uint64 remaining;
+  bool started;
+  bool running;
+
+  // Times from the performance counter and the process CPU clock
+  Uint64 start;
+  Uint64 elapsed;
+  double cpuStart;
+  double cpuElapsed;
+
+  Uint64 items;
+  Uint64 bytes;
+  const char *counterNames[BENCH_MAX_COUNTERS];
+  double counterValues[BENCH_MAX_COUNTERS];
+  int counterNum;
+  const char *error;
+
+  friend class BenchRunner;
+};
+
+typedef void (*BenchFunction)(BenchState *state);
+
+// Keeps the compiler from optimising away a result that is otherwise unused
+void benchUse(Uint32 value);
+
+// Connection benchmarks, in BenchConnection.cpp
+void benchSendMessage(BenchState *state);
+void benchReceiveMessage(BenchState *state);
+void benchReceiveBatch(BenchState *state);
+void benchSendReceive(BenchState *state);
+void benchSendReceiveTraced(BenchState *state);
+void benchWriterMessage(BenchState *state);
+void benchCheckBuildIdle(BenchState *state);
+void benchCheckParseIdle(BenchState *state);
+void benchCheckBuildLoss(BenchState *state);
+void benchCheckParseLoss(BenchState *state);
+void benchTransferLoss5(BenchState *state);
+void benchTransferLoss20(BenchState *state);
+void benchTransferFragmented(BenchState *state);
+void benchWakeup(BenchState *state);
+void benchSendImmediate(BenchState *state);
+void benchSendCoalesce(BenchState *state);
+void benchBottleneck(BenchState *state);
+void benchSymmetric(BenchState *state);
+void benchSnapshot(BenchState *state);
+void benchInputLatency(BenchState *state);
+void benchStateResync(BenchState *state);
+
+// Encoding, hashing and compression benchmarks, in BenchCodec.cpp
+void benchFloatEncode(BenchState *state);
+void benchFloatDecode(BenchState *state);
+void benchFloatBits(BenchState *state);
+void benchFloatQuantized(BenchState *state);
+void benchHashWords(BenchState *state);
+void benchHashTick(BenchState *state);
+void benchCompress(BenchState *state);
+void benchCompressDictionary(BenchState *state);
+void benchDecompressDictionary(BenchState *state);